@@ -0,0 +1,810 @@
+/**
+ * @file imgfs_bench.c
+ * @brief Micro-benchmarks for the imgFS core library.
+ *
+ * Usage: imgfs_bench <benchmark> [ARGUMENTS]
+ *
+ * Every benchmark works on a scratch imgFS file which is (re)created
+ * from scratch, so never point it to a store you care about.
+ */
+
+#include "imgfs.h"
+#include "image_content.h"
+#include "imgfs_blobs.h"
+#include "imgfs_durability.h"
+#include "imgfs_index.h"
+#include "imgfs_rcu.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_wal.h"
+#include "util.h"
+#include <vips/vips.h>
+
+#include <inttypes.h> // for PRIu64
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h> // for struct rusage
+#include <sys/wait.h> // for wait4
+#include <time.h>
+#include <unistd.h>   // for sysconf, fork
+
+/**
+ * @brief Signature of a benchmark, same convention as the imgfscmd commands.
+ */
+typedef int (*benchmark) (int argc, char* argv[]);
+
+typedef struct {
+    const char* name;
+    benchmark func;
+    const char* usage;
+} benchmark_mapping;
+
+/********************************************************************
+ * Wall-clock time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/********************************************************************
+ * Loads a whole file in memory, keeping extra_bytes of room at the end.
+ */
+static int load_file(const char* path, size_t extra_bytes, char** buffer, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+
+    fseek(file, 0, SEEK_END);
+    const long file_size = ftell(file);
+    rewind(file);
+    if (file_size <= 0) {
+        fclose(file);
+        return ERR_IO;
+    }
+
+    *buffer = calloc((size_t) file_size + extra_bytes, 1);
+    if (*buffer == NULL) {
+        fclose(file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const size_t read = fread(*buffer, 1, (size_t) file_size, file);
+    fclose(file);
+    if (read != (size_t) file_size) {
+        free(*buffer);
+        *buffer = NULL;
+        return ERR_IO;
+    }
+
+    *size = (size_t) file_size;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Creates an empty scratch store able to hold max_files images.
+ */
+static int create_store(const char* path, uint32_t max_files)
+{
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    imgfs_file.header.max_files = max_files;
+    imgfs_file.header.resized_res[2 * THUMB_RES]     = 64;
+    imgfs_file.header.resized_res[2 * THUMB_RES + 1] = 64;
+    imgfs_file.header.resized_res[2 * SMALL_RES]     = 256;
+    imgfs_file.header.resized_res[2 * SMALL_RES + 1] = 256;
+
+    const int err = do_create(path, &imgfs_file);
+    do_close(&imgfs_file);
+    return err;
+}
+
+/********************************************************************
+ * Inserts count distinct copies of a JPEG (a counter is appended after
+ * its end marker, which decoders ignore, so every copy has its own SHA).
+ */
+static int ingest(const char* store, char* jpeg, size_t jpeg_size,
+                  uint32_t count, int with_index, double* seconds)
+{
+    int err = create_store(store, count);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    err = do_open(store, "rb+", &imgfs_file);
+    if (err != ERR_NONE) return err;
+    if (!with_index) index_free(&imgfs_file);
+
+    char img_id[MAX_IMG_ID + 1];
+    const double start = now();
+    for (uint32_t i = 0; i < count && err == ERR_NONE; ++i) {
+        memcpy(jpeg + jpeg_size, &i, sizeof(i));
+        snprintf(img_id, sizeof(img_id), "img%08u", i);
+        err = do_insert(jpeg, jpeg_size + sizeof(i), img_id, &imgfs_file);
+    }
+    *seconds = now() - start;
+
+    do_close(&imgfs_file);
+    return err;
+}
+
+/********************************************************************
+ * ingest <scratch_imgFS> <jpeg> [count]
+ */
+static int bench_ingest(int argc, char* argv[])
+{
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const uint32_t count = argc > 2 ? atouint32(argv[2]) : 100000;
+    if (count == 0) return ERR_INVALID_ARGUMENT;
+
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = load_file(argv[1], sizeof(uint32_t), &jpeg, &jpeg_size);
+    if (err != ERR_NONE) return err;
+
+    double linear = 0.0, indexed = 0.0;
+    err = ingest(argv[0], jpeg, jpeg_size, count, 0, &linear);
+    if (err == ERR_NONE) err = ingest(argv[0], jpeg, jpeg_size, count, 1, &indexed);
+    free(jpeg);
+    if (err != ERR_NONE) return err;
+
+    printf("ingest of %u images:\n", count);
+    printf("  linear scan: %9.3f s (%10.1f inserts/s)\n", linear, count / linear);
+    printf("  hash index : %9.3f s (%10.1f inserts/s)\n", indexed, count / indexed);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * For qsort(): latencies in increasing order.
+ */
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/********************************************************************
+ * Inserts count distinct copies of a JPEG under a durability policy
+ * (in WAL mode if with_wal), and prints the throughput and the latency
+ * of the insertions.
+ */
+static int durable_ingest(const char* store, char* jpeg, size_t jpeg_size, uint32_t count,
+                          const char* name, enum durability_mode mode, int with_wal, double* latencies)
+{
+    int err = create_store(store, count);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    err = do_open(store, "rb+", &imgfs_file);
+    if (err == ERR_NONE && with_wal) err = wal_start(&imgfs_file, store);
+    if (err == ERR_NONE) err = durability_start(&imgfs_file, mode, DURABILITY_DEFAULT_INTERVAL_MS);
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        return err;
+    }
+
+    char img_id[MAX_IMG_ID + 1];
+    const double start = now();
+    for (uint32_t i = 0; i < count && err == ERR_NONE; ++i) {
+        memcpy(jpeg + jpeg_size, &i, sizeof(i));
+        snprintf(img_id, sizeof(img_id), "img%08u", i);
+        const double before = now();
+        err = do_insert(jpeg, jpeg_size + sizeof(i), img_id, &imgfs_file);
+        latencies[i] = now() - before;
+    }
+    const double seconds = now() - start;
+    do_close(&imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    printf("  %-10s %10.1f inserts/s   latency (us): p50 %8.1f  p99 %8.1f  max %8.1f\n",
+           name, count / seconds, latencies[count / 2] * 1e6,
+           latencies[(size_t) count * 99 / 100] * 1e6, latencies[count - 1] * 1e6);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * durability <scratch_imgFS> <jpeg> [count]
+ */
+static int bench_durability(int argc, char* argv[])
+{
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const uint32_t count = argc > 2 ? atouint32(argv[2]) : 2000;
+    if (count == 0) return ERR_INVALID_ARGUMENT;
+
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = load_file(argv[1], sizeof(uint32_t), &jpeg, &jpeg_size);
+    if (err != ERR_NONE) return err;
+    double* latencies = calloc(count, sizeof(double));
+    if (latencies == NULL) {
+        free(jpeg);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    printf("%u inserts, one at a time:\n", count);
+    err = durable_ingest(argv[0], jpeg, jpeg_size, count, "none", DURABILITY_NONE, 0, latencies);
+    if (err == ERR_NONE) {
+        err = durable_ingest(argv[0], jpeg, jpeg_size, count, "batched", DURABILITY_BATCHED, 0, latencies);
+    }
+    if (err == ERR_NONE) {
+        err = durable_ingest(argv[0], jpeg, jpeg_size, count, "sync", DURABILITY_PER_OP, 0, latencies);
+    }
+    if (err == ERR_NONE) {
+        err = durable_ingest(argv[0], jpeg, jpeg_size, count, "sync + WAL", DURABILITY_PER_OP, 1, latencies);
+    }
+    free(latencies);
+    free(jpeg);
+    return err;
+}
+
+/********************************************************************
+ * A client of the wal benchmark: inserts, then deletes, its share of the
+ * images, the way the server does (one lock for the store).
+ */
+struct wal_client {
+    struct imgfs_file* imgfs_file;
+    pthread_mutex_t* lock;
+    pthread_barrier_t* barrier;
+    const int* cancelled; // set, under the lock, when not all the clients could start
+    char* jpeg;        // its own copy, with room for the counter
+    size_t jpeg_size;
+    uint32_t first;
+    uint32_t count;
+    int err;
+};
+
+/********************************************************************
+ * Makes the last operation durable: through the log if in WAL mode,
+ * otherwise by syncing the whole file, with the lock still held.
+ */
+static int wal_client_commit(struct wal_client* client)
+{
+    if (!wal_active(client->imgfs_file)) {
+        const int err = blobs_sync(client->imgfs_file->file);
+        pthread_mutex_unlock(client->lock);
+        return err;
+    }
+    const uint64_t position = wal_position(client->imgfs_file);
+    pthread_mutex_unlock(client->lock);
+    return wal_sync(client->imgfs_file, position);
+}
+
+static void* wal_client_run(void* arg)
+{
+    struct wal_client* client = arg;
+    char img_id[MAX_IMG_ID + 1];
+
+    // the clients only go once all of them were started
+    pthread_mutex_lock(client->lock);
+    const int cancelled = *client->cancelled;
+    pthread_mutex_unlock(client->lock);
+    if (cancelled) return NULL;
+
+    pthread_barrier_wait(client->barrier);
+    for (uint32_t i = client->first; i < client->first + client->count && client->err == ERR_NONE; ++i) {
+        memcpy(client->jpeg + client->jpeg_size, &i, sizeof(i));
+        snprintf(img_id, sizeof(img_id), "img%08u", i);
+        pthread_mutex_lock(client->lock);
+        client->err = do_insert(client->jpeg, client->jpeg_size + sizeof(i), img_id, client->imgfs_file);
+        if (client->err != ERR_NONE) {
+            pthread_mutex_unlock(client->lock);
+        } else {
+            client->err = wal_client_commit(client);
+        }
+    }
+
+    pthread_barrier_wait(client->barrier);
+    for (uint32_t i = client->first; i < client->first + client->count && client->err == ERR_NONE; ++i) {
+        snprintf(img_id, sizeof(img_id), "img%08u", i);
+        pthread_mutex_lock(client->lock);
+        client->err = do_delete(img_id, client->imgfs_file);
+        if (client->err != ERR_NONE) {
+            pthread_mutex_unlock(client->lock);
+        } else {
+            client->err = wal_client_commit(client);
+        }
+    }
+    pthread_barrier_wait(client->barrier);
+    return NULL;
+}
+
+/********************************************************************
+ * Inserts then deletes count images with durable operations, from
+ * nb_clients threads, and times both phases.
+ */
+static int durable_churn(const char* store, const char* jpeg, size_t jpeg_size, uint32_t count,
+                         uint32_t nb_clients, int with_wal, double* insert_seconds, double* delete_seconds)
+{
+    int err = create_store(store, count);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    err = do_open(store, "rb+", &imgfs_file);
+    if (err == ERR_NONE && with_wal) err = wal_start(&imgfs_file, store);
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        return err;
+    }
+
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nb_clients + 1);
+    struct wal_client* clients = calloc(nb_clients, sizeof(struct wal_client));
+    pthread_t* threads = calloc(nb_clients, sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) err = ERR_OUT_OF_MEMORY;
+
+    int cancelled = 0;
+    pthread_mutex_lock(&lock);
+    uint32_t started = 0;
+    for (; started < nb_clients && err == ERR_NONE; ++started) {
+        struct wal_client* client = &clients[started];
+        client->imgfs_file = &imgfs_file;
+        client->lock = &lock;
+        client->barrier = &barrier;
+        client->cancelled = &cancelled;
+        client->jpeg_size = jpeg_size;
+        client->first = started * (count / nb_clients);
+        client->count = started + 1 == nb_clients ? count - client->first : count / nb_clients;
+        client->jpeg = malloc(jpeg_size + sizeof(uint32_t));
+        if (client->jpeg == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        memcpy(client->jpeg, jpeg, jpeg_size);
+        if (pthread_create(&threads[started], NULL, wal_client_run, client) != 0) {
+            free(client->jpeg);
+            err = ERR_THREADING;
+            break;
+        }
+    }
+
+    // the barrier could not be passed without all the clients: the started ones give up
+    cancelled = err != ERR_NONE;
+    pthread_mutex_unlock(&lock);
+
+    if (err == ERR_NONE) {
+        pthread_barrier_wait(&barrier);
+        const double start = now();
+        pthread_barrier_wait(&barrier);
+        const double middle = now();
+        pthread_barrier_wait(&barrier);
+        *insert_seconds = middle - start;
+        *delete_seconds = now() - middle;
+    }
+
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+        if (clients[i].err != ERR_NONE) err = clients[i].err;
+        free(clients[i].jpeg);
+    }
+    free(threads);
+    free(clients);
+    pthread_barrier_destroy(&barrier);
+    do_close(&imgfs_file);
+    return err;
+}
+
+/********************************************************************
+ * wal <scratch_imgFS> <jpeg> [count] [clients]
+ */
+static int bench_wal(int argc, char* argv[])
+{
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const uint32_t count = argc > 2 ? atouint32(argv[2]) : 2000;
+    const uint32_t nb_clients = argc > 3 ? atouint32(argv[3]) : 8;
+    if (count == 0 || nb_clients == 0 || nb_clients > count) return ERR_INVALID_ARGUMENT;
+
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = load_file(argv[1], 0, &jpeg, &jpeg_size);
+    if (err != ERR_NONE) return err;
+
+    double in_place[2] = { 0.0, 0.0 }, logged[2] = { 0.0, 0.0 };
+    err = durable_churn(argv[0], jpeg, jpeg_size, count, nb_clients, 0, &in_place[0], &in_place[1]);
+    if (err == ERR_NONE) err = durable_churn(argv[0], jpeg, jpeg_size, count, nb_clients, 1, &logged[0], &logged[1]);
+    free(jpeg);
+    if (err != ERR_NONE) return err;
+
+    printf("%u durable inserts then deletes, %u clients:\n", count, nb_clients);
+    printf("  in place, fdatasync per operation: %10.1f inserts/s %10.1f deletes/s\n",
+           count / in_place[0], count / in_place[1]);
+    printf("  WAL, group commit                : %10.1f inserts/s %10.1f deletes/s\n",
+           count / logged[0], count / logged[1]);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * How the readers of the readers benchmark reach the store.
+ */
+enum read_model {
+    READ_MUTEX,   // always the lock, exclusively
+    READ_RWLOCK,  // the lock, shared when the read changes nothing
+    READ_SNAPSHOT // no lock, from the snapshot, as the server does
+};
+
+/********************************************************************
+ * A thread of the readers benchmark: reads random images, the way of
+ * its model.
+ */
+struct read_client {
+    struct imgfs_file* imgfs_file;
+    pthread_rwlock_t* lock;
+    enum read_model model;
+    uint32_t nb_images;
+    const struct imgfs_snapshot* snapshot;
+    const atomic_int* stop;
+    uint64_t reads;
+    uint64_t checksum; // of the bytes read, so that they are read indeed
+    int err;
+};
+
+static void* read_client_run(void* arg)
+{
+    struct read_client* client = arg;
+    unsigned int seed = (unsigned int) (uintptr_t) client;
+    char img_id[MAX_IMG_ID + 1];
+
+    while (!atomic_load(client->stop) && client->err == ERR_NONE) {
+        snprintf(img_id, sizeof(img_id), "img%08u", (uint32_t) rand_r(&seed) % client->nb_images);
+        const char* image = NULL;
+        uint32_t size = 0;
+        int done = 0;
+        if (client->model == READ_SNAPSHOT) {
+            client->err = rcu_read_enter();
+            if (client->err != ERR_NONE) break;
+            client->err = snapshot_read_view(client->snapshot, img_id, ORIG_RES, &image, &size, &done);
+            if (!done) rcu_read_exit();
+        }
+        if (!done) {
+            if (client->model == READ_RWLOCK) {
+                pthread_rwlock_rdlock(client->lock);
+                client->err = do_read_view_shared(img_id, ORIG_RES, &image, &size, client->imgfs_file, &done);
+                if (!done) pthread_rwlock_unlock(client->lock);
+            }
+            if (!done) {
+                pthread_rwlock_wrlock(client->lock);
+                client->err = index_finish_scan(client->imgfs_file);
+                if (client->err == ERR_NONE) {
+                    if (client->model == READ_SNAPSHOT) (void) snapshot_build(client->imgfs_file);
+                    client->err = do_read_view(img_id, ORIG_RES, &image, &size, client->imgfs_file);
+                }
+            }
+            // the bytes stay in place during a read section, as with the lock
+            if (client->model == READ_SNAPSHOT) (void) rcu_read_enter();
+            pthread_rwlock_unlock(client->lock);
+        }
+
+        // the server sends the bytes without the lock: so does the client
+        for (uint32_t i = 0; client->err == ERR_NONE && i < size; i += 64) {
+            client->checksum += (unsigned char) image[i];
+        }
+        if (client->model == READ_SNAPSHOT) rcu_read_exit();
+        client->reads++;
+    }
+    return NULL;
+}
+
+/********************************************************************
+ * The writer of the readers benchmark: one insertion per millisecond.
+ */
+struct write_client {
+    struct imgfs_file* imgfs_file;
+    pthread_rwlock_t* lock;
+    char* jpeg;        // with room for the counter
+    size_t jpeg_size;
+    uint32_t next;     // counter of the next image
+    const atomic_int* stop;
+    uint64_t inserts;
+    int err;
+};
+
+static void* write_client_run(void* arg)
+{
+    struct write_client* client = arg;
+    char img_id[MAX_IMG_ID + 1];
+    const struct timespec pause = { 0, 1000000L };
+
+    while (!atomic_load(client->stop) && client->err == ERR_NONE) {
+        memcpy(client->jpeg + client->jpeg_size, &client->next, sizeof(client->next));
+        snprintf(img_id, sizeof(img_id), "img%08u", client->next);
+        pthread_rwlock_wrlock(client->lock);
+        client->err = do_insert(client->jpeg, client->jpeg_size + sizeof(client->next), img_id,
+                                client->imgfs_file);
+        pthread_rwlock_unlock(client->lock);
+        if (client->err == ERR_IMGFS_FULL) {
+            client->err = ERR_NONE;
+            break;
+        }
+        client->next++;
+        client->inserts++;
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/********************************************************************
+ * Runs nb_readers readers and the writer for some time, and gives the
+ * number of reads per second.
+ */
+static int read_while_inserting(struct imgfs_file* imgfs_file, struct write_client* writer,
+                                uint32_t nb_images, uint32_t nb_readers, enum read_model model,
+                                double seconds, double* reads_per_second)
+{
+    pthread_rwlock_t lock;
+    pthread_rwlock_init(&lock, NULL);
+    atomic_int stop = 0;
+    struct read_client* readers = calloc(nb_readers, sizeof(struct read_client));
+    pthread_t* threads = calloc(nb_readers + 1, sizeof(pthread_t));
+    if (readers == NULL || threads == NULL) {
+        free(readers);
+        free(threads);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    writer->lock = &lock;
+    writer->stop = &stop;
+    uint32_t started = 0;
+    const int writing = pthread_create(&threads[0], NULL, write_client_run, writer) == 0;
+    int err = writing ? ERR_NONE : ERR_THREADING;
+    const double start = now();
+    for (; err == ERR_NONE && started < nb_readers; ++started) {
+        readers[started] = (struct read_client) {
+            imgfs_file, &lock, model, nb_images, snapshot_of(imgfs_file), &stop, 0, 0, ERR_NONE
+        };
+        if (pthread_create(&threads[started + 1], NULL, read_client_run, &readers[started]) != 0) {
+            err = ERR_THREADING;
+            break;
+        }
+    }
+
+    const struct timespec duration = { (time_t) seconds, (long) ((seconds - (double) (time_t) seconds) * 1e9) };
+    if (err == ERR_NONE) nanosleep(&duration, NULL);
+    atomic_store(&stop, 1);
+
+    uint64_t reads = 0;
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(threads[i + 1], NULL);
+        reads += readers[i].reads;
+        if (readers[i].err != ERR_NONE) err = readers[i].err;
+    }
+    const double elapsed = now() - start;
+    if (writing) {
+        pthread_join(threads[0], NULL);
+        if (writer->err != ERR_NONE) err = writer->err;
+    }
+    *reads_per_second = (double) reads / elapsed;
+
+    free(readers);
+    free(threads);
+    pthread_rwlock_destroy(&lock);
+    return err;
+}
+
+/********************************************************************
+ * readers <scratch_imgFS> <jpeg> [count] [seconds]
+ */
+static int bench_readers(int argc, char* argv[])
+{
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const uint32_t count = argc > 2 ? atouint32(argv[2]) : 1000;
+    const double seconds = argc > 3 ? (double) atouint32(argv[3]) : 1.0;
+    if (count == 0 || seconds <= 0.0) return ERR_INVALID_ARGUMENT;
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint32_t max_readers = (uint32_t) MAX(cores, 1L);
+
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = load_file(argv[1], sizeof(uint32_t), &jpeg, &jpeg_size);
+    if (err != ERR_NONE) return err;
+
+    // room for the writer to insert during every run
+    double unused = 0.0;
+    err = ingest(argv[0], jpeg, jpeg_size, count, 1, &unused);
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    if (err == ERR_NONE) err = do_open_lazy(argv[0], "rb+", &imgfs_file);
+    if (err == ERR_NONE) err = do_grow(count + 100000, &imgfs_file);
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        free(jpeg);
+        return err;
+    }
+
+    struct write_client writer;
+    zero_init_var(writer);
+    writer.imgfs_file = &imgfs_file;
+    writer.jpeg = jpeg;
+    writer.jpeg_size = jpeg_size;
+    writer.next = count;
+
+    printf("random reads of %u images, with one insertion per ms meanwhile (reads/s):\n", count);
+    printf("  %7s %12s %12s %12s\n", "readers", "mutex", "rwlock", "snapshot");
+    for (uint32_t nb_readers = 1; err == ERR_NONE && nb_readers <= max_readers; nb_readers *= 2) {
+        double rates[READ_SNAPSHOT + 1] = { 0.0 };
+        for (int model = READ_MUTEX; err == ERR_NONE && model <= READ_SNAPSHOT; ++model) {
+            err = read_while_inserting(&imgfs_file, &writer, count, nb_readers, (enum read_model) model,
+                                       seconds, &rates[model]);
+        }
+        if (err == ERR_NONE) {
+            printf("  %7u %12.0f %12.0f %12.0f\n", nb_readers,
+                   rates[READ_MUTEX], rates[READ_RWLOCK], rates[READ_SNAPSHOT]);
+        }
+    }
+    if (err == ERR_NONE) printf("  (%" PRIu64 " insertions in all)\n", writer.inserts);
+
+    do_close(&imgfs_file);
+    free(jpeg);
+    return err;
+}
+
+#define RESIZE_RUNS 5
+#define RESIZE_THUMB_RES 64  // as imgfscmd create by default
+#define RESIZE_SMALL_RES 256
+
+/********************************************************************
+ * Computes the given variants of a JPEG (none if resolutions is 0) in a
+ * child process, so that its peak memory is its own, and gives its CPU
+ * time (user and system, in ms) and peak resident size (in KiB). The
+ * parent never runs libvips itself, so it has no thread to lose in fork().
+ */
+static int measure_resize(char* jpeg, size_t jpeg_size, unsigned int resolutions,
+                          enum resize_mode mode, double* cpu_ms, long* peak_kib)
+{
+    fflush(stdout);
+    const pid_t child = fork();
+    if (child < 0) return ERR_RUNTIME;
+    if (child == 0) {
+        int err = ERR_NONE;
+        if (resolutions != 0) {
+            struct resize_job job;
+            zero_init_var(job);
+            job.resolutions = resolutions;
+            job.mode = mode;
+            job.width[THUMB_RES] = job.height[THUMB_RES] = RESIZE_THUMB_RES;
+            job.width[SMALL_RES] = job.height[SMALL_RES] = RESIZE_SMALL_RES;
+            job.original = jpeg;
+            job.original_size = jpeg_size;
+            err = resize_encode(&job);
+            job.original = NULL; // not ours
+            resize_release(&job);
+        }
+        _exit(err == ERR_NONE ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child || !WIFEXITED(status)
+        || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return ERR_IMGLIB;
+    }
+    *cpu_ms = (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3
+              + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-3;
+    *peak_kib = usage.ru_maxrss;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Median CPU time and peak memory of RESIZE_RUNS resizes, less those of
+ * a child process that computes nothing.
+ */
+static int median_resize(char* jpeg, size_t jpeg_size, unsigned int resolutions, enum resize_mode mode,
+                         double* cpu_ms, long* peak_kib)
+{
+    double cpu[RESIZE_RUNS];
+    double peak[RESIZE_RUNS];
+    for (int run = 0; run < RESIZE_RUNS; ++run) {
+        double idle_cpu = 0.0, busy_cpu = 0.0;
+        long idle_peak = 0, busy_peak = 0;
+        int err = measure_resize(jpeg, jpeg_size, 0, mode, &idle_cpu, &idle_peak);
+        if (err == ERR_NONE) err = measure_resize(jpeg, jpeg_size, resolutions, mode, &busy_cpu, &busy_peak);
+        if (err != ERR_NONE) return err;
+        cpu[run] = MAX(busy_cpu - idle_cpu, 0.0);
+        peak[run] = (double) MAX(busy_peak - idle_peak, 0L);
+    }
+    qsort(cpu, RESIZE_RUNS, sizeof(double), compare_doubles);
+    qsort(peak, RESIZE_RUNS, sizeof(double), compare_doubles);
+    *cpu_ms = cpu[RESIZE_RUNS / 2];
+    *peak_kib = (long) peak[RESIZE_RUNS / 2];
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * resize <jpeg>...
+ */
+static int bench_resize(int argc, char* argv[])
+{
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    static const struct {
+        const char* name;
+        unsigned int resolutions;
+    } variants[] = {
+        { "thumb", RESOLUTION_BIT(THUMB_RES) },
+        { "small", RESOLUTION_BIT(SMALL_RES) },
+        { "both", RESIZED_VARIANTS },
+    };
+
+    printf("variants of %dx%d and %dx%d, median of %d runs (CPU ms, peak KiB over an idle process):\n",
+           RESIZE_THUMB_RES, RESIZE_THUMB_RES, RESIZE_SMALL_RES, RESIZE_SMALL_RES, RESIZE_RUNS);
+    printf("  %-24s %-6s %10s %10s %10s %10s %10s %10s\n", "image", "",
+           "exact ms", "KiB", "shrink ms", "KiB", "exif ms", "KiB");
+    int err = ERR_NONE;
+    for (int i = 0; err == ERR_NONE && i < argc; ++i) {
+        char* jpeg = NULL;
+        size_t jpeg_size = 0;
+        err = load_file(argv[i], 0, &jpeg, &jpeg_size);
+        const char* name = strrchr(argv[i], '/') != NULL ? strrchr(argv[i], '/') + 1 : argv[i];
+
+        for (size_t v = 0; err == ERR_NONE && v < sizeof(variants) / sizeof(variants[0]); ++v) {
+            double cpu[RESIZE_EXIF_THUMBNAIL + 1] = { 0.0 };
+            long peak[RESIZE_EXIF_THUMBNAIL + 1] = { 0 };
+            for (int mode = RESIZE_EXACT; err == ERR_NONE && mode <= RESIZE_EXIF_THUMBNAIL; ++mode) {
+                err = median_resize(jpeg, jpeg_size, variants[v].resolutions, (enum resize_mode) mode,
+                                    &cpu[mode], &peak[mode]);
+            }
+            if (err == ERR_NONE) {
+                printf("  %-24s %-6s %10.1f %10ld %10.1f %10ld %10.1f %10ld\n", v == 0 ? name : "", variants[v].name,
+                       cpu[RESIZE_EXACT], peak[RESIZE_EXACT], cpu[RESIZE_SHRINK_ON_LOAD], peak[RESIZE_SHRINK_ON_LOAD],
+                       cpu[RESIZE_EXIF_THUMBNAIL], peak[RESIZE_EXIF_THUMBNAIL]);
+            }
+        }
+        free(jpeg);
+    }
+    return err;
+}
+
+static const benchmark_mapping benchmarks[] = {
+    {"ingest", bench_ingest, "ingest <scratch_imgFS> <jpeg> [count]: time do_insert with and without the index."},
+    {"durability", bench_durability, "durability <scratch_imgFS> <jpeg> [count]: insert throughput and latency per durability policy."},
+    {"readers", bench_readers, "readers <scratch_imgFS> <jpeg> [count] [seconds]: read throughput per number of readers, under a mutex, a rwlock or from the snapshot, while inserting."},
+    {"resize", bench_resize, "resize <jpeg>...: CPU time and peak memory of the variants of each image, decoded at full size, shrunk on load, or from the EXIF thumbnail."},
+    {"wal", bench_wal, "wal <scratch_imgFS> <jpeg> [count] [clients]: durable inserts and deletes, in place or through the WAL."},
+    {NULL, NULL, NULL},
+};
+
+/********************************************************************/
+static void usage(void)
+{
+    printf("imgfs_bench <BENCHMARK> [ARGUMENTS]\n");
+    for (size_t i = 0; benchmarks[i].name != NULL; ++i) {
+        printf("  %s\n", benchmarks[i].usage);
+    }
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        return ERR_IMGLIB;
+    }
+
+    int ret = ERR_INVALID_COMMAND;
+    if (argc < 2) {
+        ret = ERR_NOT_ENOUGH_ARGUMENTS;
+    } else {
+        for (size_t i = 0; benchmarks[i].name != NULL; ++i) {
+            if (strcmp(argv[1], benchmarks[i].name) == 0) {
+                ret = benchmarks[i].func(argc - 2, argv + 2);
+                break;
+            }
+        }
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+        usage();
+    }
+
+    vips_shutdown();
+    return ret;
+}
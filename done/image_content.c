@@ -1,112 +1,414 @@
 #include "imgfs.h"
+#include "image_content.h"
+#include "imgfs_alloc.h"
+#include "imgfs_derived.h"
+#include "imgfs_durability.h"
+#include "imgfs_io.h"
+#include "imgfs_jpeg.h"
+#include "imgfs_refs.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_wal.h"
 #include "imgfscmd_functions.h"
-#include "util.h"   // for _unused
+#include "util.h"   // for _unused, MIN, MAX
 #include <vips/vips.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
+// how the variants are computed, see resize_set_mode()
+static enum resize_mode resize_mode = RESIZE_EXACT;
+
+/*******************************************************************
+ * Writes back the metadata of one slot.
+ */
+static int write_metadata(struct imgfs_file* imgfs_file, size_t index)
+{
+    // In WAL mode, it goes to the log instead.
+    if (wal_active(imgfs_file)) {
+        const int err = wal_append(imgfs_file, (uint32_t) index);
+        return err != ERR_NONE ? err : durability_commit(imgfs_file);
+    }
+
+    const int err = io_write_at(imgfs_file->file, &imgfs_file->metadata[index], sizeof(struct img_metadata),
+                                sizeof(struct imgfs_header) + sizeof(struct img_metadata) * index);
+    return err != ERR_NONE ? err : durability_commit(imgfs_file);
+}
+
+/*******************************************************************
+ * Shares the variant another image with the same content already has, if any.
+ * The caller writes the metadata back.
+ */
+static void share_variant(int resolution, struct imgfs_file* imgfs_file, size_t index, int* shared)
+{
+    struct img_metadata* metadata = &imgfs_file->metadata[index];
+    uint64_t shared_offset = 0;
+    uint32_t shared_size = 0;
+    *shared = refs_find_variant(imgfs_file, metadata->SHA, resolution, &shared_offset, &shared_size);
+    if (!*shared) return;
+
+    metadata->offset[resolution] = shared_offset;
+    metadata->size[resolution] = shared_size;
+    refs_add_variant(imgfs_file, (uint32_t) index, resolution);
+}
+
+/*******************************************************************
+ * Publishes and writes back the metadata of a slot whose variants changed.
+ */
+static int variants_changed(struct imgfs_file* imgfs_file, size_t index)
+{
+    snapshot_update(imgfs_file, (uint32_t) index);
+    return write_metadata(imgfs_file, index);
+}
+
+int resize_mode_parse(const char* text, enum resize_mode* mode)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(mode);
+
+    if (strcmp(text, "exact") == 0) {
+        *mode = RESIZE_EXACT;
+    } else if (strcmp(text, "shrink") == 0) {
+        *mode = RESIZE_SHRINK_ON_LOAD;
+    } else if (strcmp(text, "exif") == 0) {
+        *mode = RESIZE_EXIF_THUMBNAIL;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return ERR_NONE;
+}
+
+void resize_set_mode(enum resize_mode mode)
+{
+    resize_mode = mode;
+}
+
+int resize_begin(unsigned int resolutions, struct imgfs_file* imgfs_file, size_t index,
+                 struct resize_job* job, int* done)
 {
     // Check for null pointers to avoid dereferencing null.
     M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+    M_REQUIRE_NON_NULL(done);
+    memset(job, 0, sizeof(struct resize_job));
+    *done = 0;
 
     // Validate the image index and its validity within the filesystem metadata array.
     if (!(index < imgfs_file->header.max_files && imgfs_file->metadata[index].is_valid))
         return ERR_INVALID_IMGID;
 
-    // Check if the requested resolution is within the valid range.
-    if (resolution < 0 || resolution >= NB_RES) {
+    // Check if the requested resolutions are within the valid range.
+    if (resolutions == 0 || resolutions >= RESOLUTION_BIT(NB_RES)) {
         return ERR_INVALID_IMGID;
     }
 
     // Get a pointer to the metadata of the image at the specified index.
-    struct img_metadata* metadata = &imgfs_file->metadata[index];
+    const struct img_metadata* metadata = &imgfs_file->metadata[index];
 
     // Check if the image metadata indicates the image is valid and non-empty.
     if (metadata->is_valid != NON_EMPTY) return ERR_INVALID_IMGID;
 
-    // If the image is already resized at this resolution, exit function successfully.
-    if (metadata->size[resolution] != 0) return ERR_NONE;
+    // Keep the variants that are missing, and that no other image with
+    // the same content already has (those are shared).
+    int changed = 0;
+    for (int resolution = 0; resolution < NB_RES; ++resolution) {
+        if (!(resolutions & RESOLUTION_BIT(resolution)) || metadata->size[resolution] != 0) continue;
+        int shared = 0;
+        share_variant(resolution, imgfs_file, index, &shared);
+        if (shared) {
+            changed = 1;
+        } else {
+            job->resolutions |= RESOLUTION_BIT(resolution);
+            job->width[resolution] = imgfs_file->header.resized_res[resolution * 2];
+            job->height[resolution] = imgfs_file->header.resized_res[resolution * 2 + 1];
+        }
+    }
+    if (changed) {
+        const int err = variants_changed(imgfs_file, index);
+        if (err != ERR_NONE) return err;
+    }
 
-    // Seek to the position of the original resolution image in the filesystem.
-    if (fseek(imgfs_file->file, (long) metadata->offset[ORIG_RES], SEEK_SET) != 0)
-        return ERR_IO;
+    // If the image already has all these variants, exit function successfully.
+    *done = job->resolutions == 0;
+    if (*done) return ERR_NONE;
 
     // Allocate memory for reading the original image.
-    void *orig_buf = calloc(1, metadata->size[ORIG_RES]);
-    if (orig_buf == NULL) return ERR_OUT_OF_MEMORY;
+    job->original = calloc(1, metadata->size[ORIG_RES]);
+    if (job->original == NULL) return ERR_OUT_OF_MEMORY;
+    job->original_size = metadata->size[ORIG_RES];
 
     // Read the original image data from the file.
-    if (fread(orig_buf, metadata->size[ORIG_RES], 1, imgfs_file->file) != 1) {
-        free(orig_buf);
+    if (io_read_at(imgfs_file->file, job->original, job->original_size, metadata->offset[ORIG_RES]) != ERR_NONE) {
+        resize_release(job);
         return ERR_IO;
     }
 
-    // Load the image from the buffer using the VIPS library.
-    VipsImage *in_image, *out_image;
-    if (vips_jpegload_buffer(orig_buf, metadata->size[ORIG_RES], &in_image, NULL) != 0) {
-        free(orig_buf);
+    // Remember what the variants are for, and how to compute them.
+    job->index = index;
+    job->mode = resize_mode;
+    memcpy(job->SHA, metadata->SHA, sizeof(job->SHA));
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * The largest JPEG shrink-on-load factor (1, 2, 4 or 8) at which the
+ * original still covers every given variant of the job.
+ */
+static int load_shrink(const struct resize_job* job, unsigned int resolutions,
+                       int original_width, int original_height)
+{
+    // vips_thumbnail_image() fits each variant in its box, keeping the aspect ratio
+    double scale = 0.0;
+    for (int resolution = 0; resolution < NB_RES; ++resolution) {
+        if (!(resolutions & RESOLUTION_BIT(resolution))) continue;
+        const double fit = MIN((double) job->width[resolution] / original_width,
+                               (double) job->height[resolution] / original_height);
+        scale = MAX(scale, fit);
+    }
+
+    int shrink = 8;
+    while (shrink > 1 && shrink * scale > 1.0) shrink /= 2;
+    return shrink;
+}
+
+/*******************************************************************
+ * Decodes the original, as small as the given variants allow unless in
+ * RESIZE_EXACT mode. When several variants are computed from it, the
+ * pixels are kept in memory: libvips would decode the original again
+ * for each of them otherwise.
+ */
+static int decode_original(const struct resize_job* job, unsigned int resolutions, VipsImage** decoded)
+{
+    // Only reads the header: the pixels are decoded when first needed.
+    VipsImage* image = NULL;
+    if (vips_jpegload_buffer(job->original, job->original_size, &image, NULL) != 0) {
         return ERR_IMGLIB;
     }
 
-    // Determine the target dimensions for the resized image.
-    int target_width = imgfs_file->header.resized_res[resolution * 2];
-    int target_height = imgfs_file->header.resized_res[resolution * 2 + 1];
+    if (job->mode != RESIZE_EXACT) {
+        const int width = vips_image_get_width(image);
+        const int height = vips_image_get_height(image);
+        const int shrink = width > 0 && height > 0 ? load_shrink(job, resolutions, width, height) : 1;
+        if (shrink > 1) {
+            g_object_unref(VIPS_OBJECT(image));
+            if (vips_jpegload_buffer(job->original, job->original_size, &image, "shrink", shrink, NULL) != 0) {
+                return ERR_IMGLIB;
+            }
+        }
+    }
+
+    if (resolutions & (resolutions - 1)) {
+        VipsImage* in_memory = vips_image_copy_memory(image);
+        g_object_unref(VIPS_OBJECT(image));
+        if (in_memory == NULL) return ERR_IMGLIB;
+        image = in_memory;
+    }
 
-    // Create a thumbnail image of the target resolution.
-    if (vips_thumbnail_image(in_image, &out_image, target_width, "height", target_height, NULL) != 0) {
-        g_object_unref(VIPS_OBJECT(in_image));
-        free(orig_buf);
+    *decoded = image;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Computes a single variant from a JPEG (the original, or its EXIF
+ * thumbnail) unless in RESIZE_EXACT mode: libvips then chooses the
+ * shrink-on-load factor itself.
+ */
+static int encode_thumbnail(struct resize_job* job, int resolution, const char* source, size_t source_size)
+{
+    VipsImage* out_image = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_thumbnail_buffer((void*) source, source_size, &out_image, job->width[resolution],
+                              "height", job->height[resolution], NULL) != 0) {
         return ERR_IMGLIB;
     }
+#pragma GCC diagnostic pop
+
+    int err = ERR_NONE;
+    if (vips_jpegsave_buffer(out_image, &job->variant[resolution], &job->variant_size[resolution], NULL) != 0) {
+        job->variant[resolution] = NULL;
+        err = ERR_IMGLIB;
+    }
+    g_object_unref(VIPS_OBJECT(out_image));
+    return err;
+}
+
+/*******************************************************************
+ * Computes a variant from the thumbnail embedded in the original, in
+ * RESIZE_EXIF_THUMBNAIL mode: as is, when it is (within a pixel) what
+ * vips_thumbnail_image() would make of the original, or downscaled,
+ * when larger. Leaves the variant NULL when the original has no such
+ * thumbnail: one smaller than the variant, or with another aspect ratio
+ * (letterboxed, or left from before the image was cropped), is not used.
+ */
+static int encode_from_exif(struct resize_job* job, int resolution)
+{
+    const char* embedded = NULL;
+    size_t embedded_size = 0;
+    uint32_t height = 0, width = 0, embedded_height = 0, embedded_width = 0;
+    if (!jpeg_exif_thumbnail(job->original, job->original_size, &embedded, &embedded_size)
+        || !jpeg_dimensions(job->original, job->original_size, &height, &width)
+        || !jpeg_dimensions(embedded, embedded_size, &embedded_height, &embedded_width)) {
+        return ERR_NONE;
+    }
+
+    // the same aspect ratio, within a pixel of the thumbnail
+    const uint64_t cross = (uint64_t) embedded_width * height;
+    const uint64_t cross_other = (uint64_t) embedded_height * width;
+    if (MAX(cross, cross_other) - MIN(cross, cross_other) > MAX(width, height)) return ERR_NONE;
+
+    // the size vips_thumbnail_image() gives, fitting the variant box
+    const double scale = MIN((double) job->width[resolution] / width,
+                             (double) job->height[resolution] / height);
+    const uint32_t fit_width = (uint32_t) (width * scale + 0.5);
+    const uint32_t fit_height = (uint32_t) (height * scale + 0.5);
+    if (embedded_width + 1 < fit_width || embedded_height + 1 < fit_height) return ERR_NONE;
+
+    if (embedded_width > fit_width + 1 || embedded_height > fit_height + 1) {
+        return encode_thumbnail(job, resolution, embedded, embedded_size);
+    }
+
+    job->variant[resolution] = g_malloc(embedded_size);
+    memcpy(job->variant[resolution], embedded, embedded_size);
+    job->variant_size[resolution] = embedded_size;
+    return ERR_NONE;
+}
+
+int resize_encode(struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(job);
+    M_REQUIRE_NON_NULL(job->original);
+
+    unsigned int pending = job->resolutions;
+    if (job->mode == RESIZE_EXIF_THUMBNAIL && (pending & RESOLUTION_BIT(THUMB_RES))) {
+        const int err = encode_from_exif(job, THUMB_RES);
+        if (err != ERR_NONE) return err;
+        if (job->variant[THUMB_RES] != NULL) pending &= ~RESOLUTION_BIT(THUMB_RES);
+    }
+    if (pending == 0) return ERR_NONE;
+
+    if (job->mode != RESIZE_EXACT && (pending & (pending - 1)) == 0) {
+        int resolution = 0;
+        while (!(pending & RESOLUTION_BIT(resolution))) ++resolution;
+        return encode_thumbnail(job, resolution, job->original, job->original_size);
+    }
+
+    // Load the image from the buffer using the VIPS library.
+    VipsImage* in_image = NULL;
+    const int err = decode_original(job, pending, &in_image);
+    if (err != ERR_NONE) return err;
+
+    int result = ERR_NONE;
+    for (int resolution = 0; resolution < NB_RES && result == ERR_NONE; ++resolution) {
+        if (!(pending & RESOLUTION_BIT(resolution))) continue;
+
+        // Create a thumbnail image of the target resolution.
+        VipsImage* out_image = NULL;
+        if (vips_thumbnail_image(in_image, &out_image, job->width[resolution],
+                                 "height", job->height[resolution], NULL) != 0) {
+            result = ERR_IMGLIB;
+            break;
+        }
+
+        // Save the resized image to a new buffer.
+        if (vips_jpegsave_buffer(out_image, &job->variant[resolution], &job->variant_size[resolution], NULL) != 0) {
+            job->variant[resolution] = NULL;
+            result = ERR_IMGLIB;
+        }
+
+        // Clean up the resized image VIPS object.
+        g_object_unref(VIPS_OBJECT(out_image));
+    }
 
     // Unreference the original VIPS image object as it is no longer needed.
     g_object_unref(VIPS_OBJECT(in_image));
+    return result;
+}
 
-    // Save the resized image to a new buffer.
-    void *buf = NULL;
-    size_t len;
-    if (vips_jpegsave_buffer(out_image, &buf, &len, NULL) != 0) {
-        g_object_unref(VIPS_OBJECT(out_image));
-        free(orig_buf);
-        return ERR_IMGLIB;
+int resize_finish(struct imgfs_file* imgfs_file, struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+
+    // The slot may have changed while the variants were encoded: drop
+    // them if it no longer holds the same content.
+    const size_t index = job->index;
+    if (index >= imgfs_file->header.max_files) return ERR_NONE;
+    struct img_metadata* metadata = &imgfs_file->metadata[index];
+    if (metadata->is_valid != NON_EMPTY || memcmp(metadata->SHA, job->SHA, sizeof(job->SHA)) != 0) {
+        return ERR_NONE;
     }
 
-    // Clean up the resized image VIPS object.
-    g_object_unref(VIPS_OBJECT(out_image));
+    int err = ERR_NONE;
+    int changed = 0;
+    for (int resolution = 0; resolution < NB_RES && err == ERR_NONE; ++resolution) {
+        // Also drop those the slot got meanwhile.
+        if (job->variant[resolution] == NULL || metadata->size[resolution] != 0) continue;
+        int shared = 0;
+        share_variant(resolution, imgfs_file, index, &shared);
+        changed |= shared;
+        if (shared) continue;
 
-    // Seek to the end of the file to append the resized image.
-    if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
-        g_free(buf);
-        return ERR_IO;
+        // Find room for the resized image: a hole left by deletions, or else the end of the file.
+        uint64_t offset = 0;
+        err = alloc_take(imgfs_file, (uint32_t) job->variant_size[resolution], &offset);
+        if (err != ERR_NONE) break;
+
+        // Write the resized image buffer to the file.
+        if (io_write_at(imgfs_file->file, job->variant[resolution], job->variant_size[resolution], offset) != ERR_NONE) {
+            alloc_reset(imgfs_file);
+            err = ERR_IO;
+            break;
+        }
+
+        // Update the metadata with the new offset and size of the resized image.
+        metadata->offset[resolution] = offset;
+        metadata->size[resolution] = (uint32_t) job->variant_size[resolution];
+        refs_add_variant(imgfs_file, (uint32_t) index, resolution);
+        changed = 1;
     }
 
-    // Write the resized image buffer to the file.
-    if (fwrite(buf, len, 1, imgfs_file->file) != 1) {
-        g_free(buf);
-        return ERR_IO;
+    // Write the updated metadata, with the variants stored before any error.
+    if (changed) {
+        const int write_err = variants_changed(imgfs_file, index);
+        if (err == ERR_NONE) err = write_err;
     }
+    return err;
+}
 
-    // Update the metadata with the new offset and size of the resized image.
-    metadata->offset[resolution] = ((unsigned long) ftell(imgfs_file->file)) - len;
-    metadata->size[resolution] = (uint32_t) len;
+void resize_release(struct resize_job* job)
+{
+    if (job == NULL) return;
+    free(job->original);
+    job->original = NULL;
+    for (int resolution = 0; resolution < NB_RES; ++resolution) {
+        g_free(job->variant[resolution]);
+        job->variant[resolution] = NULL;
+    }
+}
 
-    // Free the buffer containing the resized image.
-    g_free(buf);
+int resize_variants(unsigned int resolutions, struct imgfs_file* imgfs_file, size_t index)
+{
+    struct resize_job job;
+    int done = 0;
+    int err = resize_begin(resolutions, imgfs_file, index, &job, &done);
+    if (err != ERR_NONE || done) return err;
 
-    // Seek to the metadata position in the file and write the updated metadata.
-    if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + sizeof(struct img_metadata) * index), SEEK_SET) != 0)
-        return ERR_IO;
-    if (fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1)
-        return ERR_IO;
+    err = resize_encode(&job);
+    if (err == ERR_NONE) err = resize_finish(imgfs_file, &job);
+    resize_release(&job);
+    return err;
+}
 
-    // Clean up the original image buffer.
-    free(orig_buf);
+int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
 
-    // Return success.
-    return ERR_NONE;
+    // Check if the requested resolution is within the valid range.
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_INVALID_IMGID;
+    }
+    return resize_variants(RESOLUTION_BIT(resolution), imgfs_file, index);
 }
 
 int get_resolution(uint32_t *height, uint32_t *width,
@@ -116,6 +418,9 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // Read from the frame header when possible: libvips sets up a whole decoder.
+    if (jpeg_dimensions(image_buffer, image_size, height, width)) return ERR_NONE;
+
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -131,3 +436,83 @@ int get_resolution(uint32_t *height, uint32_t *width,
     return ERR_NONE;
 }
 
+int tile_encode(const char* original, size_t original_size, uint32_t level, uint32_t x, uint32_t y,
+                void** tile, size_t* tile_size)
+{
+    M_REQUIRE_NON_NULL(original);
+    M_REQUIRE_NON_NULL(tile);
+    M_REQUIRE_NON_NULL(tile_size);
+
+    uint32_t height = 0, width = 0;
+    int err = get_resolution(&height, &width, original, original_size);
+    if (err != ERR_NONE) return err;
+    if (!tile_exists(width, height, level, x, y)) return ERR_INVALID_ARGUMENT;
+
+    // libjpeg shrinks by up to 8 while decoding, libvips does the rest.
+    const uint32_t factor = 1u << level;
+    const uint32_t shrink = MIN(factor, 8u);
+
+    // Rows are decoded as the extraction needs them, and only those up to the tile.
+    VipsImage* image = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) original, original_size, &image,
+                             "shrink", (int) shrink, "access", VIPS_ACCESS_SEQUENTIAL, NULL) != 0) {
+        return ERR_IMGLIB;
+    }
+#pragma GCC diagnostic pop
+
+    if (factor > shrink) {
+        VipsImage* resized = NULL;
+        err = vips_resize(image, &resized, (double) shrink / factor, NULL);
+        g_object_unref(VIPS_OBJECT(image));
+        if (err != 0) return ERR_IMGLIB;
+        image = resized;
+    }
+
+    // The level may be a pixel off the one tile_exists() computes: stay within it.
+    const int level_width = vips_image_get_width(image);
+    const int level_height = vips_image_get_height(image);
+    const int left = (int) MIN((uint64_t) x * TILE_SIZE, (uint64_t) (level_width - 1));
+    const int top = (int) MIN((uint64_t) y * TILE_SIZE, (uint64_t) (level_height - 1));
+    VipsImage* area = NULL;
+    err = vips_extract_area(image, &area, left, top,
+                            MIN(TILE_SIZE, level_width - left), MIN(TILE_SIZE, level_height - top), NULL);
+    g_object_unref(VIPS_OBJECT(image));
+    if (err != 0) return ERR_IMGLIB;
+
+    err = ERR_NONE;
+    if (vips_jpegsave_buffer(area, tile, tile_size, NULL) != 0) {
+        *tile = NULL;
+        err = ERR_IMGLIB;
+    }
+    g_object_unref(VIPS_OBJECT(area));
+    return err;
+}
+
+int sized_encode(const char* original, size_t original_size, uint32_t width, uint32_t height,
+                 void** variant, size_t* variant_size)
+{
+    M_REQUIRE_NON_NULL(original);
+    M_REQUIRE_NON_NULL(variant);
+    M_REQUIRE_NON_NULL(variant_size);
+    if (width == 0 || height == 0) return ERR_INVALID_ARGUMENT;
+
+    // As a single variant: libvips picks the shrink-on-load factor itself.
+    VipsImage* out_image = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_thumbnail_buffer((void*) original, original_size, &out_image, (int) width,
+                              "height", (int) height, NULL) != 0) {
+        return ERR_IMGLIB;
+    }
+#pragma GCC diagnostic pop
+
+    int err = ERR_NONE;
+    if (vips_jpegsave_buffer(out_image, variant, variant_size, NULL) != 0) {
+        *variant = NULL;
+        err = ERR_IMGLIB;
+    }
+    g_object_unref(VIPS_OBJECT(out_image));
+    return err;
+}
@@ -37,6 +37,155 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief How the variants are computed from the original.
+ */
+enum resize_mode {
+    RESIZE_EXACT,          ///< from the original decoded at full size (the default)
+    RESIZE_SHRINK_ON_LOAD, ///< from the original decoded by libjpeg at 1/2, 1/4 or 1/8 of
+                           ///< its size when the variants allow: faster and smaller, but
+                           ///< the pixels differ slightly from those of RESIZE_EXACT
+    RESIZE_EXIF_THUMBNAIL  ///< as RESIZE_SHRINK_ON_LOAD, but the thumbnail comes from the
+                           ///< one cameras embed in the EXIF data, when it fits (see imgfs_jpeg.h)
+};
+
+/**
+ * @brief Reads a mode given on a command line: "exact", "shrink" or "exif".
+ *
+ * @param text The text to read.
+ * @param mode Where to put the mode.
+ * @return Some error code. 0 if no error.
+ */
+int resize_mode_parse(const char* text, enum resize_mode* mode);
+
+/**
+ * @brief Sets how the variants are computed from now on, in the whole
+ *        process. To be called before any resize starts.
+ *
+ * @param mode The mode.
+ */
+void resize_set_mode(enum resize_mode mode);
+
+#define RESOLUTION_BIT(res) (1u << (res))
+#define RESIZED_VARIANTS (RESOLUTION_BIT(THUMB_RES) | RESOLUTION_BIT(SMALL_RES))
+
+/**
+ * @brief Resize the image to several resolutions at once, decoding the
+ * original only once, and updates the metadata on the disk (once).
+ *
+ * @param resolutions The resolutions, as RESOLUTION_BIT()s (e.g. RESIZED_VARIANTS).
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int resize_variants(unsigned int resolutions, struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Computes a tile of an image (see imgfs_derived.h), decoding the
+ *        original no larger than its level needs, and only down to the tile.
+ *
+ * @param original The original image.
+ * @param original_size Its size.
+ * @param level The level of the tile.
+ * @param x Its column.
+ * @param y Its row.
+ * @param tile Where to put the tile, to be released with g_free().
+ * @param tile_size Where to put its size.
+ * @return Some error code (ERR_INVALID_ARGUMENT if the image has no such tile). 0 if no error.
+ */
+int tile_encode(const char* original, size_t original_size, uint32_t level, uint32_t x, uint32_t y,
+                void** tile, size_t* tile_size);
+
+/**
+ * @brief Computes a sized variant of an image (see imgfs_derived.h): the
+ *        original fit in a box, keeping its aspect ratio.
+ *
+ * @param original The original image.
+ * @param original_size Its size.
+ * @param width The width of the box.
+ * @param height Its height.
+ * @param variant Where to put the variant, in JPEG, to be released with g_free().
+ * @param variant_size Where to put its size.
+ * @return Some error code. 0 if no error.
+ */
+int sized_encode(const char* original, size_t original_size, uint32_t width, uint32_t height,
+                 void** variant, size_t* variant_size);
+
+/**
+ * @struct resize_job
+ * @brief Variants computed in three steps, so that the encoding, which
+ *        may take long, is done without holding anything of the imgFS:
+ *        resize_begin() and resize_finish() need exclusive access to it,
+ *        resize_encode() does not need it at all. resize_variants() does
+ *        the three in a row.
+ *
+ * @param index The slot of the image.
+ * @param resolutions The variants to compute, as RESOLUTION_BIT()s.
+ * @param mode How to compute them.
+ * @param SHA The content of the slot when begun.
+ * @param width The width of each variant.
+ * @param height The height of each variant.
+ * @param original A copy of the original image.
+ * @param original_size Its size.
+ * @param variant Each variant, once encoded.
+ * @param variant_size Their sizes.
+ */
+struct resize_job {
+    size_t index;
+    unsigned int resolutions;
+    enum resize_mode mode;
+    uint8_t SHA[SHA256_DIGEST_LENGTH];
+    int width[NB_RES];
+    int height[NB_RES];
+    void* original;
+    size_t original_size;
+    void* variant[NB_RES];
+    size_t variant_size[NB_RES];
+};
+
+/**
+ * @brief First step of a resize: checks the image and the resolutions,
+ *        and copies the original image, unless the variants exist or
+ *        another image with the same content has them (which are then
+ *        shared right away).
+ *
+ * @param resolutions The variants to compute, as RESOLUTION_BIT()s.
+ * @param imgfs_file The main in-memory structure.
+ * @param index The index of the image in the metadata array.
+ * @param job Where to put what the next steps need.
+ * @param done Where to put whether the slot has all the variants already (nothing left to do).
+ * @return Some error code. 0 if no error.
+ */
+int resize_begin(unsigned int resolutions, struct imgfs_file* imgfs_file, size_t index,
+                 struct resize_job* job, int* done);
+
+/**
+ * @brief Second step of a resize: computes the variants, from a single
+ *        decoding of the original. Needs nothing of the imgFS.
+ *
+ * @param job The resize, begun.
+ * @return Some error code. 0 if no error.
+ */
+int resize_encode(struct resize_job* job);
+
+/**
+ * @brief Last step of a resize: appends the variants and writes the
+ *        metadata of the slot, once. The variants the slot got meanwhile
+ *        are dropped, all of them if it lost its image.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param job The resize, encoded.
+ * @return Some error code. 0 if no error.
+ */
+int resize_finish(struct imgfs_file* imgfs_file, struct resize_job* job);
+
+/**
+ * @brief Releases the buffers of a resize, whatever step it reached.
+ *
+ * @param job The resize.
+ */
+void resize_release(struct resize_job* job);
+
 #ifdef __cplusplus
 }
 #endif
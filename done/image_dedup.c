@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 #include <vips/vips.h>
@@ -24,33 +25,23 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
         return ERR_NONE;
     }
 
-    int found = 0; // Flag to indicate if a duplicate has been found.
-
-    // Loop through all metadata entries except the one at the provided index.
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-        if (i != index && imgfs_file->metadata[i].is_valid != EMPTY) {
-            struct img_metadata *current_metadata = &imgfs_file->metadata[i];
-
-            // Check if the current metadata has the same image ID as the target metadata.
-            if (strncmp(current_metadata->img_id, target_metadata->img_id, MAX_IMG_ID) == 0) {
-                return ERR_DUPLICATE_ID; // Duplicate image ID found.
-            }
-
-            // Check if the current metadata has the same SHA-256 hash as the target metadata.
-            if (memcmp(current_metadata->SHA, target_metadata->SHA, SHA256_DIGEST_LENGTH) == 0) {
-                // Link duplicate entries by copying over offsets and sizes from the found entry to the target.
-                for (int res = 0; res < NB_RES; res++) {
-                    target_metadata->offset[res] = current_metadata->offset[res];
-                    target_metadata->size[res] = current_metadata->size[res];
-                }
-                found = 1;
-                break; // Stop searching after finding a duplicate.
-            }
-        }
+    // Check through the index if another image already has the same ID.
+    if (index_find_id(imgfs_file, target_metadata->img_id, index) != INDEX_NO_SLOT) {
+        return ERR_DUPLICATE_ID;
     }
 
-    // If no duplicate was found, set the original resolution offset to zero, indicating it needs initialization.
-    if (found == 0) {
+    // Check through the index if another image already has the same content.
+    const uint32_t same_content = index_find_sha(imgfs_file, target_metadata->SHA, index);
+    if (same_content != INDEX_NO_SLOT) {
+        const struct img_metadata *current_metadata = &imgfs_file->metadata[same_content];
+
+        // Link duplicate entries by copying over offsets and sizes from the found entry to the target.
+        for (int res = 0; res < NB_RES; res++) {
+            target_metadata->offset[res] = current_metadata->offset[res];
+            target_metadata->size[res] = current_metadata->size[res];
+        }
+    } else {
+        // No duplicate found: set the original resolution offset to zero, indicating it needs initialization.
         target_metadata->offset[ORIG_RES] = 0;
     }
 
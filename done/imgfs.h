@@ -6,7 +6,8 @@
  * the disk and provides interface functions.
  *
  * The imgFS data structure starts with exactly one header structure,
- * followed by exactly imgfs_header.max_files metadata structures.
+ * followed by exactly imgfs_header.max_files metadata structures
+ * (and, in the IMGFS_FORMAT_INDEXED format, by an on-disk ID index).
  * The actual content is not defined by these structures because it
  * should be stored as raw bytes appended at the end of the imgFS
  * file and addressed by offsets in the metadata structure.
@@ -40,6 +41,11 @@
 #define ORIG_RES  2
 #define NB_RES    3
 
+// Formats of an imgFS file, stored in imgfs_header.unused_32
+#define IMGFS_FORMAT_BASIC   0  // header, metadata, then the images
+#define IMGFS_FORMAT_INDEXED 1  // same, with an on-disk ID index between metadata and images
+#define IMGFS_FORMAT_LATEST  IMGFS_FORMAT_INDEXED
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,8 +67,8 @@ extern "C" {
  * @param nb_files    The current number of images in the file system.
  * @param max_files   The maximum number of images that the system can contain.
  * @param resized_res Array storing the resolutions of the "thumbnail" and "small" images.
- * @param unused_32   Reserved 32-bit integer for future use or alignment purposes.
- * @param unused_64   Reserved 64-bit integer for future use or alignment purposes.
+ * @param unused_32   Format of the file (IMGFS_FORMAT_*), 0 in files of the original format.
+ * @param unused_64   With IMGFS_FORMAT_INDEXED, position of the on-disk ID index in the file.
  */
 struct imgfs_header {
     char name[MAX_IMGFS_NAME+1];
@@ -141,6 +147,63 @@ int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Open imgFS file and map it in memory instead of reading it.
+ *
+ * The metadata array points into a mapping of the file (shared for
+ * writable modes, private copy-on-write for read-only ones), so opening
+ * does not copy anything, and the blobs can be read without copy with
+ * do_read_view().
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open_mapped(const char* imgfs_filename,
+                   const char* open_mode,
+                   struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Open imgFS file, reading only its header.
+ *
+ * Like do_open_mapped(), but the metadata is not even scanned: pages of
+ * the metadata are loaded on first touch, and the index is filled as
+ * lookups need it (see index_build()). Opening time and resident memory
+ * then depend on the images actually used, not on header.max_files.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open_lazy(const char* imgfs_filename,
+                 const char* open_mode,
+                 struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Gives a pointer to size bytes at offset in a mapped imgFS.
+ *
+ * @param imgfs_file Structure opened with do_open_mapped().
+ * @param offset Position of the bytes in the imgFS file.
+ * @param size Number of bytes.
+ * @param view Where to put the pointer to the bytes.
+ * @return Some error code. 0 if no error.
+ */
+int map_view(struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size, const char** view);
+
+/**
+ * @brief Same as map_view(), but changes nothing, so that several threads
+ *        may call it at the same time: if the bytes lie past the part of
+ *        the file mapped so far, view is set to NULL, and map_view() is
+ *        needed (with exclusive access) to map them.
+ *
+ * @param imgfs_file Structure opened with do_open_mapped().
+ * @param offset Position of the bytes in the imgFS file.
+ * @param size Number of bytes.
+ * @param view Where to put the pointer to the bytes, or NULL.
+ * @return Some error code. 0 if no error.
+ */
+int map_view_shared(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size, const char** view);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
@@ -175,6 +238,9 @@ int do_list(const struct imgfs_file* imgfs_file,
  * @brief Creates the imgFS called imgfs_filename. Writes the header and the
  *        preallocated empty metadata array to imgFS file.
  *
+ * The format of the new file is given by imgfs_file->header.unused_32:
+ * IMGFS_FORMAT_INDEXED, or else IMGFS_FORMAT_BASIC.
+ *
  * @param imgfs_filename Path to the imgFS file
  * @param imgfs_file In memory structure with header and metadata.
  */
@@ -216,6 +282,47 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads the content of an image from a mapped imgFS, without copy.
+ *
+ * Same as do_read(), except that image_buffer points directly into the
+ * mapping of the file. It must not be freed, and stays valid until the
+ * room of the blob is reclaimed: the room of a deleted image is only
+ * reused, and the file only cut, once no reader may still see it (see
+ * imgfs_alloc.h). A view taken within a read section (see imgfs_rcu.h)
+ * thus lasts until the section is left, even if the image is deleted
+ * meanwhile; outside any section, until the next change of the imgFS.
+ * do_grow() and do_gbcollect_step() move blobs: no view may be in use
+ * while they run.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param image_buffer Location of the pointer to the image content
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure, opened with do_open_mapped()
+ * @return Some error code. 0 if no error.
+ */
+int do_read_view(const char* img_id, int resolution, const char** image_buffer,
+                 uint32_t* image_size, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Same as do_read_view(), for readers sharing the imgFS: it only
+ *        succeeds when the read changes nothing (no resize, no index scan,
+ *        no new mapping), so that several threads may call it at the same
+ *        time, as long as nothing else changes the imgFS meanwhile.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param image_buffer Location of the pointer to the image content
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure, opened with do_open_mapped()
+ * @param done Where to put whether the read was carried out (error or not);
+ *        when 0, do_read_view() is needed, with exclusive access.
+ * @return Some error code. 0 if no error.
+ */
+int do_read_view_shared(const char* img_id, int resolution, const char** image_buffer,
+                        uint32_t* image_size, const struct imgfs_file* imgfs_file, int* done);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -227,15 +334,51 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Enlarges the metadata table of an open imgFS to max_files slots.
+ *
+ * The blobs lying where the larger table goes are moved to the end of
+ * the file and their offsets rewritten; the other ones are not touched,
+ * so the cost depends on the relocated bytes, not on the whole store.
+ * The views given so far (see do_read_view()) must no longer be in use.
+ *
+ * @param max_files The new number of slots, larger than the current one.
+ * @param imgfs_file The main in-memory data structure, opened for writing.
+ * @return Some error code. 0 if no error.
+ */
+int do_grow(uint32_t max_files, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
+ * The live content is copied, in offset order, into a fresh imgFS
+ * which then replaces the original one.
+ *
  * @param imgfs_path The path to the imgFS file
  * @param imgfs_tmp_bkp_path The path to the a (to be created) temporary imgFS backup file
  * @return Some error code. 0 if no error.
  */
 int do_gbcollect(const char* imgfs_path, const char* imgfs_tmp_bkp_path);
 
+/**
+ * @brief Does one step of the in-place compaction of an open imgFS.
+ *
+ * Each step slides the next live blobs (about budget bytes of them)
+ * down over the room freed by deletions, and rewrites the offsets of
+ * every slot sharing them. Once a pass has moved all the blobs, the
+ * file is truncated after the last one and the next step starts a new
+ * pass. Steps may be freely interleaved with the other operations, but
+ * the views given before a step (see do_read_view()) must no longer be
+ * in use when it starts.
+ *
+ * @param imgfs_file The main in-memory data structure, opened for writing.
+ * @param budget About how many bytes to copy during this step.
+ * @param copied Where to put how many bytes were actually copied.
+ * @param finished Where to put whether this step ended a pass.
+ * @return Some error code. 0 if no error.
+ */
+int do_gbcollect_step(struct imgfs_file* imgfs_file, size_t budget, size_t* copied, int* finished);
+
 #ifdef __cplusplus
 }
 #endif
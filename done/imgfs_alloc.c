@@ -0,0 +1,439 @@
+/**
+ * @file imgfs_alloc.c
+ * @brief Reuse of the room freed by deletions (see imgfs_alloc.h).
+ *
+ * The free extents are kept in two sorted arrays holding the same
+ * extents: one by offset, one by (size, offset). A store has far fewer
+ * holes than images, so the moves done by insertions and removals cost
+ * less than the pointer chasing of a balanced tree.
+ */
+
+#include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_blobs.h"
+#include "imgfs_io.h"
+#include "imgfs_rcu.h"
+#include "imgfs_refs.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>   // for malloc, free
+#include <string.h>   // for memmove
+
+struct extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*
+ * The blobs freed by a deletion wait to be reused: in WAL mode, until
+ * the deletion is durable (a crash could bring its slot back), and in
+ * any case until no reader without lock may still be sending them from
+ * the mapping of the file. The first condition is checked here; the
+ * second one is reported by rcu_retire() (see imgfs_rcu.h), which may
+ * do so after the allocator is gone: whichever of the two lets go of
+ * the record last frees it.
+ */
+enum grace {
+    GRACE_RUNNING,
+    GRACE_PASSED,             // no reader sees the blobs any more
+    GRACE_DROPPED             // the allocator let go of the record
+};
+
+struct released {
+    struct extent extents[NB_RES];
+    size_t count;
+    uint64_t position;        // in the log, of the deletion that freed them
+    atomic_int grace;
+    struct released* next;
+};
+
+struct imgfs_alloc {
+    struct extent* by_offset; // sorted by offset, never two touching extents
+    struct extent* by_size;   // the same extents, sorted by size then offset
+    size_t count;
+    size_t capacity;
+    uint64_t end;             // end of the content area (the file size)
+    int built;                // whether the extents above were worked out
+    struct released* released; // oldest first
+    struct released** released_tail;
+};
+
+/*******************************************************************
+ * Orders.
+ */
+static int before_by_offset(const struct extent* a, const struct extent* b)
+{
+    return a->offset < b->offset;
+}
+
+static int before_by_size(const struct extent* a, const struct extent* b)
+{
+    return a->size < b->size || (a->size == b->size && a->offset < b->offset);
+}
+
+/*******************************************************************
+ * Position of the first extent of array not before key.
+ */
+static size_t lower_bound(const struct extent* array, size_t count, const struct extent* key,
+                          int (*before)(const struct extent*, const struct extent*))
+{
+    size_t low = 0, high = count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (before(&array[middle], key)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void array_insert(struct extent* array, size_t count, const struct extent* extent,
+                         int (*before)(const struct extent*, const struct extent*))
+{
+    const size_t at = lower_bound(array, count, extent, before);
+    memmove(&array[at + 1], &array[at], (count - at) * sizeof(struct extent));
+    array[at] = *extent;
+}
+
+static void array_erase(struct extent* array, size_t count, const struct extent* extent,
+                        int (*before)(const struct extent*, const struct extent*))
+{
+    const size_t at = lower_bound(array, count, extent, before);
+    memmove(&array[at], &array[at + 1], (count - at - 1) * sizeof(struct extent));
+}
+
+/*******************************************************************
+ * Adds or removes an extent, in both orders.
+ */
+static int add_extent(struct imgfs_alloc* alloc, const struct extent* extent)
+{
+    if (alloc->count == alloc->capacity) {
+        const size_t capacity = alloc->capacity == 0 ? 16 : 2 * alloc->capacity;
+        struct extent* by_offset = realloc(alloc->by_offset, capacity * sizeof(struct extent));
+        if (by_offset == NULL) return ERR_OUT_OF_MEMORY;
+        alloc->by_offset = by_offset;
+        struct extent* by_size = realloc(alloc->by_size, capacity * sizeof(struct extent));
+        if (by_size == NULL) return ERR_OUT_OF_MEMORY;
+        alloc->by_size = by_size;
+        alloc->capacity = capacity;
+    }
+    array_insert(alloc->by_offset, alloc->count, extent, before_by_offset);
+    array_insert(alloc->by_size, alloc->count, extent, before_by_size);
+    ++alloc->count;
+    return ERR_NONE;
+}
+
+static void remove_extent(struct imgfs_alloc* alloc, const struct extent* extent)
+{
+    array_erase(alloc->by_offset, alloc->count, extent, before_by_offset);
+    array_erase(alloc->by_size, alloc->count, extent, before_by_size);
+    --alloc->count;
+}
+
+/*******************************************************************
+ * Called by rcu_retire() once no reader sees the blobs of released.
+ */
+static void grace_passed(void* released)
+{
+    struct released* record = released;
+    if (atomic_exchange(&record->grace, GRACE_PASSED) == GRACE_DROPPED) free(record);
+}
+
+static void drop_released(struct released* record)
+{
+    if (atomic_exchange(&record->grace, GRACE_DROPPED) == GRACE_PASSED) free(record);
+}
+
+/*******************************************************************
+ * Forgets the free extents (not the blobs waiting to be reused).
+ */
+static void forget_extents(struct imgfs_alloc* alloc)
+{
+    free(alloc->by_offset);
+    free(alloc->by_size);
+    alloc->by_offset = alloc->by_size = NULL;
+    alloc->count = alloc->capacity = 0;
+    alloc->built = 0;
+}
+
+static void forget_released(struct imgfs_alloc* alloc)
+{
+    while (alloc->released != NULL) {
+        struct released* record = alloc->released;
+        alloc->released = record->next;
+        drop_released(record);
+    }
+    alloc->released_tail = &alloc->released;
+}
+
+/*******************************************************************
+ * The allocator of an imgFS, created empty if it has none yet.
+ */
+static struct imgfs_alloc* alloc_of(struct imgfs_state* state)
+{
+    if (state->alloc == NULL) {
+        state->alloc = calloc(1, sizeof(struct imgfs_alloc));
+        if (state->alloc != NULL) state->alloc->released_tail = &state->alloc->released;
+    }
+    return state->alloc;
+}
+
+/*******************************************************************
+ * Cuts the file at end, where the content area now ends. A running
+ * compaction pass (see do_gbcollect_step()) is pulled back there: the
+ * blobs appended next would otherwise lie behind its cursor, where it
+ * never looks, and be cut off when the pass ends.
+ */
+static int cut_file(struct imgfs_file* imgfs_file, struct imgfs_alloc* alloc, uint64_t end)
+{
+    if (io_truncate(imgfs_file->file, end) != ERR_NONE) return ERR_IO;
+    alloc->end = end;
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state != NULL && state->gc_from > end) {
+        state->gc_from = end;
+        state->gc_to = MIN(state->gc_to, end);
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Adds the blobs waiting to be reused to those collected, as if they
+ * were still live.
+ */
+static int add_released(const struct imgfs_alloc* alloc, struct blob_move** blobs, size_t* count)
+{
+    size_t waiting = 0;
+    for (const struct released* record = alloc->released; record != NULL; record = record->next) {
+        waiting += record->count;
+    }
+    if (waiting == 0) return ERR_NONE;
+
+    struct blob_move* larger = realloc(*blobs, (*count + waiting) * sizeof(struct blob_move));
+    if (larger == NULL) return ERR_OUT_OF_MEMORY;
+    *blobs = larger;
+    for (const struct released* record = alloc->released; record != NULL; record = record->next) {
+        for (size_t i = 0; i < record->count; ++i) {
+            const struct extent* extent = &record->extents[i];
+            larger[(*count)++] = (struct blob_move) {
+                extent->offset, extent->offset, (uint32_t) extent->size
+            };
+        }
+    }
+    qsort(larger, *count, sizeof(struct blob_move), blobs_compare);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Works out the free extents: the gaps between the live blobs and
+ * those waiting to be reused.
+ */
+static int alloc_build(struct imgfs_file* imgfs_file, struct imgfs_alloc* alloc)
+{
+    // every hole found must come from a durable deletion
+    const int sync_err = wal_sync(imgfs_file, wal_position(imgfs_file));
+    if (sync_err != ERR_NONE) return sync_err;
+
+    uint64_t end = 0;
+    if (io_size(imgfs_file->file, &end) != ERR_NONE) return ERR_IO;
+    alloc->end = MAX(end, blobs_start(&imgfs_file->header));
+
+    struct blob_move* blobs = NULL;
+    size_t count = 0;
+    int err = blobs_collect(imgfs_file, 0, UINT64_MAX, SIZE_MAX, &blobs, &count);
+    if (err == ERR_NONE) err = add_released(alloc, &blobs, &count);
+
+    uint64_t position = blobs_start(&imgfs_file->header);
+    for (size_t i = 0; i < count && err == ERR_NONE; ++i) {
+        if (blobs[i].from > position) {
+            const struct extent gap = { position, blobs[i].from - position };
+            err = add_extent(alloc, &gap);
+        }
+        position = MAX(position, blobs[i].from + blobs[i].size);
+    }
+    // the room after the last blob is not a hole: the file ends there
+    if (err == ERR_NONE && position < alloc->end && cut_file(imgfs_file, alloc, position) != ERR_NONE) {
+        const struct extent tail = { position, alloc->end - position };
+        err = add_extent(alloc, &tail);
+    }
+
+    free(blobs);
+    if (err != ERR_NONE) {
+        forget_extents(alloc);
+        return err;
+    }
+    alloc->built = 1;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Frees an extent, merged with the free extents it touches.
+ */
+static int free_extent(struct imgfs_file* imgfs_file, struct imgfs_alloc* alloc, struct extent extent)
+{
+    const size_t at = lower_bound(alloc->by_offset, alloc->count, &extent, before_by_offset);
+    if (at < alloc->count && alloc->by_offset[at].offset < extent.offset + extent.size) {
+        return ERR_RUNTIME; // already free
+    }
+    if (at < alloc->count && alloc->by_offset[at].offset == extent.offset + extent.size) {
+        const struct extent next = alloc->by_offset[at];
+        remove_extent(alloc, &next);
+        extent.size += next.size;
+    }
+    if (at > 0) {
+        const struct extent previous = alloc->by_offset[at - 1];
+        if (previous.offset + previous.size > extent.offset) return ERR_RUNTIME;
+        if (previous.offset + previous.size == extent.offset) {
+            remove_extent(alloc, &previous);
+            extent.offset = previous.offset;
+            extent.size += previous.size;
+        }
+    }
+
+    if (extent.offset + extent.size == alloc->end && cut_file(imgfs_file, alloc, extent.offset) == ERR_NONE) {
+        return ERR_NONE;
+    }
+    return add_extent(alloc, &extent);
+}
+
+/*******************************************************************
+ * Frees the blobs released that can be reused by now.
+ */
+static int settle_released(struct imgfs_file* imgfs_file, struct imgfs_alloc* alloc)
+{
+    if (alloc->released == NULL) return ERR_NONE;
+
+    rcu_reclaim(); // reports the grace periods over
+    int err = ERR_NONE;
+    while (alloc->released != NULL && err == ERR_NONE
+           && atomic_load(&alloc->released->grace) == GRACE_PASSED
+           && wal_durable(imgfs_file, alloc->released->position)) {
+        struct released* record = alloc->released;
+        for (size_t i = 0; i < record->count && err == ERR_NONE; ++i) {
+            err = free_extent(imgfs_file, alloc, record->extents[i]);
+        }
+        alloc->released = record->next;
+        drop_released(record);
+    }
+    if (alloc->released == NULL) alloc->released_tail = &alloc->released;
+    return err;
+}
+
+int alloc_take(struct imgfs_file* imgfs_file, uint32_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(offset);
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) {
+        // nothing known about the holes: append
+        return io_size(imgfs_file->file, offset);
+    }
+    struct imgfs_alloc* alloc = alloc_of(state);
+    if (alloc == NULL) return ERR_OUT_OF_MEMORY;
+    if (!alloc->built) {
+        const int err = alloc_build(imgfs_file, alloc);
+        if (err != ERR_NONE) return err;
+    }
+    if (settle_released(imgfs_file, alloc) != ERR_NONE) {
+        // the holes may be half updated: they are worked out again, once
+        alloc_reset(imgfs_file);
+        int err = alloc_build(imgfs_file, alloc);
+        if (err == ERR_NONE) err = settle_released(imgfs_file, alloc);
+        if (err != ERR_NONE) {
+            alloc_reset(imgfs_file);
+            return err;
+        }
+    }
+
+    // Smallest hole that fits; those before the compaction cursor
+    // belong to the running compaction pass (see do_gbcollect_step()).
+    const struct extent key = { 0, size };
+    for (size_t i = lower_bound(alloc->by_size, alloc->count, &key, before_by_size); i < alloc->count; ++i) {
+        const struct extent hole = alloc->by_size[i];
+        if (hole.offset < state->gc_from) continue;
+
+        remove_extent(alloc, &hole);
+        if (hole.size > size) {
+            const struct extent rest = { hole.offset + size, hole.size - size };
+            const int err = add_extent(alloc, &rest);
+            if (err != ERR_NONE) {
+                alloc_reset(imgfs_file);
+                return err;
+            }
+        }
+        *offset = hole.offset;
+        return ERR_NONE;
+    }
+
+    *offset = alloc->end;
+    alloc->end += size;
+    return ERR_NONE;
+}
+
+void alloc_release(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    if (imgfs_file == NULL || imgfs_file->file == NULL || imgfs_file->metadata == NULL) return;
+
+    // without state, nothing is reused anyway
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return;
+
+    struct blob_move freed[NB_RES];
+    size_t nb_freed = 0;
+    int err = refs_remove(imgfs_file, slot, freed, &nb_freed);
+    if (err == ERR_NONE && nb_freed == 0) return;
+
+    // the blobs freed are kept from the holes until they can be reused
+    struct imgfs_alloc* alloc = alloc_of(state);
+    struct released* record = alloc == NULL ? NULL : calloc(1, sizeof(struct released));
+    if (err != ERR_NONE || record == NULL) {
+        // forgotten, they would be holes at once: wait for the readers instead
+        rcu_synchronize();
+        alloc_reset(imgfs_file);
+        refs_free(imgfs_file);
+        return;
+    }
+    for (size_t i = 0; i < nb_freed; ++i) {
+        record->extents[i] = (struct extent) {
+            freed[i].from, freed[i].size
+        };
+    }
+    record->count = nb_freed;
+    record->position = wal_position(imgfs_file);
+    atomic_init(&record->grace, GRACE_RUNNING);
+    *alloc->released_tail = record;
+    alloc->released_tail = &record->next;
+    rcu_retire(record, grace_passed);
+}
+
+void alloc_reset(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->alloc == NULL) return;
+    forget_extents(state->alloc);
+}
+
+void alloc_discard(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->alloc == NULL) return;
+    forget_extents(state->alloc);
+    forget_released(state->alloc);
+}
+
+void alloc_free(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->alloc == NULL) return;
+    forget_extents(state->alloc);
+    forget_released(state->alloc);
+    free(state->alloc);
+    state->alloc = NULL;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file imgfs_alloc.h
+ * @brief Reuse of the room freed by deletions.
+ *
+ * The allocator keeps the free extents of the content area: the holes
+ * left by blobs that no valid slot refers to any more (deduplicated
+ * slots share their blobs, so a blob only becomes free with its last
+ * slot). They are kept both in offset order, to merge neighbours, and
+ * in size order, so that a new blob goes to the smallest hole it fits
+ * in. Only when no hole fits is it appended at the end of the file,
+ * and a hole reaching the end of the file is cut off the file instead.
+ *
+ * The room of a deleted blob is not reused at once: readers without
+ * lock may still be sending it from the mapping of the file (see
+ * imgfs_rcu.h). It is handed to rcu_retire(), and only becomes a hole
+ * once they have all left their read section (and, in WAL mode, once the
+ * deletion is durable).
+ *
+ * The free extents are worked out from the metadata the first time they
+ * are needed, and simply forgotten (to be worked out again) whenever
+ * blobs are moved around, by do_grow() or by compaction. An imgfs_file
+ * without state (see imgfs_state.h) always appends.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_alloc; // free extents, see imgfs_alloc.c
+
+/**
+ * @brief Finds room for a new blob, and takes it.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param size The size of the blob.
+ * @param offset Where to put the offset at which the blob must be written.
+ * @return Some error code. 0 if no error.
+ */
+int alloc_take(struct imgfs_file* imgfs_file, uint32_t size, uint64_t* offset);
+
+/**
+ * @brief Gives back the blobs of a slot that no valid slot refers to any more.
+ *
+ * Must be called once the slot is no longer valid, but still holds its
+ * offsets and sizes. The blobs become holes once no reader may read them
+ * any more. Should the bookkeeping fail, it waits for the readers, and
+ * the free extents are simply worked out again at the next allocation.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot just deleted.
+ */
+void alloc_release(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Forgets the free extents, after an allocated room could not be
+ *        written. The deleted blobs still waiting for their readers keep
+ *        waiting.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void alloc_reset(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Forgets the free extents and the deleted blobs waiting for their
+ *        readers, after blobs were moved: the caller made sure that no
+ *        reader may still read from the room of any deleted blob.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void alloc_discard(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Releases the allocator (if any).
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void alloc_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,231 @@
+/**
+ * @file imgfs_blobs.c
+ * @brief Moving image contents around inside an imgFS (see imgfs_blobs.h).
+ */
+
+#define _GNU_SOURCE // for copy_file_range()
+
+#include "imgfs_blobs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_refs.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h> // for SSIZE_MAX
+#include <stdlib.h>
+#include <unistd.h>
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+int blobs_compare(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct blob_move*) a)->from;
+    const uint64_t y = ((const struct blob_move*) b)->from;
+    return (x > y) - (x < y);
+}
+
+uint64_t blobs_start(const struct imgfs_header* header)
+{
+    return sizeof(struct imgfs_header) + (uint64_t) header->max_files * sizeof(struct img_metadata)
+           + index_disk_size(header);
+}
+
+int blobs_collect(const struct imgfs_file* imgfs_file, uint64_t first, uint64_t limit, size_t max,
+                  struct blob_move** blobs, size_t* count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(blobs);
+    M_REQUIRE_NON_NULL(count);
+
+    // an open imgFS knows its blobs without walking the metadata
+    if (state_of(imgfs_file) != NULL) return refs_collect(imgfs_file, first, limit, max, blobs, count);
+
+    size_t capacity = 16;
+    *count = 0;
+    *blobs = calloc(capacity, sizeof(struct blob_move));
+    if (*blobs == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            const uint64_t offset = metadata->offset[res];
+            if (metadata->size[res] == 0 || offset < first || offset >= limit) continue;
+
+            if (*count == capacity) {
+                capacity *= 2;
+                struct blob_move* larger = realloc(*blobs, capacity * sizeof(struct blob_move));
+                if (larger == NULL) {
+                    free(*blobs);
+                    *blobs = NULL;
+                    return ERR_OUT_OF_MEMORY;
+                }
+                *blobs = larger;
+            }
+            (*blobs)[*count].from = offset;
+            (*blobs)[*count].to = offset;
+            (*blobs)[*count].size = metadata->size[res];
+            ++*count;
+        }
+    }
+
+    qsort(*blobs, *count, sizeof(struct blob_move), blobs_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < *count; ++i) {
+        if (unique == 0 || (*blobs)[unique - 1].from != (*blobs)[i].from) {
+            (*blobs)[unique++] = (*blobs)[i];
+        }
+    }
+    *count = MIN(unique, max);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Plain copy through a buffer, when copy_file_range() is not available
+ * (or refuses overlapping ranges). Copying forward, each chunk is read
+ * before anything is written over it when the destination is lower.
+ */
+static int copy_buffered(int in, off_t from, int out, off_t to, uint64_t size)
+{
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = ERR_NONE;
+    while (size > 0 && err == ERR_NONE) {
+        const size_t chunk = (size_t) MIN(size, (uint64_t) COPY_BUFFER_SIZE);
+        const ssize_t got = pread(in, buffer, chunk, from);
+        if (got <= 0) {
+            err = ERR_IO;
+            break;
+        }
+        for (ssize_t done = 0; done < got; ) {
+            const ssize_t put = pwrite(out, buffer + done, (size_t) (got - done), to + done);
+            if (put <= 0) {
+                err = ERR_IO;
+                break;
+            }
+            done += put;
+        }
+        from += got;
+        to += got;
+        size -= (uint64_t) got;
+    }
+
+    free(buffer);
+    return err;
+}
+
+int blobs_copy(FILE* in, uint64_t from, FILE* out, uint64_t to, uint64_t size)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(out);
+    if (fflush(in) != 0 || fflush(out) != 0) return ERR_IO;
+
+    const int fd_in = fileno(in);
+    const int fd_out = fileno(out);
+    off_t off_in = (off_t) from;
+    off_t off_out = (off_t) to;
+
+    while (size > 0) {
+        const ssize_t copied = copy_file_range(fd_in, &off_in, fd_out, &off_out,
+                                               (size_t) MIN(size, (uint64_t) SSIZE_MAX), 0);
+        if (copied > 0) {
+            size -= (uint64_t) copied;
+        } else if (copied < 0 && errno == EINTR) {
+            continue;
+        } else if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                                  || errno == EOPNOTSUPP)) {
+            return copy_buffered(fd_in, off_in, fd_out, off_out, size);
+        } else {
+            return ERR_IO; // error, or end of file before the end of the blob
+        }
+    }
+    return ERR_NONE;
+}
+
+static int compare_slots(const void* a, const void* b)
+{
+    const uint32_t x = *(const uint32_t*) a;
+    const uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************
+ * Points the offsets of a slot referring to moved blobs to their new
+ * place, and writes the slot if any did.
+ */
+static int repoint_slot(struct imgfs_file* imgfs_file, uint32_t slot,
+                        const struct blob_move* moves, size_t count)
+{
+    struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    if (metadata->is_valid != NON_EMPTY) return ERR_NONE;
+
+    int moved = 0;
+    for (int res = 0; res < NB_RES; ++res) {
+        const uint64_t offset = metadata->offset[res];
+        if (metadata->size[res] == 0 || offset < moves[0].from || offset > moves[count - 1].from) continue;
+
+        const struct blob_move key = { offset, 0, 0 };
+        const struct blob_move* blob = bsearch(&key, moves, count, sizeof(struct blob_move),
+                                               blobs_compare);
+        if (blob == NULL || blob->to == offset) continue;
+        metadata->offset[res] = blob->to;
+        moved = 1;
+    }
+    if (!moved) return ERR_NONE;
+
+    if (io_write_at(imgfs_file->file, metadata, sizeof(struct img_metadata),
+                    sizeof(struct imgfs_header) + (uint64_t) slot * sizeof(struct img_metadata)) != ERR_NONE) {
+        return ERR_IO;
+    }
+    snapshot_update(imgfs_file, slot);
+    return ERR_NONE;
+}
+
+int blobs_repoint(struct imgfs_file* imgfs_file, const struct blob_move* moves, size_t count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (count == 0) return ERR_NONE;
+    M_REQUIRE_NON_NULL(moves);
+
+    // in place, so nothing older may be left in the log to replay over it
+    int err = wal_checkpoint(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    // the slots of the moved blobs, or else all of them; each only once,
+    // as a blob may have moved where another one was
+    uint32_t* slots = NULL;
+    size_t nb_slots = 0;
+    if (state_of(imgfs_file) != NULL && refs_slots(imgfs_file, moves, count, &slots, &nb_slots) == ERR_NONE) {
+        qsort(slots, nb_slots, sizeof(uint32_t), compare_slots);
+        for (size_t i = 0; i < nb_slots && err == ERR_NONE; ++i) {
+            if (i == 0 || slots[i] != slots[i - 1]) err = repoint_slot(imgfs_file, slots[i], moves, count);
+        }
+        free(slots);
+    } else {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE; ++i) {
+            err = repoint_slot(imgfs_file, i, moves, count);
+        }
+    }
+    if (err != ERR_NONE) {
+        refs_free(imgfs_file); // no longer matches the metadata
+        return err;
+    }
+    refs_repoint(imgfs_file, moves, count);
+    return ERR_NONE;
+}
+
+int blobs_sync(FILE* file)
+{
+    M_REQUIRE_NON_NULL(file);
+    if (fflush(file) != 0 || fdatasync(fileno(file)) != 0) return ERR_IO;
+    return ERR_NONE;
+}
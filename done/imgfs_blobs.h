@@ -0,0 +1,104 @@
+/**
+ * @file imgfs_blobs.h
+ * @brief Moving image contents around inside an imgFS.
+ *
+ * A blob is the content of one resolution of an image, stored at
+ * metadata.offset[res] for metadata.size[res] bytes. Deduplicated slots
+ * share their blobs, so a blob may be referred to by several slots:
+ * moving it means copying its bytes, then rewriting every offset that
+ * points to it.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @struct blob_move
+ * @brief A blob, and where it is moved to.
+ *
+ * @param from Current offset of the blob.
+ * @param to   New offset of the blob.
+ * @param size Size of the blob.
+ */
+struct blob_move {
+    uint64_t from;
+    uint64_t to;
+    uint32_t size;
+};
+
+/**
+ * @brief Position of the first blob of an imgFS, right after its metadata
+ *        (and its on-disk index, if any).
+ *
+ * @param header The header of the imgFS.
+ * @return The offset of the content area.
+ */
+uint64_t blobs_start(const struct imgfs_header* header);
+
+/**
+ * @brief Orders blob moves by from, for qsort() and bsearch().
+ */
+int blobs_compare(const void* a, const void* b);
+
+/**
+ * @brief Lists the blobs starting in [first, limit), in offset order and
+ *        without duplicates: at most max of them, the first ones. Their
+ *        destination is set to where they are.
+ *
+ * An open imgFS gets them from its table of references (see imgfs_refs.h),
+ * other imgfs_file by a scan of the metadata.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param first Lowest offset to consider.
+ * @param limit Offset from which blobs are no longer considered.
+ * @param max Most blobs to list, SIZE_MAX for all.
+ * @param blobs Where to put the (allocated) list, to be freed by the caller.
+ * @param count Where to put the number of blobs.
+ * @return Some error code. 0 if no error.
+ */
+int blobs_collect(const struct imgfs_file* imgfs_file, uint64_t first, uint64_t limit, size_t max,
+                  struct blob_move** blobs, size_t* count);
+
+/**
+ * @brief Copies size bytes from offset from of in to offset to of out.
+ *
+ * Uses copy_file_range() when the kernel supports it, and large
+ * sequential reads and writes otherwise. Both files are flushed first;
+ * the copy does not go through their stdio buffers. When in and out are
+ * the same file, the two ranges may only overlap if to is below from
+ * (as memmove() would), which is how the compaction slides blobs down.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int blobs_copy(FILE* in, uint64_t from, FILE* out, uint64_t to, uint64_t size);
+
+/**
+ * @brief Points every offset referring to a moved blob to its new place,
+ *        in memory and on disk. An open imgFS finds the slots to rewrite
+ *        through its table of references, other imgfs_file by a scan.
+ *
+ * @param imgfs_file The main in-memory structure, with its file open for writing.
+ * @param moves The blobs, sorted by from (as given by blobs_collect()).
+ * @param count The number of blobs.
+ * @return Some error code. 0 if no error.
+ */
+int blobs_repoint(struct imgfs_file* imgfs_file, const struct blob_move* moves, size_t count);
+
+/**
+ * @brief Flushes the file and waits for its data to reach the disk.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int blobs_sync(FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
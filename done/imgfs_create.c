@@ -1,4 +1,7 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 
@@ -19,8 +22,13 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     strncpy(imgfs_file->header.name, CAT_TXT, MAX_IMGFS_NAME+1);  // Note: using CAT_TXT seems like a placeholder. Check correctness.
     imgfs_file->header.version = 0;  // Starting version number.
     imgfs_file->header.nb_files = 0;  // No files initially.
-    imgfs_file->header.unused_32 = 0;  // Clear unused data.
-    imgfs_file->header.unused_64 = 0;  // Clear unused data.
+    if (imgfs_file->header.unused_32 != IMGFS_FORMAT_INDEXED) {
+        imgfs_file->header.unused_32 = IMGFS_FORMAT_BASIC;  // Anything else is the original format.
+    }
+    // The on-disk ID index (if any) goes right after the metadata.
+    imgfs_file->header.unused_64 = imgfs_file->header.unused_32 == IMGFS_FORMAT_INDEXED ?
+                                   sizeof(struct imgfs_header) +
+                                   (uint64_t) imgfs_file->header.max_files * sizeof(struct img_metadata) : 0;
 
     // Attempt to create the file for the file system.
     imgfs_file->file = fopen(imgfs_filename, "wb");
@@ -29,7 +37,7 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     }
 
     // Write the initialized header to the file.
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+    if (io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
         fclose(imgfs_file->file);  // Close the file if write fails.
         imgfs_file->file = NULL;  // Nullify the file pointer.
         return ERR_IO;  // Return write error.
@@ -45,7 +53,8 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
 
     // Write the empty metadata for each file slot to the file.
     size_t metadata_count = imgfs_file->header.max_files;
-    if (fwrite(imgfs_file->metadata, sizeof(struct img_metadata), metadata_count, imgfs_file->file) != metadata_count) {
+    if (io_write_at(imgfs_file->file, imgfs_file->metadata, metadata_count * sizeof(struct img_metadata),
+                    sizeof(struct imgfs_header)) != ERR_NONE) {
         free(imgfs_file->metadata);  // Free metadata memory.
         fclose(imgfs_file->file);  // Close the file.
         imgfs_file->file = NULL;  // Nullify the file pointer.
@@ -53,6 +62,25 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
         return ERR_IO;  // Return write error.
     }
 
+    // Write the (empty) on-disk ID index, if the format has one.
+    int err = ERR_NONE;
+    if (imgfs_file->header.unused_32 == IMGFS_FORMAT_INDEXED) {
+        err = index_disk_create(imgfs_file);
+    }
+
+    // Build the (empty) lookup index so that the structure can be used right away.
+    struct imgfs_state* state = NULL;
+    if (err == ERR_NONE) err = state_attach(imgfs_file, &state);
+    if (err == ERR_NONE) err = index_build(imgfs_file, 0);
+    if (err != ERR_NONE) {
+        state_detach(imgfs_file);
+        free(imgfs_file->metadata);
+        fclose(imgfs_file->file);
+        imgfs_file->file = NULL;
+        imgfs_file->metadata = NULL;
+        return err;
+    }
+
     // Print confirmation of successful operations.
     printf("%zu item(s) written\n", 1 + metadata_count);
 
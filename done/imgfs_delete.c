@@ -1,4 +1,11 @@
 #include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_derived.h"
+#include "imgfs_durability.h"
+#include "imgfs_io.h"
+#include "imgfs_index.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_wal.h"
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 
@@ -7,6 +14,89 @@
 #include <inttypes.h>
 #include "error.h"
 
+/*******************************************************************
+ * Writes the deletion of slot i to the file: its metadata, then the header.
+ */
+static int write_deletion(struct imgfs_file* imgfs_file, uint32_t i)
+{
+    // Update the metadata in the file.
+    if (io_write_at(imgfs_file->file, &imgfs_file->metadata[i], sizeof(struct img_metadata),
+                    sizeof(struct imgfs_header) + (uint64_t) i * sizeof(struct img_metadata)) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    // Decrement the number of files and increment the version of the file system.
+    imgfs_file->header.nb_files--;
+    imgfs_file->header.version++;
+
+    // Update the file system header in the file.
+    if (io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+static int delete_slot(struct imgfs_file* imgfs_file, uint32_t i); // deletes its derived images
+
+/*******************************************************************
+ * Deletes the images derived from that of slot i, if any was stored.
+ * They are found by its ID through the index, whatever their kind
+ * and number, without looking at the other slots.
+ */
+static int delete_derived(struct imgfs_file* imgfs_file, uint32_t i)
+{
+    if (!(imgfs_file->metadata[i].unused_16 & IMG_HAS_DERIVED)) return ERR_NONE;
+
+    char img_id[MAX_IMG_ID + 1];
+    strncpy(img_id, imgfs_file->metadata[i].img_id, MAX_IMG_ID);
+    img_id[MAX_IMG_ID] = '\0';
+
+    for (uint32_t j = index_find_derived(imgfs_file, img_id); j != INDEX_NO_SLOT;
+         j = index_find_derived(imgfs_file, img_id)) {
+        const int err = delete_slot(imgfs_file, j);
+        if (err != ERR_NONE) return err;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Deletes the (valid) image of slot i.
+ */
+static int delete_slot(struct imgfs_file* imgfs_file, uint32_t i)
+{
+    // Its derived images go first: they are of no use without it.
+    int err = delete_derived(imgfs_file, i);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    err = index_remove(imgfs_file, i);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    imgfs_file->metadata[i].is_valid = EMPTY; // Mark the metadata entry as empty.
+    snapshot_update(imgfs_file, i);
+
+    if (wal_active(imgfs_file)) {
+        // In WAL mode, the metadata and the header go to the log instead.
+        imgfs_file->header.nb_files--;
+        imgfs_file->header.version++;
+        err = wal_append(imgfs_file, i);
+    } else {
+        err = write_deletion(imgfs_file, i);
+    }
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // The blobs no other image shares can now be reused.
+    alloc_release(imgfs_file, i);
+
+    // Sync now, later or never, depending on the durability policy.
+    return durability_commit(imgfs_file);
+}
+
 int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
 {
     // Validate the input parameters to ensure they are not null.
@@ -23,41 +113,24 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
         return ERR_IMAGE_NOT_FOUND;
     }
 
-    int found = 0; // This will be set to 1 if the image is found and deleted.
-    uint32_t i = 0; // Index to iterate through metadata entries.
-
-    // Loop through metadata entries to find and delete the image.
-    while (found != 1 && i < imgfs_file->header.max_files) {
-        if (imgfs_file->metadata[i].is_valid == NON_EMPTY &&
-            strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID) == 0) {
-            imgfs_file->metadata[i].is_valid = EMPTY; // Mark the metadata entry as empty.
-
-            // Update the metadata in the file.
-            fseek(imgfs_file->file, sizeof(struct imgfs_header) + i * sizeof(struct img_metadata), SEEK_SET);
-            if (fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-                return ERR_IO;
-            }
-
-            found = 1; // Indicate that the image has been found and marked for deletion.
-        }
-        ++i;
-    }
+    // Find the image through the index.
+    const uint32_t i = index_find_id(imgfs_file, img_id, INDEX_NO_SLOT);
 
     // If the image was not found, return an error.
-    if (!found) {
+    if (i == INDEX_NO_SLOT) {
         return ERR_IMAGE_NOT_FOUND;
     }
 
-    // Decrement the number of files and increment the version of the file system.
-    imgfs_file->header.nb_files--;
-    imgfs_file->header.version++;
+    return delete_slot(imgfs_file, i);
+}
 
-    // Update the file system header in the file.
-    fseek(imgfs_file->file, 0, SEEK_SET);
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
-    }
+int derived_evict(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (imgfs_file->file == NULL) return ERR_IO;
 
-    return ERR_NONE; // Return success if the image was deleted successfully.
-}
+    const uint32_t i = index_find_derived(imgfs_file, NULL);
+    if (i == INDEX_NO_SLOT) return ERR_IMGFS_FULL;
 
+    return delete_slot(imgfs_file, i);
+}
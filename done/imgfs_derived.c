@@ -0,0 +1,126 @@
+/**
+ * @file imgfs_derived.c
+ * @brief IDs and geometry of the derived images (see imgfs_derived.h).
+ */
+
+#include "imgfs_derived.h"
+#include "error.h"
+
+#include <stdio.h>  // for snprintf
+#include <stdlib.h> // for strtoul
+#include <string.h> // for strchr
+
+/*******************************************************************
+ * The size of a level, from that of the original.
+ */
+static uint32_t level_size(uint32_t size, uint32_t level)
+{
+    if (level >= 32) return size > 0;
+    return (uint32_t) (((uint64_t) size + (1ull << level) - 1) >> level);
+}
+
+/*******************************************************************/
+uint32_t tile_levels(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    while (level_size(width, levels - 1) > TILE_SIZE || level_size(height, levels - 1) > TILE_SIZE) {
+        ++levels;
+    }
+    return levels;
+}
+
+/*******************************************************************/
+int tile_exists(uint32_t width, uint32_t height, uint32_t level, uint32_t x, uint32_t y)
+{
+    if (width == 0 || height == 0 || level >= tile_levels(width, height)) return 0;
+    return (uint64_t) x * TILE_SIZE < level_size(width, level)
+           && (uint64_t) y * TILE_SIZE < level_size(height, level);
+}
+
+/*******************************************************************/
+int tile_id(const char* img_id, uint32_t level, uint32_t x, uint32_t y, char tile_id[MAX_IMG_ID + 1])
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(tile_id);
+
+    const int length = snprintf(tile_id, MAX_IMG_ID + 1, "%ctile:%u:%u:%u%c%s",
+                                DERIVED_MARK, level, x, y, DERIVED_MARK, img_id);
+    return length < 0 || length > MAX_IMG_ID ? ERR_INVALID_IMGID : ERR_NONE;
+}
+
+/*******************************************************************
+ * Reads a dimension of a bucket, up to the given end.
+ */
+static int parse_dimension(const char* text, char** end, uint32_t* dimension)
+{
+    if (*text < '0' || *text > '9') return ERR_INVALID_ARGUMENT;
+    const unsigned long value = strtoul(text, end, 10);
+    if (value == 0 || value > UINT16_MAX) return ERR_INVALID_ARGUMENT; // as resized_res
+    *dimension = (uint32_t) value;
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+int size_buckets_parse(const char* text, struct size_buckets* buckets)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(buckets);
+
+    buckets->count = 0;
+    const char* at = text;
+    for (;;) {
+        if (buckets->count == MAX_SIZE_BUCKETS) return ERR_INVALID_ARGUMENT;
+        uint32_t width = 0, height = 0;
+        char* end = NULL;
+        int err = parse_dimension(at, &end, &width);
+        if (err != ERR_NONE) return err;
+        height = width;
+        if (*end == 'x') {
+            err = parse_dimension(end + 1, &end, &height);
+            if (err != ERR_NONE) return err;
+        }
+        if (*end != ',' && *end != '\0') return ERR_INVALID_ARGUMENT;
+
+        // insertion by area
+        uint32_t i = buckets->count++;
+        for (; i > 0 && (uint64_t) buckets->width[i - 1] * buckets->height[i - 1] > (uint64_t) width * height; --i) {
+            buckets->width[i] = buckets->width[i - 1];
+            buckets->height[i] = buckets->height[i - 1];
+        }
+        buckets->width[i] = width;
+        buckets->height[i] = height;
+        if (*end == '\0') break;
+        at = end + 1;
+    }
+
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+uint32_t size_bucket(const struct size_buckets* buckets, uint32_t width, uint32_t height)
+{
+    if (buckets == NULL || buckets->count == 0) return 0;
+    for (uint32_t i = 0; i < buckets->count; ++i) {
+        if (buckets->width[i] >= width && buckets->height[i] >= height) return i;
+    }
+    return buckets->count - 1;
+}
+
+/*******************************************************************/
+int sized_id(const char* img_id, uint32_t width, uint32_t height, char sized_id[MAX_IMG_ID + 1])
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(sized_id);
+
+    const int length = snprintf(sized_id, MAX_IMG_ID + 1, "%csize:%ux%u%c%s",
+                                DERIVED_MARK, width, height, DERIVED_MARK, img_id);
+    return length < 0 || length > MAX_IMG_ID ? ERR_INVALID_IMGID : ERR_NONE;
+}
+
+/*******************************************************************/
+const char* derived_parent(const char* derived_id)
+{
+    if (derived_id == NULL || !IS_DERIVED_ID(derived_id)) return NULL;
+    const char* mark = strchr(derived_id + 1, DERIVED_MARK);
+    return mark == NULL ? NULL : mark + 1;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file imgfs_derived.h
+ * @brief Images derived from the stored ones (tiles, variants of any size),
+ *        stored as images of their own.
+ *
+ * struct img_metadata has room for three variants only. Anything else
+ * computed from an image is thus stored in a slot of its own, under an
+ * ID no image inserted by a user can have: DERIVED_MARK, what it is,
+ * DERIVED_MARK again, then the ID of its image. It is then read (from
+ * the snapshot without lock), logged, deduplicated and compacted as any
+ * image, but neither listed nor insertable through do_insert().
+ *
+ * The slot of an image some derived images were stored for has
+ * IMG_HAS_DERIVED in its unused_16, so that do_delete() deletes them
+ * with it, and only then looks for them, by its ID through the index
+ * (see index_find_derived()). Those derived images make the variant
+ * table of the image, of any length.
+ *
+ * They are a cache: they only take the slots the images inserted by
+ * the users leave free, and are dropped to make room for the latter
+ * once the imgFS is full (they are computed again when requested).
+ *
+ * Tiles: level 0 is the original at full size, each next level halves
+ * it (rounding up), up to the first level that fits in a single tile.
+ * Tile (x, y) of a level is its square of TILE_SIZE pixels at column x
+ * and row y, cut at the right and bottom edges.
+ *
+ * Sized variants: the image fit in a box, as the thumbnail and small
+ * variants, but of any size. Requested sizes are snapped to a few boxes
+ * (the buckets), so that an image has a bounded number of them.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file, MAX_IMG_ID
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DERIVED_MARK '\x1f' // first character of the ID of a derived image
+#define IS_DERIVED_ID(img_id) ((img_id)[0] == DERIVED_MARK)
+#define IMG_HAS_DERIVED 0x1 // in img_metadata.unused_16
+
+#define TILE_SIZE 256
+
+#define MAX_SIZE_BUCKETS 16
+#define DEFAULT_SIZE_BUCKETS "128,256,512,1024,2048"
+
+/**
+ * @brief The boxes the sized variants fit in, from the smallest.
+ */
+struct size_buckets {
+    uint32_t count;
+    uint32_t width[MAX_SIZE_BUCKETS];
+    uint32_t height[MAX_SIZE_BUCKETS];
+};
+
+/**
+ * @brief Gives the number of levels of the tiles of an image.
+ *
+ * @param width The width of the original.
+ * @param height Its height.
+ * @return The number of levels, at least 1.
+ */
+uint32_t tile_levels(uint32_t width, uint32_t height);
+
+/**
+ * @brief Tells whether an image has a given tile.
+ *
+ * @param width The width of the original.
+ * @param height Its height.
+ * @param level The level of the tile.
+ * @param x Its column.
+ * @param y Its row.
+ * @return 1 if the tile is within the image, 0 otherwise.
+ */
+int tile_exists(uint32_t width, uint32_t height, uint32_t level, uint32_t x, uint32_t y);
+
+/**
+ * @brief Makes the ID a tile of an image is stored under.
+ *
+ * @param img_id The ID of the image.
+ * @param level The level of the tile.
+ * @param x Its column.
+ * @param y Its row.
+ * @param tile_id Where to put the ID.
+ * @return Some error code (ERR_INVALID_IMGID if the ID of the image is too long
+ *         for that of its tiles: they are then not stored). 0 if no error.
+ */
+int tile_id(const char* img_id, uint32_t level, uint32_t x, uint32_t y, char tile_id[MAX_IMG_ID + 1]);
+
+/**
+ * @brief Reads buckets given on a command line: comma-separated boxes,
+ *        each "WxH", or "N" for N x N (e.g. DEFAULT_SIZE_BUCKETS).
+ *
+ * @param text The text to read.
+ * @param buckets Where to put the buckets, sorted by area.
+ * @return Some error code. 0 if no error.
+ */
+int size_buckets_parse(const char* text, struct size_buckets* buckets);
+
+/**
+ * @brief Snaps a requested size to a bucket: the smallest that holds it,
+ *        or the largest if none does.
+ *
+ * @param buckets The buckets.
+ * @param width The width requested, 0 if only the height is.
+ * @param height The height requested, 0 if only the width is.
+ * @return The index of the bucket.
+ */
+uint32_t size_bucket(const struct size_buckets* buckets, uint32_t width, uint32_t height);
+
+/**
+ * @brief Makes the ID a sized variant of an image is stored under.
+ *
+ * @param img_id The ID of the image.
+ * @param width The width of its box.
+ * @param height The height of its box.
+ * @param sized_id Where to put the ID.
+ * @return Some error code (ERR_INVALID_IMGID if the ID of the image is too long:
+ *         the variant is then not stored). 0 if no error.
+ */
+int sized_id(const char* img_id, uint32_t width, uint32_t height, char sized_id[MAX_IMG_ID + 1]);
+
+/**
+ * @brief Gives the ID of the image a derived image derives from.
+ *
+ * @param derived_id The ID of the derived image.
+ * @return What follows its second DERIVED_MARK, NULL if not a derived ID.
+ */
+const char* derived_parent(const char* derived_id);
+
+/**
+ * @brief Stores an image derived from another one, as do_insert(), and
+ *        marks the latter as having derived images (see imgfs_insert.c).
+ *
+ * @param image_buffer The derived image.
+ * @param image_size Its size.
+ * @param derived_id Its ID (see tile_id(), sized_id()).
+ * @param img_id The ID of the image it derives from.
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code (ERR_DUPLICATE_ID if already stored, ERR_IMGFS_FULL
+ *         if no slot is free: images are never dropped for it). 0 if no error.
+ */
+int derived_insert(const char* image_buffer, size_t image_size, const char* derived_id,
+                   const char* img_id, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Deletes one of the derived images, to make room for an image
+ *        inserted by a user (see imgfs_delete.c).
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code (ERR_IMGFS_FULL if there is none). 0 if no error.
+ */
+int derived_evict(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,183 @@
+/**
+ * @file imgfs_durability.c
+ * @brief When the changes made to an imgFS reach the disk (see imgfs_durability.h).
+ *
+ * A sync is that of the log in WAL mode (see imgfs_wal.h), otherwise
+ * that of the whole file (stdio buffer, then fdatasync()). The periodic
+ * sync of DURABILITY_BATCHED runs without the lock serializing the
+ * operations: it only flushes what stdio holds and syncs the descriptor,
+ * and wal_sync() may be called without that lock anyway.
+ */
+
+#include "imgfs.h"
+#include "imgfs_blobs.h"
+#include "imgfs_durability.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <errno.h>     // for ETIMEDOUT
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>      // for clock_gettime
+
+struct imgfs_durability {
+    enum durability_mode mode;
+    uint32_t interval_ms;
+    struct imgfs_file* imgfs_file; // the one given to durability_start()
+    pthread_t thread;
+    int running;                   // the thread was started
+    pthread_mutex_t lock;          // for the fields below
+    pthread_cond_t wakeup;
+    uint64_t dirty;                // operations committed since the last sync
+    int stopping;
+    int failed;                    // error of the last periodic sync, not reported yet
+};
+
+static struct imgfs_durability* durability_of(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_state* state = state_of(imgfs_file);
+    return state == NULL ? NULL : state->durability;
+}
+
+/*******************************************************************
+ * Makes everything done so far durable.
+ */
+static int sync_now(struct imgfs_file* imgfs_file)
+{
+    if (wal_active(imgfs_file)) return wal_sync(imgfs_file, wal_position(imgfs_file));
+    return blobs_sync(imgfs_file->file);
+}
+
+/*******************************************************************
+ * The thread of DURABILITY_BATCHED.
+ */
+static void* batch_loop(void* arg)
+{
+    struct imgfs_durability* durability = arg;
+
+    pthread_mutex_lock(&durability->lock);
+    while (!durability->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += durability->interval_ms / 1000;
+        deadline.tv_nsec += (long) (durability->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!durability->stopping
+               && pthread_cond_timedwait(&durability->wakeup, &durability->lock, &deadline) != ETIMEDOUT) {
+        }
+        if (durability->stopping || durability->dirty == 0) continue;
+
+        durability->dirty = 0;
+        pthread_mutex_unlock(&durability->lock);
+        const int err = sync_now(durability->imgfs_file);
+        pthread_mutex_lock(&durability->lock);
+        if (err != ERR_NONE) durability->failed = err;
+    }
+    pthread_mutex_unlock(&durability->lock);
+    return NULL;
+}
+
+/*******************************************************************/
+int durability_parse(const char* text, enum durability_mode* mode, uint32_t* interval_ms)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(mode);
+    M_REQUIRE_NON_NULL(interval_ms);
+
+    *interval_ms = DURABILITY_DEFAULT_INTERVAL_MS;
+    if (strcmp(text, "none") == 0) {
+        *mode = DURABILITY_NONE;
+    } else if (strcmp(text, "sync") == 0) {
+        *mode = DURABILITY_PER_OP;
+    } else if (strncmp(text, "batched", strlen("batched")) == 0) {
+        const char* rest = text + strlen("batched");
+        if (*rest == ':') {
+            *interval_ms = atouint32(rest + 1);
+            if (*interval_ms == 0) return ERR_INVALID_ARGUMENT;
+        } else if (*rest != '\0') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        *mode = DURABILITY_BATCHED;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+int durability_start(struct imgfs_file* imgfs_file, enum durability_mode mode, uint32_t interval_ms)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+    if (mode == DURABILITY_BATCHED && interval_ms == 0) return ERR_INVALID_ARGUMENT;
+
+    durability_stop(imgfs_file);
+    if (mode == DURABILITY_NONE) return ERR_NONE;
+
+    struct imgfs_durability* durability = calloc(1, sizeof(struct imgfs_durability));
+    if (durability == NULL) return ERR_OUT_OF_MEMORY;
+    durability->mode = mode;
+    durability->interval_ms = interval_ms;
+    durability->imgfs_file = imgfs_file;
+    pthread_mutex_init(&durability->lock, NULL);
+    pthread_cond_init(&durability->wakeup, NULL);
+
+    if (mode == DURABILITY_BATCHED) {
+        if (pthread_create(&durability->thread, NULL, batch_loop, durability) != 0) {
+            pthread_cond_destroy(&durability->wakeup);
+            pthread_mutex_destroy(&durability->lock);
+            free(durability);
+            return ERR_THREADING;
+        }
+        durability->running = 1;
+    }
+
+    state->durability = durability;
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+int durability_commit(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_durability* durability = durability_of(imgfs_file);
+    if (durability == NULL) return ERR_NONE;
+
+    if (durability->mode == DURABILITY_PER_OP) return sync_now(imgfs_file);
+
+    pthread_mutex_lock(&durability->lock);
+    durability->dirty++;
+    const int err = durability->failed;
+    durability->failed = ERR_NONE;
+    pthread_mutex_unlock(&durability->lock);
+    return err;
+}
+
+/*******************************************************************/
+void durability_stop(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->durability == NULL) return;
+    struct imgfs_durability* durability = state->durability;
+
+    if (durability->running) {
+        pthread_mutex_lock(&durability->lock);
+        durability->stopping = 1;
+        pthread_cond_signal(&durability->wakeup);
+        pthread_mutex_unlock(&durability->lock);
+        pthread_join(durability->thread, NULL);
+    }
+    if (durability->dirty > 0 || durability->failed != ERR_NONE) {
+        (void) sync_now(imgfs_file);
+    }
+
+    state->durability = NULL;
+    pthread_cond_destroy(&durability->wakeup);
+    pthread_mutex_destroy(&durability->lock);
+    free(durability);
+}
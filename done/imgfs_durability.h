@@ -0,0 +1,84 @@
+/**
+ * @file imgfs_durability.h
+ * @brief When the changes made to an imgFS reach the disk.
+ *
+ * By default (DURABILITY_NONE), insertions, deletions and lazy resizes
+ * are left to stdio and to the kernel: a crash may lose any of them.
+ * DURABILITY_BATCHED has a background thread sync the file (or the log,
+ * in WAL mode) every so often, when something changed: a crash loses at
+ * most the last interval. DURABILITY_PER_OP syncs before every operation
+ * returns.
+ *
+ * The policy is set after opening and lasts until do_close(), which
+ * syncs what the background thread did not yet.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DURABILITY_DEFAULT_INTERVAL_MS 1000 // between two syncs, in DURABILITY_BATCHED
+
+/**
+ * @brief The durability policies.
+ */
+enum durability_mode {
+    DURABILITY_NONE,    // no sync at all
+    DURABILITY_BATCHED, // periodic sync in the background
+    DURABILITY_PER_OP   // sync before every operation returns
+};
+
+struct imgfs_durability; // the policy and its thread, see imgfs_durability.c
+
+/**
+ * @brief Reads a policy given on a command line: "none", "batched",
+ *        "batched:<milliseconds>" or "sync".
+ *
+ * @param text The text to read.
+ * @param mode Where to put the policy.
+ * @param interval_ms Where to put the interval between two syncs
+ *        (DURABILITY_DEFAULT_INTERVAL_MS if none was given).
+ * @return Some error code. 0 if no error.
+ */
+int durability_parse(const char* text, enum durability_mode* mode, uint32_t* interval_ms);
+
+/**
+ * @brief Sets the policy of an imgFS open for writing.
+ *
+ * The imgfs_file must stay where it is until do_close(): the background
+ * thread of DURABILITY_BATCHED refers to it.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param mode The policy.
+ * @param interval_ms The interval between two syncs, for DURABILITY_BATCHED.
+ * @return Some error code. 0 if no error.
+ */
+int durability_start(struct imgfs_file* imgfs_file, enum durability_mode mode, uint32_t interval_ms);
+
+/**
+ * @brief Called at the end of every operation that changed the imgFS:
+ *        syncs it, marks it for the next periodic sync, or does nothing,
+ *        depending on the policy.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code (including that of a failed periodic sync). 0 if no error.
+ */
+int durability_commit(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Stops the background thread (if any), after a last sync if
+ *        something changed since the previous one.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void durability_stop(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,251 @@
+/**
+ * @file imgfs_gbcollect.c
+ * @brief Reclaims the room of deleted images and orphaned resized variants.
+ *
+ * do_gbcollect() rewrites the whole imgFS into a new, compact, file and
+ * then replaces the original with it.
+ *
+ * do_gbcollect_step() compacts an open imgFS in place, a few blobs at a
+ * time, so that a server can interleave it with requests: the live
+ * blobs are slid down, in offset order, over the holes left before them,
+ * and the file is truncated once a pass has reached its end. A moved
+ * blob is only overwritten after every offset that referred to it has
+ * been pointed to its copy and synced, so a crash at any point leaves
+ * every valid slot pointing to an intact blob.
+ */
+
+#include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_blobs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <stdio.h>    // for rename
+#include <stdlib.h>
+#include <string.h>
+
+#define GC_BATCH 64 // blobs looked up at once by do_gbcollect_step()
+
+/*******************************************************************
+ * Writes the whole header and metadata of an imgFS.
+ */
+static int write_header_and_metadata(struct imgfs_file* imgfs_file)
+{
+    const size_t count = imgfs_file->header.max_files;
+    if (io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE
+        || io_write_at(imgfs_file->file, imgfs_file->metadata, count * sizeof(struct img_metadata),
+                       sizeof(struct imgfs_header)) != ERR_NONE) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Copies every live blob of source, in offset order, one after the
+ * other at the beginning of the content area of target, and gives
+ * target the metadata of source pointing to these copies.
+ */
+static int copy_live_content(const struct imgfs_file* source, struct imgfs_file* target)
+{
+    struct blob_move* blobs = NULL;
+    size_t count = 0;
+    int err = blobs_collect(source, 0, UINT64_MAX, SIZE_MAX, &blobs, &count);
+    if (err != ERR_NONE) return err;
+
+    uint64_t to = blobs_start(&target->header);
+    for (size_t i = 0; i < count && err == ERR_NONE; ++i) {
+        blobs[i].to = to;
+        err = blobs_copy(source->file, blobs[i].from, target->file, to, blobs[i].size);
+        to += blobs[i].size;
+    }
+
+    // the metadata, still pointing to the blobs of source, then repointed
+    for (uint32_t i = 0; i < target->header.max_files; ++i) {
+        if (source->metadata[i].is_valid == NON_EMPTY) {
+            target->metadata[i] = source->metadata[i];
+        }
+    }
+    if (err == ERR_NONE) err = write_header_and_metadata(target);
+    if (err == ERR_NONE) err = blobs_repoint(target, blobs, count);
+
+    free(blobs);
+    return err;
+}
+
+int do_gbcollect(const char* imgfs_path, const char* imgfs_tmp_bkp_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_path);
+    M_REQUIRE_NON_NULL(imgfs_tmp_bkp_path);
+
+    struct imgfs_file source;
+    zero_init_var(source);
+    int err = do_open(imgfs_path, "rb", &source);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_file target;
+    zero_init_var(target);
+    target.header.max_files = source.header.max_files;
+    memcpy(target.header.resized_res, source.header.resized_res, sizeof(target.header.resized_res));
+    target.header.unused_32 = source.header.unused_32;
+    err = do_create(imgfs_tmp_bkp_path, &target);
+    if (err == ERR_NONE) {
+        // reopened for reading too, as filling the on-disk index reads it back
+        do_close(&target);
+        err = do_open(imgfs_tmp_bkp_path, "rb+", &target);
+    }
+    if (err != ERR_NONE) {
+        do_close(&source);
+        remove(imgfs_tmp_bkp_path);
+        return err;
+    }
+
+    // same slots, so that the image IDs keep their place in the on-disk index
+    memcpy(target.header.name, source.header.name, sizeof(target.header.name));
+    target.header.nb_files = source.header.nb_files;
+    target.header.version = source.header.version + 1;
+
+    err = copy_live_content(&source, &target);
+    if (err == ERR_NONE && target.header.unused_32 == IMGFS_FORMAT_INDEXED) {
+        err = index_disk_create(&target);
+    }
+    if (err == ERR_NONE) err = blobs_sync(target.file);
+
+    do_close(&source);
+    do_close(&target);
+    if (err == ERR_NONE && rename(imgfs_tmp_bkp_path, imgfs_path) != 0) err = ERR_IO;
+    if (err != ERR_NONE) remove(imgfs_tmp_bkp_path);
+    return err;
+}
+
+/*******************************************************************
+ * Makes some moves durable: their copies first, then the offsets
+ * pointing to them.
+ */
+static int publish(struct imgfs_file* imgfs_file, const struct blob_move* moves, size_t count)
+{
+    if (count == 0) return ERR_NONE;
+
+    int err = blobs_sync(imgfs_file->file);
+    if (err == ERR_NONE) err = blobs_repoint(imgfs_file, moves, count);
+    if (err == ERR_NONE) err = blobs_sync(imgfs_file->file);
+    return err;
+}
+
+/*******************************************************************
+ * Moves a blob to a destination overlapping it, through a copy at the
+ * end of the file, which is truncated back afterwards.
+ */
+static int move_through_end(struct imgfs_file* imgfs_file, const struct blob_move* blob)
+{
+    uint64_t end = 0;
+    if (io_size(imgfs_file->file, &end) != ERR_NONE) return ERR_IO;
+
+    const struct blob_move out = { blob->from, end, blob->size };
+    const struct blob_move back = { end, blob->to, blob->size };
+    int err = blobs_copy(imgfs_file->file, out.from, imgfs_file->file, out.to, out.size);
+    if (err == ERR_NONE) err = publish(imgfs_file, &out, 1);
+    if (err == ERR_NONE) err = blobs_copy(imgfs_file->file, back.from, imgfs_file->file, back.to, back.size);
+    if (err == ERR_NONE) err = publish(imgfs_file, &back, 1);
+    if (err == ERR_NONE) err = io_truncate(imgfs_file->file, end);
+    return err;
+}
+
+/*******************************************************************
+ * Ends a compaction pass: nothing live is left after state->gc_to.
+ */
+static int end_pass(struct imgfs_file* imgfs_file, struct imgfs_state* state)
+{
+    uint64_t end = 0;
+    int err = blobs_sync(imgfs_file->file);
+    if (err == ERR_NONE) err = io_size(imgfs_file->file, &end);
+    if (err == ERR_NONE && end > state->gc_to) err = io_truncate(imgfs_file->file, state->gc_to);
+    state->gc_from = 0;
+    return err;
+}
+
+/*******************************************************************
+ * Slides some blobs, in offset order, down to state->gc_to, until
+ * budget bytes were copied (the first blob is always handled).
+ */
+static int compact(struct imgfs_file* imgfs_file, struct imgfs_state* state,
+                   struct blob_move* blobs, size_t count, size_t budget, size_t* copied)
+{
+    // Copies are published by groups: a group ends before a copy would
+    // overwrite a blob whose offsets still point to its old place.
+    int err = ERR_NONE;
+    size_t pending = 0;
+    size_t i = 0;
+    for (; i < count && err == ERR_NONE && (i == 0 || *copied < budget); ++i) {
+        struct blob_move* blob = &blobs[i];
+        blob->to = state->gc_to;
+        const uint64_t end = blob->to + blob->size;
+
+        if (blob->to == blob->from) {
+            // already in place
+        } else if (end > blob->from) {
+            err = publish(imgfs_file, blobs + pending, i - pending);
+            if (err == ERR_NONE) err = move_through_end(imgfs_file, blob);
+            pending = i + 1;
+            *copied += 2 * (size_t) blob->size;
+        } else {
+            if (pending < i && end > blobs[pending].from) {
+                err = publish(imgfs_file, blobs + pending, i - pending);
+                pending = i;
+            }
+            if (err == ERR_NONE) err = blobs_copy(imgfs_file->file, blob->from, imgfs_file->file,
+                                                      blob->to, blob->size);
+            *copied += blob->size;
+        }
+        if (err == ERR_NONE) {
+            state->gc_to = end;
+            state->gc_from = blob->from + blob->size;
+        }
+    }
+    if (err == ERR_NONE) err = publish(imgfs_file, blobs + pending, i - pending);
+    return err;
+}
+
+int do_gbcollect_step(struct imgfs_file* imgfs_file, size_t budget, size_t* copied, int* finished)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(copied);
+    M_REQUIRE_NON_NULL(finished);
+    *copied = 0;
+    *finished = 0;
+
+    // the cursors of the pass live with the rest of the run-time state
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+    if (state->gc_from == 0) {
+        state->gc_from = state->gc_to = blobs_start(&imgfs_file->header);
+    }
+
+    // the holes change with every step, and are overwritten: their deletions must be durable
+    alloc_discard(imgfs_file);
+    int err = wal_checkpoint(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    // The blobs are looked up a few at a time, from where the pass is:
+    // a step costs what it copies, not what the imgFS holds.
+    do {
+        struct blob_move* blobs = NULL;
+        size_t count = 0;
+        err = blobs_collect(imgfs_file, state->gc_from, UINT64_MAX, GC_BATCH, &blobs, &count);
+        if (err != ERR_NONE) break;
+        if (count == 0) {
+            free(blobs);
+            *finished = 1;
+            return end_pass(imgfs_file, state);
+        }
+        err = compact(imgfs_file, state, blobs, count, budget, copied);
+        free(blobs);
+    } while (err == ERR_NONE && *copied < budget);
+
+    if (err != ERR_NONE) state->gc_from = 0; // restart from scratch next time
+    return err;
+}
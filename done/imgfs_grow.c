@@ -0,0 +1,141 @@
+/**
+ * @file imgfs_grow.c
+ * @brief Enlarges the metadata table of an open imgFS, in place.
+ *
+ * The metadata (and the on-disk ID index, if any) must stay contiguous
+ * after the header, so growing them overwrites the first bytes of the
+ * content area. The blobs stored there are first copied to the end of
+ * the file, and the offsets referring to them are rewritten; all the
+ * other blobs stay where they are.
+ */
+
+#include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_blobs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+/*******************************************************************
+ * Copies the blobs to the end of the file (but not before limit),
+ * and sets where each of them went.
+ */
+static int move_blobs(FILE* file, struct blob_move* blobs, size_t count, uint64_t limit)
+{
+    if (count == 0) return ERR_NONE;
+
+    uint64_t end = 0;
+    if (io_size(file, &end) != ERR_NONE) return ERR_IO;
+
+    uint64_t to = MAX(end, limit);
+    int err = ERR_NONE;
+    for (size_t i = 0; i < count && err == ERR_NONE; ++i) {
+        blobs[i].to = to;
+        err = blobs_copy(file, blobs[i].from, file, to, blobs[i].size);
+        to += blobs[i].size;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Writes the new, empty, metadata slots [first, last).
+ */
+static int write_empty_slots(FILE* file, uint32_t first, uint32_t last)
+{
+    static const struct img_metadata empty[64];
+
+    for (uint32_t slot = first; slot < last; ) {
+        const size_t count = MIN((size_t) (last - slot), sizeof(empty) / sizeof(empty[0]));
+        if (io_write_at(file, empty, count * sizeof(struct img_metadata),
+                        sizeof(struct imgfs_header) + (uint64_t) slot * sizeof(struct img_metadata)) != ERR_NONE) {
+            return ERR_IO;
+        }
+        slot += (uint32_t) count;
+    }
+    return ERR_NONE;
+}
+
+int do_grow(uint32_t max_files, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (max_files <= imgfs_file->header.max_files) return ERR_MAX_FILES;
+
+    // everything below is written in place
+    int err = wal_checkpoint(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_header grown = imgfs_file->header;
+    grown.max_files = max_files;
+    if (grown.unused_32 == IMGFS_FORMAT_INDEXED) {
+        grown.unused_64 = sizeof(struct imgfs_header) + (uint64_t) max_files * sizeof(struct img_metadata);
+    }
+    const uint64_t limit = blobs_start(&grown);
+
+    // First move away the blobs in the way, and point the metadata to their copies.
+    // A crash must find the metadata pointing to complete copies: those
+    // are durable before the metadata change, which is durable before
+    // the originals get overwritten.
+    struct blob_move* blobs = NULL;
+    size_t count = 0;
+    err = blobs_collect(imgfs_file, 0, limit, SIZE_MAX, &blobs, &count);
+    if (err == ERR_NONE) err = move_blobs(imgfs_file->file, blobs, count, limit);
+    if (err == ERR_NONE && count > 0) err = blobs_sync(imgfs_file->file);
+    if (err == ERR_NONE) err = blobs_repoint(imgfs_file, blobs, count);
+    if (err == ERR_NONE && count > 0) err = blobs_sync(imgfs_file->file);
+    free(blobs);
+    if (err != ERR_NONE) return err;
+
+    // The new slots overwrite the current on-disk index, if any: the
+    // header first stops pointing to it (durably), so that a crash leaves
+    // a file of the basic format, without an index, but sound. The same
+    // goes for the in-memory header, should a later step fail.
+    const struct imgfs_header old_header = imgfs_file->header;
+    struct imgfs_header fallback = old_header;
+    if (old_header.unused_32 == IMGFS_FORMAT_INDEXED) {
+        fallback.unused_32 = IMGFS_FORMAT_BASIC;
+        err = io_write_at(imgfs_file->file, &fallback, sizeof(struct imgfs_header), 0);
+        if (err == ERR_NONE) err = blobs_sync(imgfs_file->file);
+        if (err != ERR_NONE) return err;
+    }
+
+    // Then the room is free for the new slots, and for the new on-disk index.
+    const uint32_t old_max_files = old_header.max_files;
+    err = write_empty_slots(imgfs_file->file, old_max_files, max_files);
+    if (err != ERR_NONE) {
+        imgfs_file->header = fallback;
+        return err;
+    }
+
+    imgfs_file->header = grown;
+    err = state_resize_metadata(imgfs_file, old_max_files);
+    if (err != ERR_NONE) {
+        imgfs_file->header = fallback;
+        return err;
+    }
+    // the content area moved: a running compaction pass starts over,
+    // and the holes are worked out again
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state != NULL) state->gc_from = 0;
+    alloc_discard(imgfs_file);
+
+    err = index_resize(imgfs_file);
+    if (err == ERR_NONE && grown.unused_32 == IMGFS_FORMAT_INDEXED) {
+        err = index_disk_create(imgfs_file);
+    }
+    if (err != ERR_NONE) {
+        imgfs_file->header = fallback;
+        return err;
+    }
+
+    // The header goes last, once the new table is complete (and durable).
+    err = blobs_sync(imgfs_file->file);
+    if (err != ERR_NONE) return err;
+    imgfs_file->header.version++;
+    return io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+}
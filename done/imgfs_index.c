@@ -0,0 +1,744 @@
+/**
+ * @file imgfs_index.c
+ * @brief In-memory lookup structures for imgFS (see imgfs_index.h).
+ *
+ * A third table finds the images derived from an image (see
+ * imgfs_derived.h) by the ID of the latter: it holds one entry per
+ * derived image, under the hash of the ID it derives from.
+ *
+ * All tables use linear probing over a power-of-two number of entries.
+ * Each entry stores the hash of the key next to the slot number, so that
+ * most mismatches are rejected without touching the metadata. Every hit
+ * is still checked against the metadata itself, which stays the only
+ * source of truth.
+ *
+ * Free slots are tracked in a bitmap of 64-bit words (bit set = free),
+ * searched with a find-first-set from the lowest word that may still
+ * have a free bit.
+ *
+ * The metadata is indexed incrementally, in slot order: a lazy index
+ * starts empty and only scans as far as lookups require, so that with a
+ * mapped imgFS only the metadata pages actually needed are loaded.
+ */
+
+#include "imgfs.h"
+#include "imgfs_derived.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
+#include "util.h"
+
+#include <stdlib.h>   // for malloc, free
+#include <string.h>   // for memcmp, memset, strncmp, strnlen
+
+#define ENTRY_FREE    UINT32_MAX
+#define ENTRY_DELETED (UINT32_MAX - 1)
+#define MIN_CAPACITY  16
+
+struct slot_entry {
+    uint32_t hash;
+    uint32_t slot;
+};
+
+struct slot_table {
+    struct slot_entry* entries;
+    size_t capacity;  // always a power of two
+    size_t used;      // live entries
+    size_t deleted;   // tombstones
+};
+
+struct imgfs_index {
+    struct slot_table ids;   // image ID -> slot
+    struct slot_table shas;  // content SHA -> slot (one entry per slot)
+    struct slot_table parents; // ID derived from -> slot (one entry per derived image)
+    uint64_t* free_slots;    // bitmap, bit set = free slot
+    size_t nb_words;         // number of words in free_slots
+    size_t first_word;       // no free slot in the words before this one
+    uint32_t scanned;        // slots [0, scanned) are in the index
+    uint32_t nb_valid;       // number of valid slots among them
+};
+
+#define WORD_BITS 64
+
+/*******************************************************************
+ * FNV-1a hash of an image ID.
+ */
+static uint32_t hash_id(const char* img_id)
+{
+    uint32_t h = 2166136261u;
+    const size_t len = strnlen(img_id, MAX_IMG_ID);
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t) img_id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*******************************************************************
+ * A SHA256 digest is already uniformly distributed: use its first bytes.
+ */
+static uint32_t hash_sha(const uint8_t* sha)
+{
+    return (uint32_t) sha[0] | (uint32_t) sha[1] << 8
+           | (uint32_t) sha[2] << 16 | (uint32_t) sha[3] << 24;
+}
+
+/*******************************************************************
+ * Generic table handling.
+ */
+static int table_alloc(struct slot_table* table, size_t capacity)
+{
+    table->entries = malloc(capacity * sizeof(struct slot_entry));
+    if (table->entries == NULL) return ERR_OUT_OF_MEMORY;
+
+    // all bits set is ENTRY_FREE
+    memset(table->entries, 0xff, capacity * sizeof(struct slot_entry));
+    table->capacity = capacity;
+    table->used = 0;
+    table->deleted = 0;
+    return ERR_NONE;
+}
+
+static size_t capacity_for(size_t count)
+{
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < 2 * count) capacity <<= 1;
+    return capacity;
+}
+
+static void table_place(struct slot_table* table, uint32_t hash, uint32_t slot)
+{
+    const size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    size_t tombstone = SIZE_MAX;
+
+    while (table->entries[i].slot != ENTRY_FREE) {
+        if (table->entries[i].slot == ENTRY_DELETED && tombstone == SIZE_MAX) {
+            tombstone = i;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (tombstone != SIZE_MAX) {
+        i = tombstone;
+        --table->deleted;
+    }
+    table->entries[i].hash = hash;
+    table->entries[i].slot = slot;
+    ++table->used;
+}
+
+static int table_rehash(struct slot_table* table, size_t capacity)
+{
+    struct slot_table bigger;
+    int err = table_alloc(&bigger, capacity);
+    if (err != ERR_NONE) return err;
+
+    for (size_t i = 0; i < table->capacity; ++i) {
+        const struct slot_entry* e = &table->entries[i];
+        if (e->slot != ENTRY_FREE && e->slot != ENTRY_DELETED) {
+            table_place(&bigger, e->hash, e->slot);
+        }
+    }
+
+    free(table->entries);
+    *table = bigger;
+    return ERR_NONE;
+}
+
+static int table_insert(struct slot_table* table, uint32_t hash, uint32_t slot)
+{
+    // keep the load (tombstones included) under 3/4
+    if (4 * (table->used + table->deleted + 1) > 3 * table->capacity) {
+        int err = table_rehash(table, capacity_for(table->used + 1));
+        if (err != ERR_NONE) return err;
+    }
+    table_place(table, hash, slot);
+    return ERR_NONE;
+}
+
+static void table_erase(struct slot_table* table, uint32_t hash, uint32_t slot)
+{
+    const size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask; table->entries[i].slot != ENTRY_FREE; i = (i + 1) & mask) {
+        if (table->entries[i].slot == slot) {
+            table->entries[i].slot = ENTRY_DELETED;
+            --table->used;
+            ++table->deleted;
+            return;
+        }
+    }
+}
+
+/*******************************************************************
+ * Checks whether a slot holds the valid image img_id.
+ */
+static int slot_has_id(const struct imgfs_file* imgfs_file, uint32_t slot,
+                       const char* img_id)
+{
+    return slot < imgfs_file->header.max_files
+           && imgfs_file->metadata[slot].is_valid == NON_EMPTY
+           && strncmp(imgfs_file->metadata[slot].img_id, img_id, MAX_IMG_ID) == 0;
+}
+
+/*******************************************************************
+ * Checks whether a slot holds a valid image derived from img_id
+ * (from any image if img_id is NULL).
+ */
+static int slot_derives_from(const struct imgfs_file* imgfs_file, uint32_t slot,
+                             const char* img_id)
+{
+    if (slot >= imgfs_file->header.max_files
+        || imgfs_file->metadata[slot].is_valid != NON_EMPTY) return 0;
+
+    const char* parent = derived_parent(imgfs_file->metadata[slot].img_id);
+    return parent != NULL && (img_id == NULL || strncmp(parent, img_id, MAX_IMG_ID) == 0);
+}
+
+/*******************************************************************
+ * Checks whether a slot holds a valid image with content sha.
+ */
+static int slot_has_sha(const struct imgfs_file* imgfs_file, uint32_t slot,
+                        const uint8_t* sha)
+{
+    return slot < imgfs_file->header.max_files
+           && imgfs_file->metadata[slot].is_valid == NON_EMPTY
+           && memcmp(imgfs_file->metadata[slot].SHA, sha, SHA256_DIGEST_LENGTH) == 0;
+}
+
+/*******************************************************************
+ * Adds one slot to the tables.
+ */
+static int index_insert_slot(struct imgfs_index* index,
+                             const struct img_metadata* metadata, uint32_t slot)
+{
+    int err = table_insert(&index->ids, hash_id(metadata->img_id), slot);
+    if (err != ERR_NONE) return err;
+
+    err = table_insert(&index->shas, hash_sha(metadata->SHA), slot);
+    const char* parent = derived_parent(metadata->img_id);
+    if (err == ERR_NONE && parent != NULL) {
+        err = table_insert(&index->parents, hash_id(parent), slot);
+        if (err != ERR_NONE) table_erase(&index->shas, hash_sha(metadata->SHA), slot);
+    }
+    if (err != ERR_NONE) {
+        table_erase(&index->ids, hash_id(metadata->img_id), slot);
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Removes one slot from the tables.
+ */
+static void index_erase_slot(struct imgfs_index* index,
+                             const struct img_metadata* metadata, uint32_t slot)
+{
+    table_erase(&index->ids, hash_id(metadata->img_id), slot);
+    table_erase(&index->shas, hash_sha(metadata->SHA), slot);
+    const char* parent = derived_parent(metadata->img_id);
+    if (parent != NULL) table_erase(&index->parents, hash_id(parent), slot);
+}
+
+static void index_release(struct imgfs_index* index)
+{
+    if (index == NULL) return;
+
+    free(index->ids.entries);
+    free(index->shas.entries);
+    free(index->parents.entries);
+    free(index->free_slots);
+    free(index);
+}
+
+/*******************************************************************
+ * Free-slot bitmap handling.
+ */
+static void mark_free(struct imgfs_index* index, uint32_t slot)
+{
+    const size_t word = slot / WORD_BITS;
+    index->free_slots[word] |= UINT64_C(1) << (slot % WORD_BITS);
+    if (word < index->first_word) index->first_word = word;
+}
+
+static void mark_used(struct imgfs_index* index, uint32_t slot)
+{
+    index->free_slots[slot / WORD_BITS] &= ~(UINT64_C(1) << (slot % WORD_BITS));
+}
+
+/*******************************************************************
+ * Incremental scan of the metadata. The slots before index->scanned
+ * are in the index; the ones after it have not been looked at yet.
+ * Once as many valid slots as header.nb_files have been seen, the
+ * remaining ones are known to be empty and are never touched.
+ */
+static int scan_one(const struct imgfs_file* imgfs_file, struct imgfs_index* index)
+{
+    const uint32_t slot = index->scanned;
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+
+    if (metadata->is_valid == NON_EMPTY) {
+        const int err = index_insert_slot(index, metadata, slot);
+        if (err != ERR_NONE) return err;
+        ++index->nb_valid;
+    } else {
+        mark_free(index, slot);
+    }
+    ++index->scanned;
+    return ERR_NONE;
+}
+
+static int has_unscanned_images(const struct imgfs_file* imgfs_file, const struct imgfs_index* index)
+{
+    return index->scanned < imgfs_file->header.max_files
+           && index->nb_valid < imgfs_file->header.nb_files;
+}
+
+/*******************************************************************
+ * Scans up to the next valid slot, and returns it (or INDEX_NO_SLOT).
+ */
+static uint32_t scan_next_image(const struct imgfs_file* imgfs_file, struct imgfs_index* index)
+{
+    while (has_unscanned_images(imgfs_file, index)) {
+        const uint32_t slot = index->scanned;
+        if (scan_one(imgfs_file, index) != ERR_NONE) return INDEX_NO_SLOT;
+        if (imgfs_file->metadata[slot].is_valid == NON_EMPTY) return slot;
+    }
+    return INDEX_NO_SLOT;
+}
+
+/*******************************************************************
+ * On-disk ID index (IMGFS_FORMAT_INDEXED). It is a table of
+ * struct slot_entry, with linear probing, stored at header.unused_64.
+ * Its capacity only depends on header.max_files, and stays at least
+ * twice the number of images: entries are removed by shifting the
+ * rest of their cluster back, so there are never any tombstones.
+ * It is written in place even in WAL mode, ahead of the log: the
+ * replay of a log rebuilds it (see wal_replay()).
+ */
+#define DISK_CHUNK 64  // entries read at once while probing
+
+static int has_disk_index(const struct imgfs_file* imgfs_file)
+{
+    return imgfs_file->file != NULL
+           && imgfs_file->header.unused_32 == IMGFS_FORMAT_INDEXED
+           && imgfs_file->header.unused_64 != 0;
+}
+
+static uint64_t disk_capacity(const struct imgfs_header* header)
+{
+    uint64_t capacity = MIN_CAPACITY;
+    while (capacity < 2 * (uint64_t) header->max_files) capacity <<= 1;
+    return capacity;
+}
+
+static uint64_t disk_offset(const struct imgfs_header* header, uint64_t pos)
+{
+    return header->unused_64 + pos * sizeof(struct slot_entry);
+}
+
+static int disk_read(FILE* file, const struct imgfs_header* header, uint64_t pos,
+                     struct slot_entry* entries, size_t count)
+{
+    return io_read_at(file, entries, count * sizeof(struct slot_entry), disk_offset(header, pos));
+}
+
+static int disk_write(FILE* file, const struct imgfs_header* header, uint64_t pos,
+                      const struct slot_entry* entry)
+{
+    return io_write_at(file, entry, sizeof(struct slot_entry), disk_offset(header, pos));
+}
+
+/*******************************************************************
+ * Looks img_id up in the on-disk index. Reads the probed entries by
+ * chunks, so that a lookup usually costs a single read.
+ */
+static int disk_find_id(const struct imgfs_file* imgfs_file, const char* img_id,
+                        uint32_t skip, uint32_t* found)
+{
+    const struct imgfs_header* header = &imgfs_file->header;
+    const uint64_t mask = disk_capacity(header) - 1;
+    const uint32_t hash = hash_id(img_id);
+    struct slot_entry chunk[DISK_CHUNK];
+
+    *found = INDEX_NO_SLOT;
+    uint64_t pos = hash & mask;
+    for (uint64_t probed = 0; probed <= mask; ) {
+        // do not read past the end of the table: wrap around instead
+        const size_t count = (size_t) MIN((uint64_t) DISK_CHUNK, mask + 1 - pos);
+        int err = disk_read(imgfs_file->file, header, pos, chunk, count);
+        if (err != ERR_NONE) return err;
+
+        for (size_t i = 0; i < count; ++i) {
+            const struct slot_entry* e = &chunk[i];
+            if (e->slot == ENTRY_FREE) return ERR_NONE;
+            if (e->hash == hash && e->slot != skip && slot_has_id(imgfs_file, e->slot, img_id)) {
+                *found = e->slot;
+                return ERR_NONE;
+            }
+        }
+        probed += count;
+        pos = (pos + count) & mask;
+    }
+    return ERR_NONE;
+}
+
+static int disk_add(const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    const struct imgfs_header* header = &imgfs_file->header;
+    const uint64_t mask = disk_capacity(header) - 1;
+    const struct slot_entry entry = { hash_id(imgfs_file->metadata[slot].img_id), slot };
+
+    for (uint64_t pos = entry.hash & mask, probed = 0; probed <= mask; pos = (pos + 1) & mask, ++probed) {
+        struct slot_entry current;
+        int err = disk_read(imgfs_file->file, header, pos, &current, 1);
+        if (err != ERR_NONE) return err;
+        if (current.slot == slot) return ERR_NONE;  // already there
+        if (current.slot == ENTRY_FREE) return disk_write(imgfs_file->file, header, pos, &entry);
+    }
+    return ERR_IMGFS_FULL;
+}
+
+static int disk_remove(const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    const struct imgfs_header* header = &imgfs_file->header;
+    const uint64_t mask = disk_capacity(header) - 1;
+    struct slot_entry current;
+
+    // find the entry of the slot
+    uint64_t hole = hash_id(imgfs_file->metadata[slot].img_id) & mask;
+    for (uint64_t probed = 0; ; hole = (hole + 1) & mask, ++probed) {
+        if (probed > mask) return ERR_NONE;
+        int err = disk_read(imgfs_file->file, header, hole, &current, 1);
+        if (err != ERR_NONE) return err;
+        if (current.slot == ENTRY_FREE) return ERR_NONE;  // not there
+        if (current.slot == slot) break;
+    }
+
+    // move back the entries of the cluster which can no longer be reached
+    for (uint64_t pos = (hole + 1) & mask; pos != hole; pos = (pos + 1) & mask) {
+        int err = disk_read(imgfs_file->file, header, pos, &current, 1);
+        if (err != ERR_NONE) return err;
+        if (current.slot == ENTRY_FREE) break;
+
+        // an entry stays where it is if its home lies cyclically in (hole, pos]
+        const uint64_t home = current.hash & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            err = disk_write(imgfs_file->file, header, hole, &current);
+            if (err != ERR_NONE) return err;
+            hole = pos;
+        }
+    }
+
+    const struct slot_entry free_entry = { ENTRY_FREE, ENTRY_FREE };
+    return disk_write(imgfs_file->file, header, hole, &free_entry);
+}
+
+/*******************************************************************
+ * The index of an open imgFS, NULL if it has none.
+ */
+static struct imgfs_index* index_of(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_state* state = state_of(imgfs_file);
+    return state == NULL ? NULL : state->index;
+}
+
+/*******************************************************************
+ * Public interface.
+ */
+int index_build(struct imgfs_file* imgfs_file, int lazy)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+    index_release(state->index);
+    state->index = NULL;
+
+    struct imgfs_index* index = calloc(1, sizeof(struct imgfs_index));
+    if (index == NULL) return ERR_OUT_OF_MEMORY;
+
+    const size_t capacity = capacity_for(imgfs_file->header.nb_files);
+    int err = table_alloc(&index->ids, capacity);
+    if (err == ERR_NONE) err = table_alloc(&index->shas, capacity);
+    // derived images are few, if any: that table grows with them
+    if (err == ERR_NONE) err = table_alloc(&index->parents, MIN_CAPACITY);
+
+    index->nb_words = ((size_t) imgfs_file->header.max_files + WORD_BITS - 1) / WORD_BITS;
+    index->free_slots = calloc(index->nb_words, sizeof(uint64_t));
+    if (err == ERR_NONE && index->free_slots == NULL) err = ERR_OUT_OF_MEMORY;
+
+    while (!lazy && err == ERR_NONE && has_unscanned_images(imgfs_file, index)) {
+        err = scan_one(imgfs_file, index);
+    }
+    index->first_word = 0;
+    if (err != ERR_NONE) {
+        index_release(index);
+        return err;
+    }
+
+    state->index = index;
+    return ERR_NONE;
+}
+
+void index_free(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return;
+
+    index_release(state->index);
+    state->index = NULL;
+}
+
+uint64_t index_disk_size(const struct imgfs_header* header)
+{
+    if (header == NULL || header->unused_32 != IMGFS_FORMAT_INDEXED) return 0;
+    return disk_capacity(header) * sizeof(struct slot_entry);
+}
+
+int index_disk_create(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (!has_disk_index(imgfs_file)) return ERR_INVALID_ARGUMENT;
+
+    struct slot_entry empty[DISK_CHUNK];
+    memset(empty, 0xff, sizeof(empty));  // all bits set is ENTRY_FREE
+
+    const uint64_t capacity = disk_capacity(&imgfs_file->header);
+    for (uint64_t written = 0; written < capacity; written += DISK_CHUNK) {
+        const size_t count = (size_t) MIN((uint64_t) DISK_CHUNK, capacity - written);
+        if (io_write_at(imgfs_file->file, empty, count * sizeof(struct slot_entry),
+                        disk_offset(&imgfs_file->header, written)) != ERR_NONE) {
+            return ERR_IO;
+        }
+    }
+
+    int err = ERR_NONE;
+    for (uint32_t slot = 0; slot < imgfs_file->header.max_files && err == ERR_NONE; ++slot) {
+        if (imgfs_file->metadata[slot].is_valid == NON_EMPTY) {
+            err = disk_add(imgfs_file, slot);
+        }
+    }
+    return err;
+}
+
+int index_resize(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index == NULL) return ERR_NONE;
+
+    // the slots beyond the old bitmap are unscanned: their bits get set when scanned
+    const size_t nb_words = ((size_t) imgfs_file->header.max_files + WORD_BITS - 1) / WORD_BITS;
+    if (nb_words <= index->nb_words) return ERR_NONE;
+
+    uint64_t* larger = realloc(index->free_slots, nb_words * sizeof(uint64_t));
+    if (larger == NULL) return ERR_OUT_OF_MEMORY;
+    memset(larger + index->nb_words, 0, (nb_words - index->nb_words) * sizeof(uint64_t));
+    index->free_slots = larger;
+    index->nb_words = nb_words;
+    return ERR_NONE;
+}
+
+int index_scanning(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_index* index = index_of(imgfs_file);
+    return index != NULL && has_unscanned_images(imgfs_file, index);
+}
+
+int index_finish_scan(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    struct imgfs_index* index = index_of(imgfs_file);
+    int err = ERR_NONE;
+    while (index != NULL && err == ERR_NONE && has_unscanned_images(imgfs_file, index)) {
+        err = scan_one(imgfs_file, index);
+    }
+    return err;
+}
+
+uint32_t index_find_id(const struct imgfs_file* imgfs_file, const char* img_id, uint32_t skip)
+{
+    if (imgfs_file == NULL || img_id == NULL || imgfs_file->metadata == NULL) return INDEX_NO_SLOT;
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (has_disk_index(imgfs_file) && (index == NULL || has_unscanned_images(imgfs_file, index))) {
+        // a few reads of the on-disk index are cheaper than scanning the metadata
+        uint32_t found = INDEX_NO_SLOT;
+        if (disk_find_id(imgfs_file, img_id, skip, &found) == ERR_NONE) return found;
+        // unreadable on-disk index: fall back to the metadata
+    }
+
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+            if (i != skip && slot_has_id(imgfs_file, i, img_id)) return i;
+        }
+        return INDEX_NO_SLOT;
+    }
+
+    const struct slot_table* table = &index->ids;
+    const uint32_t hash = hash_id(img_id);
+    const size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask; table->entries[i].slot != ENTRY_FREE; i = (i + 1) & mask) {
+        const struct slot_entry* e = &table->entries[i];
+        if (e->hash == hash && e->slot != skip && slot_has_id(imgfs_file, e->slot, img_id)) {
+            return e->slot;
+        }
+    }
+
+    // not indexed yet: go on scanning the metadata
+    for (uint32_t slot = scan_next_image(imgfs_file, index); slot != INDEX_NO_SLOT;
+         slot = scan_next_image(imgfs_file, index)) {
+        if (slot != skip && slot_has_id(imgfs_file, slot, img_id)) return slot;
+    }
+    return INDEX_NO_SLOT;
+}
+
+uint32_t index_find_sha(const struct imgfs_file* imgfs_file, const uint8_t* sha, uint32_t skip)
+{
+    if (imgfs_file == NULL || sha == NULL || imgfs_file->metadata == NULL) return INDEX_NO_SLOT;
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+            if (i != skip && slot_has_sha(imgfs_file, i, sha)) return i;
+        }
+        return INDEX_NO_SLOT;
+    }
+
+    const struct slot_table* table = &index->shas;
+    const uint32_t hash = hash_sha(sha);
+    const size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask; table->entries[i].slot != ENTRY_FREE; i = (i + 1) & mask) {
+        const struct slot_entry* e = &table->entries[i];
+        if (e->hash == hash && e->slot != skip && slot_has_sha(imgfs_file, e->slot, sha)) {
+            return e->slot;
+        }
+    }
+
+    // not indexed yet: go on scanning the metadata
+    for (uint32_t slot = scan_next_image(imgfs_file, index); slot != INDEX_NO_SLOT;
+         slot = scan_next_image(imgfs_file, index)) {
+        if (slot != skip && slot_has_sha(imgfs_file, slot, sha)) return slot;
+    }
+    return INDEX_NO_SLOT;
+}
+
+uint32_t index_find_derived(const struct imgfs_file* imgfs_file, const char* img_id)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL) return INDEX_NO_SLOT;
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+            if (slot_derives_from(imgfs_file, i, img_id)) return i;
+        }
+        return INDEX_NO_SLOT;
+    }
+
+    const struct slot_table* table = &index->parents;
+    if (img_id != NULL) {
+        const uint32_t hash = hash_id(img_id);
+        const size_t mask = table->capacity - 1;
+        for (size_t i = hash & mask; table->entries[i].slot != ENTRY_FREE; i = (i + 1) & mask) {
+            const struct slot_entry* e = &table->entries[i];
+            if (e->hash == hash && slot_derives_from(imgfs_file, e->slot, img_id)) return e->slot;
+        }
+    } else {
+        // the table only holds derived images: any live entry will do
+        for (size_t i = 0; i < table->capacity; ++i) {
+            const struct slot_entry* e = &table->entries[i];
+            if (e->slot != ENTRY_FREE && e->slot != ENTRY_DELETED
+                && slot_derives_from(imgfs_file, e->slot, NULL)) return e->slot;
+        }
+    }
+
+    // not indexed yet: go on scanning the metadata
+    for (uint32_t slot = scan_next_image(imgfs_file, index); slot != INDEX_NO_SLOT;
+         slot = scan_next_image(imgfs_file, index)) {
+        if (slot_derives_from(imgfs_file, slot, img_id)) return slot;
+    }
+    return INDEX_NO_SLOT;
+}
+
+uint32_t index_find_free_slot(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL) return INDEX_NO_SLOT;
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index == NULL) {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+            if (imgfs_file->metadata[i].is_valid == EMPTY) return i;
+        }
+        return INDEX_NO_SLOT;
+    }
+
+    while (index->first_word < index->nb_words) {
+        const uint64_t word = index->free_slots[index->first_word];
+        if (word != 0) {
+            return (uint32_t) (index->first_word * WORD_BITS) + (uint32_t) __builtin_ctzll(word);
+        }
+        ++index->first_word;
+    }
+
+    // no free slot among the scanned ones: look further
+    while (index->scanned < imgfs_file->header.max_files) {
+        if (!has_unscanned_images(imgfs_file, index)) return index->scanned;
+
+        const uint32_t slot = index->scanned;
+        if (scan_one(imgfs_file, index) != ERR_NONE) return INDEX_NO_SLOT;
+        if (imgfs_file->metadata[slot].is_valid == EMPTY) return slot;
+    }
+    return INDEX_NO_SLOT;
+}
+
+int index_add(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (slot >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    int err = ERR_NONE;
+    if (has_disk_index(imgfs_file)) {
+        err = disk_add(imgfs_file, slot);
+        if (err != ERR_NONE) return err;
+    }
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index == NULL) return ERR_NONE;
+
+    if (slot >= index->scanned) {
+        // the slot is now valid: scanning up to it indexes it
+        while (err == ERR_NONE && index->scanned <= slot) {
+            err = scan_one(imgfs_file, index);
+        }
+    } else {
+        err = index_insert_slot(index, &imgfs_file->metadata[slot], slot);
+        if (err == ERR_NONE) {
+            mark_used(index, slot);
+            ++index->nb_valid;
+        }
+    }
+
+    if (err != ERR_NONE && has_disk_index(imgfs_file)) {
+        disk_remove(imgfs_file, slot);
+    }
+    return err;
+}
+
+int index_remove(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (slot >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_index* index = index_of(imgfs_file);
+    if (index != NULL && slot < index->scanned) {
+        index_erase_slot(index, &imgfs_file->metadata[slot], slot);
+        mark_free(index, slot);
+        --index->nb_valid;
+    }
+
+    return has_disk_index(imgfs_file) ? disk_remove(imgfs_file, slot) : ERR_NONE;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file imgfs_index.h
+ * @brief In-memory lookup structures for imgFS.
+ *
+ * Open-addressing hash tables from image ID and from content SHA to
+ * metadata slot. They are built by do_open(), kept up to date by
+ * do_insert() and do_delete(), and used by every lookup path so that
+ * finding an image or a duplicate content does not depend on
+ * header.max_files.
+ *
+ * The index also keeps a bitmap of the free metadata slots, so that
+ * do_insert() does not have to walk the metadata to find room.
+ *
+ * Files in the IMGFS_FORMAT_INDEXED format also carry an on-disk hash
+ * table from image ID to slot, kept up to date by index_add() and
+ * index_remove(). It lets a process that has just opened the file find
+ * an image in a few reads, without scanning the metadata first.
+ *
+ * When the imgfs_file has no index (see imgfs_state.h), all the lookup
+ * functions fall back to a linear scan of the metadata.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Value returned by lookups when no slot matches.
+ */
+#define INDEX_NO_SLOT UINT32_MAX
+
+/**
+ * @brief Builds the in-memory index from the metadata of an open imgFS.
+ *
+ * A lazy index starts empty and scans the metadata, in slot order, only
+ * as far as lookups require. The scan stops as soon as header.nb_files
+ * valid slots have been seen, as the remaining ones are then all empty.
+ *
+ * @param imgfs_file The main in-memory structure, with its metadata loaded (or mapped).
+ * @param lazy Whether to defer the scan of the metadata to the lookups.
+ * @return Some error code. 0 if no error.
+ */
+int index_build(struct imgfs_file* imgfs_file, int lazy);
+
+/**
+ * @brief Releases the in-memory index (if any).
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void index_free(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Size of the on-disk ID index of an imgFS.
+ *
+ * @param header The header of the imgFS.
+ * @return The size in bytes, 0 if the format of the file has no on-disk index.
+ */
+uint64_t index_disk_size(const struct imgfs_header* header);
+
+/**
+ * @brief Writes the on-disk ID index of an imgFS, at header.unused_64,
+ *        with an entry for each of its valid slots.
+ *
+ * @param imgfs_file The main in-memory structure, with its file open for writing.
+ * @return Some error code. 0 if no error.
+ */
+int index_disk_create(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Adapts the in-memory index to a larger header.max_files.
+ *
+ * @param imgfs_file The main in-memory structure, with its metadata already enlarged.
+ * @return Some error code. 0 if no error.
+ */
+int index_resize(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Whether the index is lazy and has not scanned all the images
+ *        yet: lookups then change it, and need exclusive access.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return 1 if so, 0 otherwise (including when there is no index).
+ */
+int index_scanning(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Finishes the scan of the metadata by a lazy index, so that
+ *        lookups no longer change it.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code. 0 if no error.
+ */
+int index_finish_scan(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Finds the valid metadata slot holding the given image ID.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param img_id The image ID to look for.
+ * @param skip A slot to ignore during the search, or INDEX_NO_SLOT.
+ * @return The slot index, or INDEX_NO_SLOT if not found.
+ */
+uint32_t index_find_id(const struct imgfs_file* imgfs_file, const char* img_id, uint32_t skip);
+
+/**
+ * @brief Finds a valid metadata slot whose content has the given SHA.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param sha The SHA256 digest of the content to look for.
+ * @param skip A slot to ignore during the search, or INDEX_NO_SLOT.
+ * @return The slot index, or INDEX_NO_SLOT if not found.
+ */
+uint32_t index_find_sha(const struct imgfs_file* imgfs_file, const uint8_t* sha, uint32_t skip);
+
+/**
+ * @brief Finds a valid metadata slot holding an image derived from the
+ *        given one (see imgfs_derived.h).
+ *
+ * Derived images are found by the ID they derive from, without looking
+ * at the other slots; a lazy index only scans further when none of them
+ * is indexed yet.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param img_id The ID of the image they derive from, NULL for any image.
+ * @return The slot index, or INDEX_NO_SLOT if not found.
+ */
+uint32_t index_find_derived(const struct imgfs_file* imgfs_file, const char* img_id);
+
+/**
+ * @brief Finds the lowest free metadata slot (without claiming it).
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return The slot index, or INDEX_NO_SLOT if the imgFS is full.
+ */
+uint32_t index_find_free_slot(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Registers a (valid) metadata slot in the index.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot, which must already hold the image ID and SHA.
+ * @return Some error code. 0 if no error.
+ */
+int index_add(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Unregisters a metadata slot from the index.
+ *
+ * Must be called while the slot still holds the image ID and SHA.
+ * The slot becomes available again for index_find_free_slot().
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot.
+ * @return Some error code. 0 if no error.
+ */
+int index_remove(struct imgfs_file* imgfs_file, uint32_t slot);
+
+#ifdef __cplusplus
+}
+#endif
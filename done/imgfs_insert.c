@@ -1,4 +1,12 @@
 #include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_derived.h"
+#include "imgfs_durability.h"
+#include "imgfs_io.h"
+#include "imgfs_refs.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_wal.h"
+#include "imgfs_index.h"
 #include "imgfscmd_functions.h"
 #include "image_content.h"
 #include "image_dedup.h"
@@ -9,28 +17,47 @@
 #include <string.h>
 #include <stdio.h>
 
-int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
+/*******************************************************************
+ * Undoes an insertion registered in the index, after a later step failed:
+ * the new ID is withdrawn from the index and the snapshot while the slot
+ * still holds it, then, once the content has its offset, the blobs it no
+ * longer shares are given back, and the slot gets back its old metadata.
+ */
+static int undo_insert(struct imgfs_file* imgfs_file, uint32_t slot,
+                       const struct img_metadata* oldmetadata, int err)
 {
-    // Ensure that none of the required parameters are NULL.
-    M_REQUIRE_NON_NULL(imgfs_file);
-    M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(image_buffer);
+    index_remove(imgfs_file, slot);
+    imgfs_file->metadata[slot].is_valid = EMPTY;
+    snapshot_update(imgfs_file, slot);
+    if (imgfs_file->metadata[slot].offset[ORIG_RES] != 0) alloc_release(imgfs_file, slot);
+    memcpy(&imgfs_file->metadata[slot], oldmetadata, sizeof(struct img_metadata));
+    snapshot_update(imgfs_file, slot);
+    return err;
+}
+
+/*******************************************************************
+ * Inserts an image, whatever its ID.
+ */
+static int insert_image(const char* image_buffer, size_t image_size, const char* img_id,
+                        struct imgfs_file* imgfs_file)
+{
+    // The derived images only take the slots left free: an image inserted
+    // by a user makes room by dropping some of them (see imgfs_derived.h).
+    while (!IS_DERIVED_ID(img_id)
+           && (imgfs_file->header.nb_files >= imgfs_file->header.max_files
+               || index_find_free_slot(imgfs_file) == INDEX_NO_SLOT)) {
+        const int err = derived_evict(imgfs_file);
+        if (err != ERR_NONE) return err;
+    }
 
     // Check if the file system has reached its maximum capacity for stored files.
     if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) return ERR_IMGFS_FULL;
 
     // Look for a free index where the new image metadata can be stored.
-    uint32_t free_index = UINT32_MAX;
-    uint32_t i = 0;
-    while (i < imgfs_file->header.max_files && free_index == UINT32_MAX) {
-        if (imgfs_file->metadata[i].is_valid == EMPTY) {
-            free_index = i;
-        }
-        i++;
-    }
+    const uint32_t free_index = index_find_free_slot(imgfs_file);
 
     // If no free index is found, the file system is full.
-    if (free_index == UINT32_MAX) return ERR_IMGFS_FULL;
+    if (free_index == INDEX_NO_SLOT) return ERR_IMGFS_FULL;
 
     // Store current metadata state for possible restoration in case of deduplication failure.
     struct img_metadata oldmetadata = imgfs_file->metadata[free_index];
@@ -69,22 +96,92 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
         return dedup_status;
     }
 
-    // Write the image data to the file if it's new (deduplication has not modified the offset).
+    // Make the new image reachable through the index.
+    int index_status = index_add(imgfs_file, free_index);
+    if (index_status != ERR_NONE) {
+        memcpy(&imgfs_file->metadata[free_index], &oldmetadata, sizeof(struct img_metadata));
+        return index_status;
+    }
+
+    // Write the image data to the file if it's new (deduplication has not modified the offset),
+    // in the smallest hole left by deletions that fits it, or else at the end.
     if (metadata->offset[ORIG_RES] == 0) {
-        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
-        metadata->offset[ORIG_RES] = (uint64_t) ftell(imgfs_file->file);
-        if (fwrite(image_buffer, 1, image_size, imgfs_file->file) != image_size) return ERR_IO;
+        uint64_t offset = 0;
+        int alloc_status = alloc_take(imgfs_file, (uint32_t) image_size, &offset);
+        if (alloc_status != ERR_NONE) return undo_insert(imgfs_file, free_index, &oldmetadata, alloc_status);
+        if (io_write_at(imgfs_file->file, image_buffer, image_size, offset) != ERR_NONE) {
+            alloc_reset(imgfs_file);
+            return undo_insert(imgfs_file, free_index, &oldmetadata, ERR_IO);
+        }
+        metadata->offset[ORIG_RES] = offset;
     }
+    refs_add(imgfs_file, free_index);
+    snapshot_update(imgfs_file, free_index);
 
     // Update file system header information.
     imgfs_file->header.nb_files++;
     imgfs_file->header.version++;
 
+    // In WAL mode, the header and the metadata go to the log instead.
+    if (wal_active(imgfs_file)) {
+        const int wal_status = wal_append(imgfs_file, free_index);
+        if (wal_status != ERR_NONE) {
+            imgfs_file->header.nb_files--;
+            imgfs_file->header.version--;
+            return undo_insert(imgfs_file, free_index, &oldmetadata, wal_status);
+        }
+        return durability_commit(imgfs_file);
+    }
+
     // Write updated file system header back to disk.
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) return ERR_IO;
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) return ERR_IO;
-    if (fseek(imgfs_file->file, sizeof(struct imgfs_header) + free_index * sizeof(struct img_metadata), SEEK_SET) != 0) return ERR_IO;
-    if (fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) return ERR_IO;
+    if (io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE
+        || io_write_at(imgfs_file->file, metadata, sizeof(struct img_metadata),
+                       sizeof(struct imgfs_header) + (uint64_t) free_index * sizeof(struct img_metadata)) != ERR_NONE) {
+        imgfs_file->header.nb_files--;
+        imgfs_file->header.version--;
+        // the header may have reached the disk already: put the old one back (best effort)
+        io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+        return undo_insert(imgfs_file, free_index, &oldmetadata, ERR_IO);
+    }
+
+    // Sync now, later or never, depending on the durability policy.
+    return durability_commit(imgfs_file);
+}
+
+int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
+{
+    // Ensure that none of the required parameters are NULL.
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+
+    // Those IDs are kept for the images derived from the others.
+    if (IS_DERIVED_ID(img_id)) return ERR_INVALID_IMGID;
+
+    return insert_image(image_buffer, image_size, img_id, imgfs_file);
+}
+
+int derived_insert(const char* image_buffer, size_t image_size, const char* derived_id,
+                   const char* img_id, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(derived_id);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (!IS_DERIVED_ID(derived_id)) return ERR_INVALID_IMGID;
+
+    const uint32_t index = index_find_id(imgfs_file, img_id, INDEX_NO_SLOT);
+    if (index == INDEX_NO_SLOT) return ERR_IMAGE_NOT_FOUND;
+
+    // Mark the image first: should the insertion fail, it is only looked for in vain on deletion.
+    struct img_metadata* metadata = &imgfs_file->metadata[index];
+    if (!(metadata->unused_16 & IMG_HAS_DERIVED)) {
+        metadata->unused_16 |= IMG_HAS_DERIVED;
+        const int err = wal_active(imgfs_file) ? wal_append(imgfs_file, index)
+                        : io_write_at(imgfs_file->file, metadata, sizeof(struct img_metadata),
+                                      sizeof(struct imgfs_header) + (uint64_t) index * sizeof(struct img_metadata));
+        if (err != ERR_NONE) return err;
+    }
 
-    return ERR_NONE;
+    return insert_image(image_buffer, image_size, derived_id, imgfs_file);
 }
@@ -0,0 +1,89 @@
+/**
+ * @file imgfs_io.c
+ * @brief Positional reads and writes on the file of an imgFS (see imgfs_io.h).
+ */
+
+// 64-bit off_t even where long (and the default off_t) is 32 bits
+#define _FILE_OFFSET_BITS 64
+
+#include "imgfs_io.h"
+#include "error.h"
+#include "util.h"
+
+#include <errno.h>
+#include <sys/stat.h>  // for fstat
+#include <sys/types.h> // for off_t
+#include <unistd.h>    // for pread, pwrite, ftruncate
+
+/*******************************************************************
+ * The offset as an off_t, if it fits one (with size bytes after it).
+ */
+static int to_off_t(uint64_t offset, size_t size, off_t* result)
+{
+    const uint64_t max = ((uint64_t) 1 << (sizeof(off_t) * 8 - 1)) - 1;
+    if (offset > max || size > max - offset) return ERR_INVALID_ARGUMENT;
+    *result = (off_t) offset;
+    return ERR_NONE;
+}
+
+int io_read_at(FILE* file, void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    off_t position = 0;
+    if (to_off_t(offset, size, &position) != ERR_NONE) return ERR_IO;
+
+    const int fd = fileno(file);
+    char* bytes = buffer;
+    while (size > 0) {
+        const ssize_t got = pread(fd, bytes, size, position);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return ERR_IO; // error, or end of file
+        bytes += got;
+        position += got;
+        size -= (size_t) got;
+    }
+    return ERR_NONE;
+}
+
+int io_write_at(FILE* file, const void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    off_t position = 0;
+    if (to_off_t(offset, size, &position) != ERR_NONE) return ERR_IO;
+
+    const int fd = fileno(file);
+    const char* bytes = buffer;
+    while (size > 0) {
+        const ssize_t put = pwrite(fd, bytes, size, position);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return ERR_IO;
+        bytes += put;
+        position += put;
+        size -= (size_t) put;
+    }
+    return ERR_NONE;
+}
+
+int io_size(FILE* file, uint64_t* size)
+{
+    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(size);
+
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size < 0) return ERR_IO;
+    *size = (uint64_t) st.st_size;
+    return ERR_NONE;
+}
+
+int io_truncate(FILE* file, uint64_t size)
+{
+    M_REQUIRE_NON_NULL(file);
+
+    off_t length = 0;
+    if (to_off_t(size, 0, &length) != ERR_NONE) return ERR_IO;
+    return ftruncate(fileno(file), length) == 0 ? ERR_NONE : ERR_IO;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file imgfs_io.h
+ * @brief Positional reads and writes on the file of an imgFS.
+ *
+ * struct imgfs_file keeps the stdio FILE* the course defines, but the
+ * library no longer goes through its shared position (fseek, then fread
+ * or fwrite): it reads and writes its descriptor at explicit 64-bit
+ * offsets (pread, pwrite). Two reads may then run at the same time, and
+ * offsets are no longer limited by long.
+ *
+ * As nothing is buffered by stdio any more, anything written by these
+ * functions is immediately seen by the mappings of the file.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+#include <stdio.h>  // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reads exactly size bytes at offset.
+ *
+ * @param file The file to read.
+ * @param buffer Where to put the bytes.
+ * @param size The number of bytes to read.
+ * @param offset Where to read them from.
+ * @return Some error code (ERR_IO if the file is too short). 0 if no error.
+ */
+int io_read_at(FILE* file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Writes exactly size bytes at offset.
+ *
+ * @param file The file to write.
+ * @param buffer The bytes to write.
+ * @param size The number of bytes to write.
+ * @param offset Where to write them.
+ * @return Some error code. 0 if no error.
+ */
+int io_write_at(FILE* file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Gives the size of a file (where its end is).
+ *
+ * @param file The file.
+ * @param size Where to put its size.
+ * @return Some error code. 0 if no error.
+ */
+int io_size(FILE* file, uint64_t* size);
+
+/**
+ * @brief Cuts a file (or extends it with zeros) to a given size.
+ *
+ * @param file The file.
+ * @param size Its new size.
+ * @return Some error code. 0 if no error.
+ */
+int io_truncate(FILE* file, uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
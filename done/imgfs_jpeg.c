@@ -0,0 +1,219 @@
+/**
+ * @file imgfs_jpeg.c
+ * @brief What the library reads of a JPEG without decoding it (see imgfs_jpeg.h).
+ */
+
+#include "imgfs_jpeg.h"
+
+#include <stdint.h>
+#include <string.h> // for memcmp
+
+#define JPEG_MARK  0xFF
+#define JPEG_SOI   0xD8 // start of image
+#define JPEG_EOI   0xD9 // end of image
+#define JPEG_SOS   0xDA // start of scan: the compressed data follows
+#define JPEG_TEM   0x01
+#define JPEG_RST0  0xD0
+#define JPEG_RST7  0xD7
+#define JPEG_SOF0  0xC0
+#define JPEG_SOF15 0xCF
+#define JPEG_DHT   0xC4 // in the SOFn range, but not frame headers
+#define JPEG_JPG   0xC8
+#define JPEG_DAC   0xCC
+#define JPEG_APP1  0xE1 // EXIF data
+
+#define SOF_MIN_LENGTH 6 // precision, height, width, number of components
+
+#define EXIF_SIGNATURE "Exif\0" // then a padding byte, then a TIFF structure
+#define EXIF_SIGNATURE_LENGTH 6
+#define TIFF_HEADER_LENGTH 8   // byte order, 42, offset of IFD0
+#define TIFF_ENTRY_LENGTH 12   // tag, type, count, value
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_ORIENTATION 0x0112      // 1 when shown as stored
+#define TIFF_THUMBNAIL_OFFSET 0x0201 // JPEGInterchangeFormat
+#define TIFF_THUMBNAIL_LENGTH 0x0202 // JPEGInterchangeFormatLength
+
+/*******************************************************************
+ * Reads a big-endian 16-bit number.
+ */
+static uint32_t read_u16(const uint8_t* bytes)
+{
+    return (uint32_t) bytes[0] << 8 | bytes[1];
+}
+
+/*******************************************************************
+ * The TIFF structure of EXIF data, in either byte order.
+ */
+struct tiff {
+    const uint8_t* data;
+    size_t size;
+    int big_endian;
+};
+
+static uint32_t tiff_u16(const struct tiff* tiff, size_t at)
+{
+    const uint8_t* bytes = tiff->data + at;
+    return tiff->big_endian ? (uint32_t) bytes[0] << 8 | bytes[1]
+           : (uint32_t) bytes[1] << 8 | bytes[0];
+}
+
+static uint32_t tiff_u32(const struct tiff* tiff, size_t at)
+{
+    return tiff->big_endian ? tiff_u16(tiff, at) << 16 | tiff_u16(tiff, at + 2)
+           : tiff_u16(tiff, at + 2) << 16 | tiff_u16(tiff, at);
+}
+
+/*******************************************************************
+ * The number of the entries of the IFD at offset, 0 if it does not fit.
+ */
+static uint32_t ifd_entries(const struct tiff* tiff, size_t offset)
+{
+    if (offset < TIFF_HEADER_LENGTH || offset + 2 > tiff->size) return 0;
+    const uint32_t count = tiff_u16(tiff, offset);
+    // the entries, then the offset of the next IFD
+    if (offset + 2 + (size_t) count * TIFF_ENTRY_LENGTH + 4 > tiff->size) return 0;
+    return count;
+}
+
+/*******************************************************************
+ * Moves to the next segment, starting at *pos, and gives its marker
+ * and payload (what follows its length). Returns 0 at the first scan,
+ * at the end of the image, or if the JPEG is malformed.
+ */
+static int next_segment(const uint8_t* data, size_t size, size_t* pos,
+                        uint8_t* marker, const uint8_t** payload, size_t* length)
+{
+    size_t at = *pos;
+    for (;;) {
+        if (at + 2 > size || data[at] != JPEG_MARK) return 0;
+        // any number of 0xFF may pad before the code
+        while (at + 1 < size && data[at + 1] == JPEG_MARK) ++at;
+        if (at + 2 > size) return 0;
+        const uint8_t code = data[at + 1];
+        at += 2;
+        // markers without a segment
+        if (code == JPEG_TEM || (code >= JPEG_RST0 && code <= JPEG_RST7)) continue;
+        if (code == JPEG_SOI || code == JPEG_EOI || code == JPEG_SOS || code == 0) return 0;
+
+        if (at + 2 > size) return 0;
+        const size_t segment = read_u16(data + at);
+        if (segment < 2 || at + segment > size) return 0;
+        *marker = code;
+        *payload = data + at + 2;
+        *length = segment - 2;
+        *pos = at + segment;
+        return 1;
+    }
+}
+
+/*******************************************************************/
+int jpeg_dimensions(const char* image_buffer, size_t image_size, uint32_t* height, uint32_t* width)
+{
+    if (image_buffer == NULL || height == NULL || width == NULL) return 0;
+
+    const uint8_t* data = (const uint8_t*) image_buffer;
+    if (image_size < 2 || data[0] != JPEG_MARK || data[1] != JPEG_SOI) return 0;
+
+    size_t pos = 2;
+    uint8_t marker = 0;
+    const uint8_t* payload = NULL;
+    size_t length = 0;
+    while (next_segment(data, image_size, &pos, &marker, &payload, &length)) {
+        if (marker < JPEG_SOF0 || marker > JPEG_SOF15
+            || marker == JPEG_DHT || marker == JPEG_JPG || marker == JPEG_DAC) {
+            continue;
+        }
+        if (length < SOF_MIN_LENGTH) return 0;
+        const uint32_t frame_height = read_u16(payload + 1);
+        const uint32_t frame_width = read_u16(payload + 3);
+        // a height of 0 is given by a DNL segment after the first scan
+        if (frame_height == 0 || frame_width == 0) return 0;
+        *height = frame_height;
+        *width = frame_width;
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * The value of an entry of type SHORT or LONG.
+ */
+static size_t entry_value(const struct tiff* tiff, size_t entry)
+{
+    const uint32_t type = tiff_u16(tiff, entry + 2);
+    return type == TIFF_LONG ? tiff_u32(tiff, entry + 8)
+           : type == TIFF_SHORT ? tiff_u16(tiff, entry + 8) : 0;
+}
+
+/*******************************************************************
+ * Finds the thumbnail in the TIFF structure of EXIF data: the JPEG
+ * that IFD1 (the IFD after IFD0) points to.
+ */
+static int tiff_thumbnail(const struct tiff* tiff, const uint8_t** thumbnail, size_t* thumbnail_size)
+{
+    const size_t ifd0 = tiff_u32(tiff, 4);
+    const uint32_t ifd0_entries = ifd_entries(tiff, ifd0);
+    if (ifd0_entries == 0) return 0;
+
+    // a rotated image would not look like its thumbnail, which is stored as is
+    for (uint32_t i = 0; i < ifd0_entries; ++i) {
+        const size_t entry = ifd0 + 2 + (size_t) i * TIFF_ENTRY_LENGTH;
+        if (tiff_u16(tiff, entry) == TIFF_ORIENTATION && entry_value(tiff, entry) > 1) return 0;
+    }
+
+    const size_t ifd1 = tiff_u32(tiff, ifd0 + 2 + (size_t) ifd0_entries * TIFF_ENTRY_LENGTH);
+    const uint32_t ifd1_entries = ifd_entries(tiff, ifd1);
+
+    size_t offset = 0, length = 0;
+    for (uint32_t i = 0; i < ifd1_entries; ++i) {
+        const size_t entry = ifd1 + 2 + (size_t) i * TIFF_ENTRY_LENGTH;
+        const uint32_t tag = tiff_u16(tiff, entry);
+        if (tag != TIFF_THUMBNAIL_OFFSET && tag != TIFF_THUMBNAIL_LENGTH) continue;
+        const size_t value = entry_value(tiff, entry);
+        if (tag == TIFF_THUMBNAIL_OFFSET) offset = value;
+        else length = value;
+    }
+
+    if (offset == 0 || length < 2 || offset > tiff->size || length > tiff->size - offset) return 0;
+    const uint8_t* jpeg = tiff->data + offset;
+    if (jpeg[0] != JPEG_MARK || jpeg[1] != JPEG_SOI) return 0;
+    *thumbnail = jpeg;
+    *thumbnail_size = length;
+    return 1;
+}
+
+/*******************************************************************/
+int jpeg_exif_thumbnail(const char* image_buffer, size_t image_size,
+                        const char** thumbnail, size_t* thumbnail_size)
+{
+    if (image_buffer == NULL || thumbnail == NULL || thumbnail_size == NULL) return 0;
+
+    const uint8_t* data = (const uint8_t*) image_buffer;
+    if (image_size < 2 || data[0] != JPEG_MARK || data[1] != JPEG_SOI) return 0;
+
+    size_t pos = 2;
+    uint8_t marker = 0;
+    const uint8_t* payload = NULL;
+    size_t length = 0;
+    while (next_segment(data, image_size, &pos, &marker, &payload, &length)) {
+        if (marker != JPEG_APP1 || length < EXIF_SIGNATURE_LENGTH + TIFF_HEADER_LENGTH
+            || memcmp(payload, EXIF_SIGNATURE, EXIF_SIGNATURE_LENGTH - 1) != 0) {
+            continue;
+        }
+
+        struct tiff tiff = { payload + EXIF_SIGNATURE_LENGTH, length - EXIF_SIGNATURE_LENGTH, 0 };
+        if (memcmp(tiff.data, "MM", 2) == 0) {
+            tiff.big_endian = 1;
+        } else if (memcmp(tiff.data, "II", 2) != 0) {
+            return 0;
+        }
+        if (tiff_u16(&tiff, 2) != 42) return 0;
+
+        const uint8_t* found = NULL;
+        if (!tiff_thumbnail(&tiff, &found, thumbnail_size)) return 0;
+        *thumbnail = (const char*) found;
+        return 1;
+    }
+    return 0;
+}
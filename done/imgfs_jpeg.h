@@ -0,0 +1,50 @@
+/**
+ * @file imgfs_jpeg.h
+ * @brief What the library reads of a JPEG without decoding it.
+ *
+ * A JPEG is a sequence of segments, each starting with a marker (0xFF
+ * then a code), most followed by their length. Walking them up to the
+ * first frame header (SOFn) gives the dimensions of the image, without
+ * going through libvips and libjpeg; the EXIF segment (APP1) gives the
+ * small JPEG most cameras embed as a preview. Anything unexpected makes
+ * these functions give up: the caller then falls back to libvips.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reads the dimensions of a JPEG from its frame header.
+ *
+ * @param image_buffer The JPEG.
+ * @param image_size Its size.
+ * @param height Where to put its height.
+ * @param width Where to put its width.
+ * @return Whether they were found (0 if not a well-formed JPEG, or if its
+ *         height is only given after the first scan).
+ */
+int jpeg_dimensions(const char* image_buffer, size_t image_size, uint32_t* height, uint32_t* width);
+
+/**
+ * @brief Finds the thumbnail embedded in the EXIF data of a JPEG (the
+ *        JPEG pointed to by IFD1), without copying it.
+ *
+ * @param image_buffer The JPEG.
+ * @param image_size Its size.
+ * @param thumbnail Where to put the thumbnail, which points into image_buffer.
+ * @param thumbnail_size Where to put its size.
+ * @return Whether there is one, and the image is shown as stored (no EXIF
+ *         orientation other than 1: the thumbnail would then show it otherwise).
+ */
+int jpeg_exif_thumbnail(const char* image_buffer, size_t image_size,
+                        const char** thumbnail, size_t* thumbnail_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_derived.h" // for IS_DERIVED_ID
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 
@@ -11,7 +12,22 @@
 #define OUTPUT_STDOUT 0
 #define OUTPUT_JSON   1
 
-
+/*******************************************************************
+ * Counts the images inserted by the users: header.nb_files also counts
+ * the derived ones (see imgfs_derived.h), which are not listed.
+ */
+static uint32_t count_user_images(const struct imgfs_file* imgfs_file)
+{
+    uint32_t seen = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files && seen < imgfs_file->header.nb_files; i++) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+            ++seen;
+            if (!IS_DERIVED_ID(imgfs_file->metadata[i].img_id)) ++count;
+        }
+    }
+    return count;
+}
 
 int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode, char** json_output)
 {
@@ -19,17 +35,22 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
     M_REQUIRE_NON_NULL(imgfs_file);
 
     if (output_mode == STDOUT) {
-        // Print the header information.
-        print_header(&imgfs_file->header);
+        // Print the header information, with the count of the images listed.
+        struct imgfs_header header = imgfs_file->header;
+        header.nb_files = count_user_images(imgfs_file);
+        print_header(&header);
 
         // Check if there are no files and output a placeholder message.
-        if (imgfs_file->header.nb_files == 0) {
+        if (header.nb_files == 0) {
             puts("<< empty imgFS >>");
         } else {
-            // Iterate through all possible file slots and print metadata for non-empty slots.
-            for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-                if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+            // Iterate through the file slots and print metadata for non-empty slots,
+            // stopping once all of them have been shown (the rest of the metadata is not touched).
+            uint32_t shown = 0;
+            for (uint32_t i = 0; i < imgfs_file->header.max_files && shown < header.nb_files; i++) {
+                if (imgfs_file->metadata[i].is_valid == NON_EMPTY && !IS_DERIVED_ID(imgfs_file->metadata[i].img_id)) {
                     print_metadata(&imgfs_file->metadata[i]);
+                    ++shown;
                 }
             }
         }
@@ -49,8 +70,11 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
         }
 
         // Populate the JSON array with image IDs from valid metadata entries.
-        for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
+        uint32_t listed = 0;
+        for (uint32_t i = 0; i < imgfs_file->header.max_files && listed < imgfs_file->header.nb_files; i++) {
             if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+                ++listed;
+                if (IS_DERIVED_ID(imgfs_file->metadata[i].img_id)) continue;
                 struct json_object *img_id = json_object_new_string(imgfs_file->metadata[i].img_id);
                 if (!img_id) {
                     json_object_put(json_array);
@@ -0,0 +1,208 @@
+/**
+ * @file imgfs_rcu.c
+ * @brief Epoch-based reclamation (see imgfs_rcu.h).
+ *
+ * A global epoch only ever grows. A thread in a read section announces
+ * the epoch it entered at, in a record of its own; a retired object is
+ * stamped with the epoch current when it was unpublished, then the
+ * epoch moves on. A reader that may still see the object entered no
+ * later than that stamp: the object is freed once every announced epoch
+ * is later than its stamp.
+ *
+ * The records of the threads are kept in a list that only grows; the
+ * record of a thread that exits is reused by the next one to register.
+ */
+
+#include "imgfs_rcu.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>     // for nanosleep
+
+#define RCU_POLL_NS 100000L // between two looks at the readers, when waiting for them
+
+struct rcu_reader {
+    atomic_uint_fast64_t epoch; // when its section was entered, 0 outside any section
+    atomic_int used;            // by a thread
+    struct rcu_reader* next;    // set before the record is published
+};
+
+struct rcu_retired {
+    void* object;
+    void (*release)(void*);
+    uint64_t epoch;             // when it was unpublished
+    struct rcu_retired* next;
+};
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(struct rcu_reader*) readers = NULL;
+
+static struct rcu_retired* retired = NULL;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct rcu_reader* self = NULL;
+static _Thread_local unsigned int depth = 0;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+/*******************************************************************
+ * Gives back the record of an exiting thread.
+ */
+static void release_reader(void* arg)
+{
+    struct rcu_reader* reader = arg;
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->used, 0);
+}
+
+static void create_reader_key(void)
+{
+    (void) pthread_key_create(&reader_key, release_reader);
+}
+
+/*******************************************************************
+ * Finds a record for the calling thread: a free one, or a new one.
+ */
+static struct rcu_reader* register_reader(void)
+{
+    pthread_once(&reader_key_once, create_reader_key);
+
+    struct rcu_reader* reader = atomic_load(&readers);
+    for (; reader != NULL; reader = reader->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&reader->used, &unused, 1)) break;
+    }
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(struct rcu_reader));
+        if (reader == NULL) return NULL;
+        atomic_init(&reader->epoch, 0);
+        atomic_init(&reader->used, 1);
+        reader->next = atomic_load(&readers);
+        while (!atomic_compare_exchange_weak(&readers, &reader->next, reader));
+    }
+    (void) pthread_setspecific(reader_key, reader);
+    return reader;
+}
+
+/*******************************************************************
+ * The earliest epoch announced by a reader, UINT64_MAX if none is in a section.
+ */
+static uint64_t oldest_reader(void)
+{
+    // pairs with the fence of rcu_read_enter(): either the reader is seen,
+    // or it sees what was unpublished before
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (struct rcu_reader* reader = atomic_load(&readers); reader != NULL; reader = reader->next) {
+        const uint64_t epoch = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    return oldest;
+}
+
+/*******************************************************************
+ * Frees the retired objects stamped before oldest.
+ */
+static void reclaim(uint64_t oldest)
+{
+    struct rcu_retired* expired = NULL;
+    pthread_mutex_lock(&retired_lock);
+    for (struct rcu_retired** link = &retired; *link != NULL;) {
+        struct rcu_retired* node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            node->next = expired;
+            expired = node;
+        } else {
+            link = &node->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while (expired != NULL) {
+        struct rcu_retired* node = expired;
+        expired = node->next;
+        node->release(node->object);
+        free(node);
+    }
+}
+
+/*******************************************************************
+ * Moves the epoch on and waits for the readers that entered before.
+ * Returns the epoch they entered at, at the latest.
+ */
+static uint64_t wait_readers(void)
+{
+    const uint64_t target = atomic_fetch_add(&global_epoch, 1);
+    const struct timespec pause = { 0, RCU_POLL_NS };
+    while (oldest_reader() <= target) {
+        nanosleep(&pause, NULL);
+    }
+    return target;
+}
+
+/*******************************************************************/
+int rcu_read_enter(void)
+{
+    if (self == NULL) {
+        self = register_reader();
+        if (self == NULL) return ERR_OUT_OF_MEMORY;
+    }
+    if (depth++ == 0) {
+        atomic_store_explicit(&self->epoch, atomic_load(&global_epoch), memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+void rcu_read_exit(void)
+{
+    if (self == NULL || depth == 0) return;
+    if (--depth == 0) atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+/*******************************************************************/
+void rcu_synchronize(void)
+{
+    (void) wait_readers();
+}
+
+/*******************************************************************/
+void rcu_retire(void* object, void (*release)(void*))
+{
+    if (object == NULL || release == NULL) return;
+
+    struct rcu_retired* node = malloc(sizeof(struct rcu_retired));
+    if (node == NULL) {
+        // no room to defer it: wait for the readers instead
+        rcu_synchronize();
+        release(object);
+        return;
+    }
+    node->object = object;
+    node->release = release;
+    node->epoch = atomic_fetch_add(&global_epoch, 1);
+
+    pthread_mutex_lock(&retired_lock);
+    node->next = retired;
+    retired = node;
+    pthread_mutex_unlock(&retired_lock);
+
+    reclaim(oldest_reader());
+}
+
+/*******************************************************************/
+void rcu_reclaim(void)
+{
+    reclaim(oldest_reader());
+}
+
+/*******************************************************************/
+void rcu_barrier(void)
+{
+    reclaim(wait_readers() + 1);
+}
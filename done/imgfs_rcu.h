@@ -0,0 +1,63 @@
+/**
+ * @file imgfs_rcu.h
+ * @brief Epoch-based reclamation, for structures read without any lock.
+ *
+ * A writer replaces a shared object by publishing a new one (an atomic
+ * store of the pointer), then hands the former one to rcu_retire()
+ * instead of freeing it: it is only freed once every reader that may
+ * still see it has left its read section.
+ *
+ * A reader brackets its accesses with rcu_read_enter() and
+ * rcu_read_exit(), which only write a counter of its own thread: readers
+ * never wait, neither for each other nor for writers. Sections may be
+ * nested, and must not wait for anything a writer may hold while it
+ * calls rcu_synchronize(), which must not be called from a section.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Enters a read section of the calling thread.
+ *
+ * @return Some error code (the first section of a thread registers it). 0 if no error.
+ */
+int rcu_read_enter(void);
+
+/**
+ * @brief Leaves the read section of the calling thread.
+ */
+void rcu_read_exit(void);
+
+/**
+ * @brief Waits until every thread that was in a read section when
+ *        called has left it.
+ */
+void rcu_synchronize(void);
+
+/**
+ * @brief Frees an object that was just unpublished, once no reader may
+ *        see it any more. Frees meanwhile what earlier calls retired and
+ *        no reader sees any more.
+ *
+ * @param object The object, no longer reachable by new readers.
+ * @param release How to free it.
+ */
+void rcu_retire(void* object, void (*release)(void*));
+
+/**
+ * @brief Frees, without waiting, what was retired and no reader sees any more.
+ */
+void rcu_reclaim(void);
+
+/**
+ * @brief Waits for the readers, then frees everything retired so far.
+ */
+void rcu_barrier(void);
+
+#ifdef __cplusplus
+}
+#endif
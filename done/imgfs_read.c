@@ -1,4 +1,7 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
 #include "imgfscmd_functions.h"
 #include "image_content.h"
 #include "image_dedup.h"
@@ -9,26 +12,18 @@
 #include <string.h>
 #include <stdio.h>
 
-int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+/********************************************************************
+ * Finds the metadata of an image and makes sure the requested
+ * resolution exists. Common part of do_read() and do_read_view().
+ */
+static int find_variant(const char* img_id, int resolution, struct imgfs_file* imgfs_file,
+                        const struct img_metadata** found)
 {
-    // Verify that none of the pointers are NULL.
-    M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(image_size);
-    M_REQUIRE_NON_NULL(imgfs_file);
-
-    // Search for the image by its ID within the file system's metadata entries.
-    int found_index = -1;
-    int i = 0;
-    while ((uint32_t) i < imgfs_file->header.max_files && found_index == -1) {
-        if (strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID) == 0) {
-            found_index = i;
-        }
-        i++;
-    }
+    // Search for the image by its ID through the index.
+    const uint32_t found_index = index_find_id(imgfs_file, img_id, INDEX_NO_SLOT);
 
     // If no entry is found, return an error indicating the image is not found.
-    if (found_index == -1) {
+    if (found_index == INDEX_NO_SLOT) {
         return ERR_IMAGE_NOT_FOUND;
     }
 
@@ -41,6 +36,22 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
         if (err != ERR_NONE) return err;
     }
 
+    *found = metadata;
+    return ERR_NONE;
+}
+
+int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    // Verify that none of the pointers are NULL.
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    const struct img_metadata *metadata = NULL;
+    int err = find_variant(img_id, resolution, imgfs_file, &metadata);
+    if (err != ERR_NONE) return err;
+
     // Retrieve the size and offset from the metadata to read the image.
     uint32_t size = metadata->size[resolution];
     uint64_t offset = metadata->offset[resolution];
@@ -51,8 +62,8 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
         return ERR_OUT_OF_MEMORY;
     }
 
-    // Set the file pointer to the offset and read the image data into the buffer.
-    if (fseek(imgfs_file->file, (long) offset, SEEK_SET) != 0 || fread(*image_buffer, 1, size, imgfs_file->file) != size) {
+    // Read the image data at its offset, without moving any shared file position.
+    if (io_read_at(imgfs_file->file, *image_buffer, size, offset) != ERR_NONE) {
         free(*image_buffer); // Free memory if read fails.
         *image_buffer = NULL; // Nullify pointer to avoid dangling pointer usage.
         return ERR_IO; // Return I/O error if file operations fail.
@@ -63,3 +74,57 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
     return ERR_NONE; // Return success.
 }
 
+int do_read_view(const char* img_id, int resolution, const char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    const struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->map == NULL) return ERR_INVALID_ARGUMENT;
+
+    const struct img_metadata *metadata = NULL;
+    int err = find_variant(img_id, resolution, imgfs_file, &metadata);
+    if (err != ERR_NONE) return err;
+
+    // Point directly into the mapping instead of copying the content.
+    err = map_view(imgfs_file, metadata->offset[resolution], metadata->size[resolution], image_buffer);
+    if (err != ERR_NONE) return err;
+
+    *image_size = metadata->size[resolution];
+    return ERR_NONE;
+}
+
+int do_read_view_shared(const char* img_id, int resolution, const char** image_buffer,
+                        uint32_t* image_size, const struct imgfs_file* imgfs_file, int* done)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(done);
+
+    *done = 0;
+    const struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->map == NULL) return ERR_INVALID_ARGUMENT;
+
+    // a lazy index still scanning the metadata changes as it looks up
+    if (index_scanning(imgfs_file)) return ERR_NONE;
+
+    *done = 1;
+    if (resolution < 0 || resolution >= NB_RES) return ERR_RESOLUTIONS;
+    const uint32_t found_index = index_find_id(imgfs_file, img_id, INDEX_NO_SLOT);
+    if (found_index == INDEX_NO_SLOT) return ERR_IMAGE_NOT_FOUND;
+
+    // a variant still to be computed, or past the mapping, needs exclusive access
+    const struct img_metadata* metadata = &imgfs_file->metadata[found_index];
+    *done = 0;
+    if (metadata->size[resolution] == 0) return ERR_NONE;
+    const int err = map_view_shared(imgfs_file, metadata->offset[resolution], metadata->size[resolution],
+                                    image_buffer);
+    if (err != ERR_NONE || *image_buffer == NULL) return err;
+
+    *done = 1;
+    *image_size = metadata->size[resolution];
+    return ERR_NONE;
+}
@@ -0,0 +1,621 @@
+/**
+ * @file imgfs_refs.c
+ * @brief Reference-counted table of the blobs of an imgFS (see imgfs_refs.h).
+ *
+ * An open-addressing hash table of contents, keyed by SHA, with linear
+ * probing and backward-shift deletion. Each content holds a short array
+ * of its blobs: usually one per resolution, more only when slots with
+ * the same content were given their own variants, and the slots that
+ * refer to them.
+ *
+ * Besides, every blob has a position in an array kept in offset order,
+ * with the SHA of its content: compaction walks it from where it left
+ * off, and finds the slots to repoint through the content of each blob.
+ * New blobs mostly go to the end of the file, hence of the array.
+ */
+
+#include "imgfs.h"
+#include "imgfs_refs.h"
+#include "imgfs_state.h"
+#include "util.h"
+
+#include <stdlib.h>   // for calloc, realloc, free, qsort, bsearch
+#include <string.h>   // for memcmp, memcpy, memmove
+
+#define MIN_CAPACITY 16
+#define RESORT_MAX_MOVED 16 // moved blobs put back in order one by one, more get sorted again
+
+struct blob_ref {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t refs;  // number of valid slots referring to the blob
+    int res;
+};
+
+struct content {
+    uint8_t sha[SHA256_DIGEST_LENGTH];
+    struct blob_ref* blobs;  // NULL for a free entry of the table
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;         // the valid slots with this content
+    uint32_t nb_slots;
+    uint32_t slots_capacity;
+};
+
+struct blob_pos {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t sha[SHA256_DIGEST_LENGTH];  // of the content of the blob
+};
+
+struct imgfs_refs {
+    struct content* contents;
+    size_t capacity;  // always a power of two
+    size_t used;
+    struct blob_pos* by_offset;  // every blob, in offset order
+    size_t nb_blobs;
+    size_t blobs_capacity;
+    int unsorted;                // by_offset is only appended to, while the table is built
+};
+
+/*******************************************************************
+ * A SHA256 digest is already uniformly distributed: use its first bytes.
+ */
+static size_t hash_sha(const uint8_t* sha)
+{
+    return (size_t) sha[0] | (size_t) sha[1] << 8
+           | (size_t) sha[2] << 16 | (size_t) sha[3] << 24;
+}
+
+static void refs_destroy(struct imgfs_refs* refs)
+{
+    if (refs == NULL) return;
+    for (size_t i = 0; i < refs->capacity; ++i) {
+        free(refs->contents[i].blobs);
+        free(refs->contents[i].slots);
+    }
+    free(refs->contents);
+    free(refs->by_offset);
+    free(refs);
+}
+
+static struct imgfs_refs* refs_of(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_state* state = state_of(imgfs_file);
+    return state == NULL ? NULL : state->refs;
+}
+
+/*******************************************************************
+ * Drops the table after a failed update: it gets built again.
+ */
+static void refs_drop(const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return;
+    refs_destroy(state->refs);
+    state->refs = NULL;
+}
+
+/*******************************************************************
+ * Table handling.
+ */
+static struct content* find_content(const struct imgfs_refs* refs, const uint8_t* sha)
+{
+    if (refs->capacity == 0) return NULL;
+    const size_t mask = refs->capacity - 1;
+    for (size_t i = hash_sha(sha) & mask; refs->contents[i].blobs != NULL; i = (i + 1) & mask) {
+        if (memcmp(refs->contents[i].sha, sha, SHA256_DIGEST_LENGTH) == 0) return &refs->contents[i];
+    }
+    return NULL;
+}
+
+static struct content* place_content(struct content* contents, size_t capacity, const uint8_t* sha)
+{
+    const size_t mask = capacity - 1;
+    size_t i = hash_sha(sha) & mask;
+    while (contents[i].blobs != NULL) {
+        i = (i + 1) & mask;
+    }
+    memcpy(contents[i].sha, sha, SHA256_DIGEST_LENGTH);
+    return &contents[i];
+}
+
+static int grow_table(struct imgfs_refs* refs)
+{
+    const size_t capacity = refs->capacity == 0 ? MIN_CAPACITY : 2 * refs->capacity;
+    struct content* contents = calloc(capacity, sizeof(struct content));
+    if (contents == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < refs->capacity; ++i) {
+        if (refs->contents[i].blobs != NULL) {
+            struct content* moved = place_content(contents, capacity, refs->contents[i].sha);
+            *moved = refs->contents[i];
+        }
+    }
+    free(refs->contents);
+    refs->contents = contents;
+    refs->capacity = capacity;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Finds the content sha, or adds it (without blobs yet).
+ */
+static int get_content(struct imgfs_refs* refs, const uint8_t* sha, struct content** content)
+{
+    *content = find_content(refs, sha);
+    if (*content != NULL) return ERR_NONE;
+
+    // keep the load under 3/4
+    if (4 * (refs->used + 1) > 3 * refs->capacity) {
+        const int err = grow_table(refs);
+        if (err != ERR_NONE) return err;
+    }
+    struct blob_ref* blobs = calloc(NB_RES, sizeof(struct blob_ref));
+    if (blobs == NULL) return ERR_OUT_OF_MEMORY;
+
+    *content = place_content(refs->contents, refs->capacity, sha);
+    (*content)->blobs = blobs;
+    (*content)->count = 0;
+    (*content)->capacity = NB_RES;
+    (*content)->slots = NULL;
+    (*content)->nb_slots = (*content)->slots_capacity = 0;
+    ++refs->used;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Removes a content without blobs, moving back the entries of its
+ * cluster which could no longer be reached.
+ */
+static void erase_content(struct imgfs_refs* refs, struct content* content)
+{
+    const size_t mask = refs->capacity - 1;
+    size_t hole = (size_t) (content - refs->contents);
+    free(content->blobs);
+    free(content->slots);
+    content->blobs = NULL;
+    content->slots = NULL;
+
+    for (size_t pos = (hole + 1) & mask; refs->contents[pos].blobs != NULL; pos = (pos + 1) & mask) {
+        // an entry stays where it is if its home lies cyclically in (hole, pos]
+        const size_t home = hash_sha(refs->contents[pos].sha) & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            refs->contents[hole] = refs->contents[pos];
+            refs->contents[pos].blobs = NULL;
+            refs->contents[pos].slots = NULL;
+            hole = pos;
+        }
+    }
+    --refs->used;
+}
+
+static struct blob_ref* find_blob(const struct content* content, uint64_t offset)
+{
+    for (uint32_t i = 0; i < content->count; ++i) {
+        if (content->blobs[i].offset == offset) return &content->blobs[i];
+    }
+    return NULL;
+}
+
+/*******************************************************************
+ * Positions in offset order.
+ */
+static int compare_pos(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct blob_pos*) a)->offset;
+    const uint64_t y = ((const struct blob_pos*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************
+ * The first position at or after offset.
+ */
+static size_t lower_bound(const struct imgfs_refs* refs, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = refs->nb_blobs;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (refs->by_offset[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*******************************************************************
+ * The position of the blob at offset with content sha, nb_blobs if none.
+ */
+static size_t find_pos(const struct imgfs_refs* refs, uint64_t offset, const uint8_t* sha)
+{
+    size_t i = lower_bound(refs, offset);
+    while (i < refs->nb_blobs && refs->by_offset[i].offset == offset
+           && memcmp(refs->by_offset[i].sha, sha, SHA256_DIGEST_LENGTH) != 0) {
+        ++i;
+    }
+    return i < refs->nb_blobs && refs->by_offset[i].offset == offset ? i : refs->nb_blobs;
+}
+
+static int add_pos(struct imgfs_refs* refs, uint64_t offset, uint32_t size, const uint8_t* sha)
+{
+    if (refs->nb_blobs == refs->blobs_capacity) {
+        const size_t capacity = refs->blobs_capacity == 0 ? MIN_CAPACITY : 2 * refs->blobs_capacity;
+        struct blob_pos* larger = realloc(refs->by_offset, capacity * sizeof(struct blob_pos));
+        if (larger == NULL) return ERR_OUT_OF_MEMORY;
+        refs->by_offset = larger;
+        refs->blobs_capacity = capacity;
+    }
+
+    const size_t at = refs->unsorted ? refs->nb_blobs : lower_bound(refs, offset);
+    memmove(&refs->by_offset[at + 1], &refs->by_offset[at], (refs->nb_blobs - at) * sizeof(struct blob_pos));
+    refs->by_offset[at].offset = offset;
+    refs->by_offset[at].size = size;
+    memcpy(refs->by_offset[at].sha, sha, SHA256_DIGEST_LENGTH);
+    ++refs->nb_blobs;
+    return ERR_NONE;
+}
+
+static void remove_pos(struct imgfs_refs* refs, uint64_t offset, const uint8_t* sha)
+{
+    const size_t at = find_pos(refs, offset, sha);
+    if (at == refs->nb_blobs) return;
+    --refs->nb_blobs;
+    memmove(&refs->by_offset[at], &refs->by_offset[at + 1], (refs->nb_blobs - at) * sizeof(struct blob_pos));
+}
+
+static int count_blob(struct imgfs_refs* refs, struct content* content, uint64_t offset, uint32_t size, int res)
+{
+    struct blob_ref* blob = find_blob(content, offset);
+    if (blob != NULL) {
+        ++blob->refs;
+        return ERR_NONE;
+    }
+
+    if (content->count == content->capacity) {
+        struct blob_ref* larger = realloc(content->blobs, 2 * content->capacity * sizeof(struct blob_ref));
+        if (larger == NULL) return ERR_OUT_OF_MEMORY;
+        content->blobs = larger;
+        content->capacity *= 2;
+    }
+    const int err = add_pos(refs, offset, size, content->sha);
+    if (err != ERR_NONE) return err;
+    content->blobs[content->count++] = (struct blob_ref) {
+        offset, size, 1, res
+    };
+    return ERR_NONE;
+}
+
+static int add_slot(struct content* content, uint32_t slot)
+{
+    if (content->nb_slots == content->slots_capacity) {
+        const uint32_t capacity = content->slots_capacity == 0 ? 2 : 2 * content->slots_capacity;
+        uint32_t* larger = realloc(content->slots, capacity * sizeof(uint32_t));
+        if (larger == NULL) return ERR_OUT_OF_MEMORY;
+        content->slots = larger;
+        content->slots_capacity = capacity;
+    }
+    content->slots[content->nb_slots++] = slot;
+    return ERR_NONE;
+}
+
+static void remove_slot(struct content* content, uint32_t slot)
+{
+    for (uint32_t i = 0; i < content->nb_slots; ++i) {
+        if (content->slots[i] == slot) {
+            content->slots[i] = content->slots[--content->nb_slots];
+            return;
+        }
+    }
+}
+
+static int count_slot(struct imgfs_refs* refs, const struct img_metadata* metadata, uint32_t slot)
+{
+    struct content* content = NULL;
+    int err = get_content(refs, metadata->SHA, &content);
+    if (err == ERR_NONE) err = add_slot(content, slot);
+    for (int res = 0; res < NB_RES && err == ERR_NONE; ++res) {
+        // offset 0 is the blob of a slot being inserted, not written yet
+        if (metadata->size[res] != 0 && metadata->offset[res] != 0) {
+            err = count_blob(refs, content, metadata->offset[res], metadata->size[res], res);
+        }
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Builds the table from the metadata.
+ */
+static int refs_build(const struct imgfs_file* imgfs_file, struct imgfs_state* state)
+{
+    struct imgfs_refs* refs = calloc(1, sizeof(struct imgfs_refs));
+    if (refs == NULL) return ERR_OUT_OF_MEMORY;
+
+    // the positions are sorted once, at the end
+    refs->unsorted = 1;
+    int err = ERR_NONE;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE; ++i) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+            err = count_slot(refs, &imgfs_file->metadata[i], i);
+        }
+    }
+    if (err != ERR_NONE) {
+        refs_destroy(refs);
+        return err;
+    }
+    if (refs->nb_blobs > 1) qsort(refs->by_offset, refs->nb_blobs, sizeof(struct blob_pos), compare_pos);
+    refs->unsorted = 0;
+    state->refs = refs;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Public interface.
+ */
+void refs_add(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    struct imgfs_refs* refs = refs_of(imgfs_file);
+    if (refs == NULL || slot >= imgfs_file->header.max_files) return;
+
+    if (count_slot(refs, &imgfs_file->metadata[slot], slot) != ERR_NONE) refs_drop(imgfs_file);
+}
+
+void refs_add_variant(struct imgfs_file* imgfs_file, uint32_t slot, int res)
+{
+    struct imgfs_refs* refs = refs_of(imgfs_file);
+    if (refs == NULL || slot >= imgfs_file->header.max_files || res < 0 || res >= NB_RES) return;
+
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    struct content* content = NULL;
+    int err = get_content(refs, metadata->SHA, &content);
+    if (err == ERR_NONE) err = count_blob(refs, content, metadata->offset[res], metadata->size[res], res);
+    if (err != ERR_NONE) refs_drop(imgfs_file);
+}
+
+int refs_find_variant(const struct imgfs_file* imgfs_file, const uint8_t* sha, int res,
+                      uint64_t* offset, uint32_t* size)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL || sha == NULL
+        || offset == NULL || size == NULL) return 0;
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state != NULL && (state->refs != NULL || refs_build(imgfs_file, state) == ERR_NONE)) {
+        const struct content* content = find_content(state->refs, sha);
+        for (uint32_t b = 0; content != NULL && b < content->count; ++b) {
+            if (content->blobs[b].res == res) {
+                *offset = content->blobs[b].offset;
+                *size = content->blobs[b].size;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid == NON_EMPTY && metadata->size[res] != 0 && metadata->offset[res] != 0
+            && memcmp(metadata->SHA, sha, SHA256_DIGEST_LENGTH) == 0) {
+            *offset = metadata->offset[res];
+            *size = metadata->size[res];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int refs_remove(struct imgfs_file* imgfs_file, uint32_t slot,
+                struct blob_move* freed, size_t* nb_freed)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(freed);
+    M_REQUIRE_NON_NULL(nb_freed);
+    if (slot >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+    *nb_freed = 0;
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+
+    // A table built now does not count the slot any more:
+    // its blobs that are not in the table are the freed ones.
+    const int counted = state->refs != NULL;
+    if (!counted) {
+        const int err = refs_build(imgfs_file, state);
+        if (err != ERR_NONE) return err;
+    }
+
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    struct content* content = find_content(state->refs, metadata->SHA);
+    if (content != NULL && counted) remove_slot(content, slot);
+    for (int res = 0; res < NB_RES; ++res) {
+        if (metadata->size[res] == 0 || metadata->offset[res] == 0) continue;
+
+        struct blob_ref* blob = content == NULL ? NULL : find_blob(content, metadata->offset[res]);
+        if (blob != NULL && counted && --blob->refs == 0) {
+            remove_pos(state->refs, blob->offset, content->sha);
+            *blob = content->blobs[--content->count];
+            blob = NULL;
+        }
+        if (blob == NULL) {
+            freed[(*nb_freed)++] = (struct blob_move) {
+                metadata->offset[res], metadata->offset[res], metadata->size[res]
+            };
+        }
+    }
+    if (content != NULL && content->count == 0) erase_content(state->refs, content);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * The table of an open imgFS, built if needed.
+ */
+static int get_refs(const struct imgfs_file* imgfs_file, struct imgfs_refs** refs)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+    if (state->refs == NULL) {
+        const int err = refs_build(imgfs_file, state);
+        if (err != ERR_NONE) return err;
+    }
+    *refs = state->refs;
+    return ERR_NONE;
+}
+
+int refs_collect(const struct imgfs_file* imgfs_file, uint64_t first, uint64_t limit, size_t max,
+                 struct blob_move** blobs, size_t* count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(blobs);
+    M_REQUIRE_NON_NULL(count);
+
+    struct imgfs_refs* refs = NULL;
+    const int err = get_refs(imgfs_file, &refs);
+    if (err != ERR_NONE) return err;
+
+    // the positions are already in order: only the range is copied
+    const size_t start = lower_bound(refs, first);
+    size_t end = start;
+    while (end < refs->nb_blobs && end - start < max && refs->by_offset[end].offset < limit) ++end;
+
+    *count = 0;
+    *blobs = calloc(MAX(end - start, (size_t) 1), sizeof(struct blob_move));
+    if (*blobs == NULL) return ERR_OUT_OF_MEMORY;
+    for (size_t i = start; i < end; ++i) {
+        const struct blob_pos* pos = &refs->by_offset[i];
+        // a blob shared by contents only counts once
+        if (*count > 0 && (*blobs)[*count - 1].from == pos->offset) continue;
+        (*blobs)[(*count)++] = (struct blob_move) {
+            pos->offset, pos->offset, pos->size
+        };
+    }
+    return ERR_NONE;
+}
+
+int refs_slots(const struct imgfs_file* imgfs_file, const struct blob_move* blobs, size_t count,
+               uint32_t** slots, size_t* nb_slots)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(slots);
+    M_REQUIRE_NON_NULL(nb_slots);
+    if (count > 0) M_REQUIRE_NON_NULL(blobs);
+
+    struct imgfs_refs* refs = NULL;
+    int err = get_refs(imgfs_file, &refs);
+    if (err != ERR_NONE) return err;
+
+    size_t capacity = 16;
+    *nb_slots = 0;
+    *slots = calloc(capacity, sizeof(uint32_t));
+    if (*slots == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t b = 0; b < count && err == ERR_NONE; ++b) {
+        for (size_t i = lower_bound(refs, blobs[b].from);
+             i < refs->nb_blobs && refs->by_offset[i].offset == blobs[b].from && err == ERR_NONE; ++i) {
+            const struct content* content = find_content(refs, refs->by_offset[i].sha);
+            for (uint32_t k = 0; content != NULL && k < content->nb_slots; ++k) {
+                if (*nb_slots == capacity) {
+                    capacity *= 2;
+                    uint32_t* larger = realloc(*slots, capacity * sizeof(uint32_t));
+                    if (larger == NULL) {
+                        err = ERR_OUT_OF_MEMORY;
+                        break;
+                    }
+                    *slots = larger;
+                }
+                (*slots)[(*nb_slots)++] = content->slots[k];
+            }
+        }
+    }
+    if (err != ERR_NONE) {
+        free(*slots);
+        *slots = NULL;
+        *nb_slots = 0;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Puts back in order the positions of nb_moved blobs that moved.
+ */
+static void resort(struct imgfs_refs* refs, size_t nb_moved)
+{
+    if (nb_moved > RESORT_MAX_MOVED) {
+        qsort(refs->by_offset, refs->nb_blobs, sizeof(struct blob_pos), compare_pos);
+        return;
+    }
+    // only a few are out of place: one pass of insertion sort puts them back
+    for (size_t i = 1; i < refs->nb_blobs; ++i) {
+        const struct blob_pos pos = refs->by_offset[i];
+        size_t j = i;
+        for (; j > 0 && refs->by_offset[j - 1].offset > pos.offset; --j) {
+            refs->by_offset[j] = refs->by_offset[j - 1];
+        }
+        refs->by_offset[j] = pos;
+    }
+}
+
+/*******************************************************************
+ * A blob found at its old offset, to be given its new one.
+ */
+struct repoint {
+    size_t pos;
+    struct blob_ref* blob;
+    uint64_t to;
+};
+
+void refs_repoint(struct imgfs_file* imgfs_file, const struct blob_move* moves, size_t count)
+{
+    struct imgfs_refs* refs = refs_of(imgfs_file);
+    if (refs == NULL || moves == NULL || count == 0) return;
+
+    // all found from the old offsets first: a blob may move where another one was
+    size_t capacity = count;
+    size_t nb_found = 0;
+    struct repoint* found = calloc(capacity, sizeof(struct repoint));
+    for (size_t m = 0; m < count && found != NULL; ++m) {
+        for (size_t i = lower_bound(refs, moves[m].from);
+             i < refs->nb_blobs && refs->by_offset[i].offset == moves[m].from; ++i) {
+            const struct content* content = find_content(refs, refs->by_offset[i].sha);
+            struct blob_ref* blob = content == NULL ? NULL : find_blob(content, moves[m].from);
+            if (blob == NULL) continue;
+            if (nb_found == capacity) {
+                capacity *= 2;
+                struct repoint* larger = realloc(found, capacity * sizeof(struct repoint));
+                if (larger == NULL) free(found);
+                found = larger;
+                if (found == NULL) break;
+            }
+            found[nb_found++] = (struct repoint) {
+                i, blob, moves[m].to
+            };
+        }
+    }
+    if (found == NULL) {
+        refs_drop(imgfs_file);
+        return;
+    }
+
+    int sorted = 1;
+    for (size_t k = 0; k < nb_found; ++k) {
+        found[k].blob->offset = found[k].to;
+        refs->by_offset[found[k].pos].offset = found[k].to;
+    }
+    // compaction keeps the order of the blobs, growing does not
+    for (size_t k = 0; k < nb_found && sorted; ++k) {
+        const size_t i = found[k].pos;
+        if ((i > 0 && refs->by_offset[i - 1].offset > refs->by_offset[i].offset)
+            || (i + 1 < refs->nb_blobs && refs->by_offset[i].offset > refs->by_offset[i + 1].offset)) {
+            sorted = 0;
+        }
+    }
+    if (!sorted) resort(refs, nb_found);
+    free(found);
+}
+
+void refs_free(struct imgfs_file* imgfs_file)
+{
+    refs_drop(imgfs_file);
+}
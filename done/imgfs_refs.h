@@ -0,0 +1,127 @@
+/**
+ * @file imgfs_refs.h
+ * @brief Reference-counted table of the blobs of an imgFS, by content.
+ *
+ * Deduplicated slots share the blobs of their content. The table keeps,
+ * for each distinct content (SHA), its blobs (original and variants),
+ * each with the number of valid slots referring to it, and these slots.
+ * A slot reaches its blobs through its SHA, so a deletion knows right
+ * away which blobs became free. The blobs are also kept in offset
+ * order, so that compaction gets the live blobs from any offset on, and
+ * the slots referring to a moved blob, without walking the metadata.
+ *
+ * The table is built from the metadata the first time it is needed
+ * (never by do_open() itself, to keep lazy opens cheap), then kept up
+ * to date. Should an update fail, the table is dropped and simply built
+ * again at its next use.
+ */
+
+#pragma once
+
+#include "imgfs.h"        // for struct imgfs_file
+#include "imgfs_blobs.h"  // for struct blob_move
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_refs; // the table, see imgfs_refs.c
+
+/**
+ * @brief Counts the blobs of a slot that just became valid.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot, already holding its SHA, offsets and sizes.
+ */
+void refs_add(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Counts a variant just added to a valid slot.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot.
+ * @param res The resolution of the new variant.
+ */
+void refs_add_variant(struct imgfs_file* imgfs_file, uint32_t slot, int res);
+
+/**
+ * @brief Looks for a variant of a content, that some slot already has.
+ *
+ * An imgfs_file without state gets a scan of the metadata instead.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param sha The SHA256 digest of the content.
+ * @param res The resolution of the variant.
+ * @param offset Where to put the offset of the variant, if found.
+ * @param size Where to put the size of the variant, if found.
+ * @return 1 if found, 0 otherwise.
+ */
+int refs_find_variant(const struct imgfs_file* imgfs_file, const uint8_t* sha, int res,
+                      uint64_t* offset, uint32_t* size);
+
+/**
+ * @brief Uncounts the blobs of a slot that is no longer valid (but still
+ *        holds its SHA, offsets and sizes), and lists those no valid slot
+ *        refers to any more.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot.
+ * @param freed Where to put the freed blobs (room for NB_RES of them).
+ * @param nb_freed Where to put the number of freed blobs.
+ * @return Some error code. 0 if no error.
+ */
+int refs_remove(struct imgfs_file* imgfs_file, uint32_t slot,
+                struct blob_move* freed, size_t* nb_freed);
+
+/**
+ * @brief Lists the live blobs starting in [first, limit), in offset order:
+ *        at most max of them, the first ones. Their destination is set to
+ *        where they are.
+ *
+ * @param imgfs_file The main in-memory structure, with a state.
+ * @param first Lowest offset to consider.
+ * @param limit Offset from which blobs are no longer considered.
+ * @param max Most blobs to list.
+ * @param blobs Where to put the (allocated) list, to be freed by the caller.
+ * @param count Where to put the number of blobs.
+ * @return Some error code. 0 if no error.
+ */
+int refs_collect(const struct imgfs_file* imgfs_file, uint64_t first, uint64_t limit, size_t max,
+                 struct blob_move** blobs, size_t* count);
+
+/**
+ * @brief Lists the valid slots referring to some blobs (a slot may be
+ *        listed more than once).
+ *
+ * @param imgfs_file The main in-memory structure, with a state.
+ * @param blobs The blobs, by their current offset (from).
+ * @param count The number of blobs.
+ * @param slots Where to put the (allocated) list, to be freed by the caller.
+ * @param nb_slots Where to put the number of slots.
+ * @return Some error code. 0 if no error.
+ */
+int refs_slots(const struct imgfs_file* imgfs_file, const struct blob_move* blobs, size_t count,
+               uint32_t** slots, size_t* nb_slots);
+
+/**
+ * @brief Follows moved blobs.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param moves The moves, sorted by from.
+ * @param count The number of moves.
+ */
+void refs_repoint(struct imgfs_file* imgfs_file, const struct blob_move* moves, size_t count);
+
+/**
+ * @brief Releases the table (if any).
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void refs_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
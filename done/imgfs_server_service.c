@@ -5,22 +5,89 @@
  * @author Konstantinos Prasopoulos
  */
 
+#define _GNU_SOURCE // for pthread_rwlockattr_setkind_np()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <inttypes.h> // PRIu64
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>  // ETIMEDOUT
+#include <time.h>   // clock_gettime
+#include <vips/vips.h> // g_free
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "image_content.h"
+#include "imgfs_derived.h"
+#include "imgfs_durability.h"
+#include "imgfs_index.h"
+#include "imgfs_rcu.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_wal.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
 
 // Main in-memory structure for imgFS
 static struct imgfs_file fs_file;
 static uint16_t server_port;
-pthread_mutex_t imgfs_mutex;
+// Held for writing by the requests that change the imgFS. Those that only
+// read it are answered from the snapshot of its metadata without any lock
+// (see imgfs_snapshot.h), and only take it, for reading when they change
+// nothing, when the snapshot cannot answer. Writers go first, lest a
+// stream of reads starve them.
+static pthread_rwlock_t imgfs_lock;
+// The snapshot of fs_file, and whether readers must go through imgfs_lock
+// instead, and copy what they send, while blobs move. A reply served from
+// the mapping of the file is sent within a read section (see imgfs_rcu.h):
+// the room of a deleted blob is only reused once no such reply uses it.
+static struct imgfs_snapshot* snapshot;
+static atomic_int readers_blocked;
+
+// Background compaction (see do_gbcollect_step()), at most gc_rate bytes copied per second.
+static size_t gc_rate;
+static int gc_running;
+static pthread_t gc_thread;
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_wakeup = PTHREAD_COND_INITIALIZER;
+
+// Variants being computed by a read (see read_through_metadata()): the
+// other reads of the same variant wait for it instead of computing it again.
+struct resize_flight {
+    uint32_t slot;
+    unsigned int resolutions; // RESOLUTION_BIT()s
+    int landed;             // the variant was computed, or failed
+    int result;             // then, the error, if any
+    unsigned int waiters;   // reads waiting for it
+    struct resize_flight* next;
+};
+static struct resize_flight* flights;
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER; // taken after imgfs_lock
+static pthread_cond_t flights_landed = PTHREAD_COND_INITIALIZER;
+
+// Background computation of the variants of the images inserted (see
+// variant_loop()), by variant_workers threads taking their IDs from a
+// bounded queue.
+#define VARIANT_QUEUE_CAPACITY 1024
+#define MAX_VARIANT_WORKERS 64
+static char variant_queue[VARIANT_QUEUE_CAPACITY][MAX_IMG_ID + 1];
+static size_t variant_head;     // next to take
+static size_t variant_count;    // waiting in the queue
+static uint64_t variants_dropped; // queue full
+static int variants_running;
+static unsigned int variant_workers;
+static pthread_t variant_threads[MAX_VARIANT_WORKERS];
+static pthread_mutex_t variant_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t variant_wakeup = PTHREAD_COND_INITIALIZER;
+
+// the boxes the sized variants fit in (/imgfs/read?w=&h=)
+static struct size_buckets size_buckets;
+
+#define GC_STEP_PERIOD_MS 100  // a step copies what the rate allows during this period
+#define GC_IDLE_PERIOD_MS 10000 // pause between two passes
 
 #define URI_ROOT "/imgfs"
 #define DEFAULT_LISTENING_PORT 8000
@@ -29,6 +96,12 @@ pthread_mutex_t imgfs_mutex;
 
 #define BASE_FILE "index.html"
 
+static int handle_tile_call(const struct http_message* msg, int connection);
+static int reply_sized(int connection, const char* img_id, const char* width, const char* height);
+static int handle_grow_call(const struct http_message* msg, int connection);
+static int handle_stats_call(int connection);
+static void variant_workers_start(unsigned int nb_workers);
+static void variant_workers_stop(void);
 
 /**********************************************************************
  * Sends error message.
@@ -60,6 +133,71 @@ static int reply_302_msg(int connection)
 }
 
 
+/**********************************************************************
+ * Sends the readers to imgfs_lock, where they get copies, and waits for
+ * the replies still being sent from the mapping: blobs are about to move.
+ * Called before taking imgfs_lock, lest a slow client hold every writer.
+ ********************************************************************** */
+static void block_readers(void)
+{
+    atomic_fetch_add(&readers_blocked, 1); // by the compaction and do_grow() alike
+    rcu_synchronize();
+}
+
+static void admit_readers(void)
+{
+    atomic_fetch_sub(&readers_blocked, 1);
+}
+
+/**********************************************************************
+ * Waits for ms milliseconds, or less if the server stops.
+ * Returns whether the compaction is still running.
+ ********************************************************************** */
+static int gc_wait(long ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    while (gc_running && pthread_cond_timedwait(&gc_wakeup, &gc_lock, &deadline) != ETIMEDOUT);
+    const int running = gc_running;
+    pthread_mutex_unlock(&gc_lock);
+    return running;
+}
+
+/**********************************************************************
+ * Compacts the imgFS in the background, one small step at a time so
+ * that the requests are never held for long, and pausing after each
+ * step long enough to keep the copies under gc_rate.
+ ********************************************************************** */
+static void* gc_loop(void* arg _unused)
+{
+    const size_t budget = MAX(gc_rate / (1000 / GC_STEP_PERIOD_MS), (size_t) 1);
+    long pause = GC_STEP_PERIOD_MS;
+    while (gc_wait(pause)) {
+        size_t copied = 0;
+        int finished = 0;
+        block_readers();
+        pthread_rwlock_wrlock(&imgfs_lock);
+        const int err = do_gbcollect_step(&fs_file, budget, &copied, &finished);
+        admit_readers();
+        pthread_rwlock_unlock(&imgfs_lock);
+
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Compaction step failed: %s\n", ERR_MSG(err));
+        }
+        pause = (err != ERR_NONE || finished) ? GC_IDLE_PERIOD_MS
+                : MAX((long) (copied * 1000 / gc_rate), 1L);
+    }
+    return NULL;
+}
+
 /**********************************************************************
  * Simple handling of http message. TO BE UPDATED WEEK 13
  ********************************************************************** */
@@ -79,53 +217,167 @@ int handle_http_message(struct http_message* msg, int connection)
         return handle_list_call(connection);
     } else if (http_match_uri(msg, URI_ROOT "/read")) {
         return handle_read_call(msg, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/tile")) {
+        return handle_tile_call(msg, connection);
     } else if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
         return handle_insert_call(msg, connection);
     } else if (http_match_uri(msg, URI_ROOT "/delete")) {
         return handle_delete_call(msg, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/grow")) {
+        return handle_grow_call(msg, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/stats")) {
+        return handle_stats_call(connection);
     } else {
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 }
 
 
+/********************************************************************//**
+ * Options of the server, as given after the name of the imgFS file.
+ ********************************************************************** */
+struct server_options {
+    uint16_t port;
+    size_t gc_rate;           // background compaction, bytes copied per second, 0 for none
+    const char* durability;   // see server_startup(), NULL for none
+    uint32_t nb_workers;      // threads computing the variants of the images inserted
+    enum resize_mode resize;
+    const char* buckets;      // boxes the sized variants fit in
+};
+
+/********************************************************************//**
+ * Reads the options, each given as "-option value", in any order; those
+ * not given keep their default. The port may also be given alone, right
+ * after the name of the imgFS file.
+ ********************************************************************** */
+static int parse_options(int argc, char** argv, struct server_options* options)
+{
+    options->port = DEFAULT_LISTENING_PORT;
+    options->gc_rate = 0;
+    options->durability = NULL;
+    options->nb_workers = 0;
+    options->resize = RESIZE_EXACT;
+    options->buckets = DEFAULT_SIZE_BUCKETS;
+
+    int i = 2;
+    if (argc > 2 && argv[2][0] != '-') {
+        options->port = atouint16(argv[2]);
+        if (options->port == 0) options->port = DEFAULT_LISTENING_PORT;
+        i = 3;
+    }
+
+    for (; i < argc; i += 2) {
+        if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+        const char* value = argv[i + 1];
+
+        if (strcmp(argv[i], "-port") == 0) {
+            options->port = atouint16(value);
+            if (options->port == 0) return ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "-gc") == 0) {
+            options->gc_rate = (size_t) atouint32(value) * 1024;
+        } else if (strcmp(argv[i], "-durability") == 0) {
+            options->durability = value;
+        } else if (strcmp(argv[i], "-workers") == 0) {
+            options->nb_workers = atouint32(value);
+        } else if (strcmp(argv[i], "-resize") == 0) {
+            const int err = resize_mode_parse(value, &options->resize);
+            if (err != ERR_NONE) return err;
+        } else if (strcmp(argv[i], "-buckets") == 0) {
+            options->buckets = value;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ERR_NONE;
+}
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2],
+ * then any of these options, each followed by its value:
+ *  -port:       the port number, if not given as argv[2] (8000 by default)
+ *  -gc:         the background compaction rate, in KiB/s (0, the default, for none)
+ *  -durability: "none" (the default), "batched[:MS]" or "sync" (see
+ *               imgfs_durability.h), or "wal" to log the metadata changes
+ *               and sync inserts and deletes together before replying
+ *               (see imgfs_wal.h)
+ *  -workers:    the number of threads computing the variants of the images
+ *               inserted (0, the default, for none: the first reads compute them)
+ *  -resize:     how the variants are computed: "exact" (the default) or
+ *               "shrink" to decode the originals at a fraction of their size,
+ *               or "exif" to also take the thumbnails from those the cameras
+ *               embed (see image_content.h)
+ *  -buckets:    the boxes the sized variants fit in, e.g. "320x240,640"
+ *               (DEFAULT_SIZE_BUCKETS by default, see imgfs_derived.h)
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
     if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
     const char *imgfs_filename = argv[1];
 
-    int err = do_open(imgfs_filename, "rb+", &fs_file);
+    struct server_options options;
+    int err = parse_options(argc, argv, &options);
+    if (err != ERR_NONE) return err;
+    resize_set_mode(options.resize);
+
+    err = size_buckets_parse(options.buckets, &size_buckets);
+    if (err != ERR_NONE) return err;
+
+    // Only the header is read: the server can accept connections right away.
+    err = do_open_lazy(imgfs_filename, "rb+", &fs_file);
     if (err != ERR_NONE) {
         return err;
     }
 
-    if (pthread_mutex_init(&imgfs_mutex, NULL) != 0) {
-        fprintf(stderr, "Mutex init has failed\n");
+    if (options.durability != NULL) {
+        if (strcmp(options.durability, "wal") == 0) {
+            err = wal_start(&fs_file, imgfs_filename);
+        } else {
+            enum durability_mode mode = DURABILITY_NONE;
+            uint32_t interval_ms = 0;
+            err = durability_parse(options.durability, &mode, &interval_ms);
+            if (err == ERR_NONE) err = durability_start(&fs_file, mode, interval_ms);
+        }
+        if (err != ERR_NONE) {
+            do_close(&fs_file);
+            return err;
+        }
+    }
+
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    const int lock_err = pthread_rwlock_init(&imgfs_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    if (lock_err != 0) {
+        fprintf(stderr, "Lock init has failed\n");
         do_close(&fs_file);
         return ERR_THREADING;
     }
 
+    snapshot = snapshot_of(&fs_file);
     print_header(&fs_file.header);
 
-    if (argc >= 3) {
-        server_port = atouint16(argv[2]);
-        if (server_port == 0) {
-            server_port = DEFAULT_LISTENING_PORT;
-        }
-    } else {
-        server_port = DEFAULT_LISTENING_PORT;
-    }
-
+    server_port = options.port;
     err = http_init(server_port, handle_http_message);
     if (err < 0) {
         do_close(&fs_file);
         return ERR_IO;
     }
 
+    gc_rate = options.gc_rate;
+    if (gc_rate > 0) {
+        gc_running = 1;
+        if (pthread_create(&gc_thread, NULL, gc_loop, NULL) != 0) {
+            gc_running = 0;
+            fprintf(stderr, "Could not start the background compaction\n");
+        }
+    }
+
+    if (options.nb_workers > 0) {
+        variant_workers_start(MIN(options.nb_workers, (uint32_t) MAX_VARIANT_WORKERS));
+    }
+
     printf("ImgFS server started on http://localhost:%d\n", server_port);
     return ERR_NONE;
 
@@ -137,28 +389,67 @@ int server_startup (int argc, char **argv)
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
+    pthread_mutex_lock(&gc_lock);
+    const int gc_was_running = gc_running;
+    gc_running = 0;
+    pthread_cond_broadcast(&gc_wakeup);
+    pthread_mutex_unlock(&gc_lock);
+    if (gc_was_running) pthread_join(gc_thread, NULL);
+
     http_close();
+    variant_workers_stop();
     do_close(&fs_file);
-    pthread_mutex_destroy(&imgfs_mutex);
+    pthread_rwlock_destroy(&imgfs_lock);
+}
+
+/**********************************************************************
+ * Sends a listing in JSON format.
+ ********************************************************************** */
+static int reply_list(int connection, const char* json)
+{
+    char headers[256];
+    snprintf(headers, sizeof(headers),
+             "Content-Type: application/json" HTTP_LINE_DELIM,
+             strlen(json));
+
+    return http_reply(connection, "200 OK", headers, json, strlen(json));
 }
 
 /**
  * @brief Handles the 'list' API call, sending a JSON response with file system entries.
  *
- * This function locks the file system, calls the function to list entries, and constructs
+ * This function sends the listing published since the latest change, or else locks the
+ * file system, calls the function to list entries and publishes them, and constructs
  * an HTTP response with the list in JSON format. It handles errors by replying with an
- * appropriate error message and ensures the mutual exclusion on file system access.
+ * appropriate error message.
  *
  * @param connection The socket connection to send the response to.
  * @return The status of the HTTP response.
  */
 int handle_list_call(int connection)
 {
+    int result = rcu_read_enter();
+    if (result != ERR_NONE) {
+        return reply_error_msg(connection, result);
+    }
+
+    // the listing published since the latest change, if any, needs no lock
+    const char* published = snapshot_list(snapshot);
+    if (published != NULL) {
+        result = reply_list(connection, published);
+        rcu_read_exit();
+        return result;
+    }
+    rcu_read_exit();
+
     char* json_output = NULL;
 
-    pthread_mutex_lock(&imgfs_mutex);
-    int result = do_list(&fs_file, JSON, &json_output);
-    pthread_mutex_unlock(&imgfs_mutex);
+    pthread_rwlock_rdlock(&imgfs_lock);
+    result = do_list(&fs_file, JSON, &json_output);
+    if (result == ERR_NONE) {
+        (void) snapshot_set_list(&fs_file, json_output); // for the next ones, if possible
+    }
+    pthread_rwlock_unlock(&imgfs_lock);
 
     if (result != ERR_NONE) {
         if (json_output != NULL) {
@@ -167,18 +458,288 @@ int handle_list_call(int connection)
         return reply_error_msg(connection, result);
     }
 
-    char headers[256];
-    snprintf(headers, sizeof(headers),
-             "Content-Type: application/json" HTTP_LINE_DELIM,
-             strlen(json_output));
-
-    int response_status = http_reply(connection, "200 OK", headers, json_output, strlen(json_output));
+    int response_status = reply_list(connection, json_output);
 
     free(json_output);
 
     return response_status;
 }
 
+/**********************************************************************
+ * Joins the computation of variants of a slot, if some request is
+ * computing any of the given ones. Returns it then, NULL otherwise.
+ ********************************************************************** */
+static struct resize_flight* flight_join(uint32_t slot, unsigned int resolutions)
+{
+    pthread_mutex_lock(&flights_lock);
+    struct resize_flight* flight = flights;
+    while (flight != NULL && !(flight->slot == slot && (flight->resolutions & resolutions))) {
+        flight = flight->next;
+    }
+    if (flight != NULL) flight->waiters++;
+    pthread_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+/**********************************************************************
+ * Waits for a joined computation to end, and gives its error, if any.
+ ********************************************************************** */
+static int flight_wait(struct resize_flight* flight)
+{
+    pthread_mutex_lock(&flights_lock);
+    while (!flight->landed) {
+        pthread_cond_wait(&flights_landed, &flights_lock);
+    }
+    const int result = flight->result;
+    if (--flight->waiters == 0) free(flight);
+    pthread_mutex_unlock(&flights_lock);
+    return result;
+}
+
+/**********************************************************************
+ * Registers the computation of variants, for the other requests to join.
+ * Returns NULL if out of memory: they then compute them too.
+ ********************************************************************** */
+static struct resize_flight* flight_start(uint32_t slot, unsigned int resolutions)
+{
+    struct resize_flight* flight = calloc(1, sizeof(struct resize_flight));
+    if (flight == NULL) return NULL;
+    flight->slot = slot;
+    flight->resolutions = resolutions;
+
+    pthread_mutex_lock(&flights_lock);
+    flight->next = flights;
+    flights = flight;
+    pthread_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+/**********************************************************************
+ * Ends a computation, waking up the reads that joined it.
+ ********************************************************************** */
+static void flight_land(struct resize_flight* flight, int result)
+{
+    if (flight == NULL) return;
+
+    pthread_mutex_lock(&flights_lock);
+    for (struct resize_flight** link = &flights; *link != NULL; link = &(*link)->next) {
+        if (*link == flight) {
+            *link = flight->next;
+            break;
+        }
+    }
+    flight->landed = 1;
+    flight->result = result;
+    if (flight->waiters == 0) {
+        free(flight);
+    } else {
+        pthread_cond_broadcast(&flights_landed);
+    }
+    pthread_mutex_unlock(&flights_lock);
+}
+
+/**********************************************************************
+ * Computes the variants of an image it does not have yet, from a single
+ * decoding of the original. The encoding runs without imgfs_lock, so
+ * that the other requests go on meanwhile, and only once: the requests
+ * for a variant being computed wait for it. Also builds the snapshot if
+ * needed. Called, and returns, with imgfs_lock held for writing.
+ ********************************************************************** */
+static int compute_variants(const char* img_id, unsigned int resolutions)
+{
+    struct resize_job job;
+    int done = 0;
+    int result = ERR_NONE;
+
+    while (result == ERR_NONE && !done) {
+        result = index_finish_scan(&fs_file);
+        if (result != ERR_NONE) break;
+        (void) snapshot_build(&fs_file); // if it fails, reads keep coming here
+        const uint32_t index = index_find_id(&fs_file, img_id, INDEX_NO_SLOT);
+        if (index == INDEX_NO_SLOT) {
+            result = ERR_IMAGE_NOT_FOUND;
+            break;
+        }
+
+        // computed by another request: wait for it, then look again (the
+        // slot may hold another image by then)
+        struct resize_flight* flight = flight_join(index, resolutions);
+        if (flight != NULL) {
+            pthread_rwlock_unlock(&imgfs_lock);
+            result = flight_wait(flight);
+            pthread_rwlock_wrlock(&imgfs_lock);
+            continue;
+        }
+
+        result = resize_begin(resolutions, &fs_file, index, &job, &done);
+        if (result != ERR_NONE || done) break;
+
+        flight = flight_start(index, job.resolutions);
+        pthread_rwlock_unlock(&imgfs_lock);
+        result = resize_encode(&job);
+        pthread_rwlock_wrlock(&imgfs_lock);
+        if (result == ERR_NONE) result = resize_finish(&fs_file, &job);
+        resize_release(&job);
+        flight_land(flight, result);
+        done = 1;
+    }
+    return result;
+}
+
+/**********************************************************************
+ * Reads a variant through the metadata, when the snapshot could not,
+ * computing it if missing. Once the snapshot is built, reads of existing
+ * variants no longer come here. When no error, returns within a read
+ * section, which keeps the view in place, or else, while blobs move,
+ * with a copy of the variant in *copy.
+ ********************************************************************** */
+static int read_through_metadata(const char* img_id, int resolution,
+                                 const char** image_buffer, uint32_t* image_size, char** copy)
+{
+    pthread_rwlock_wrlock(&imgfs_lock);
+    int result = compute_variants(img_id, RESOLUTION_BIT(resolution));
+    if (result == ERR_NONE) {
+        // entered before looking at readers_blocked, lest block_readers() miss it
+        (void) rcu_read_enter(); // cannot fail, the thread already entered once
+        if (atomic_load(&readers_blocked)) {
+            rcu_read_exit();
+            result = do_read(img_id, resolution, copy, image_size, &fs_file);
+            *image_buffer = *copy;
+        } else {
+            result = do_read_view(img_id, resolution, image_buffer, image_size, &fs_file);
+            if (result != ERR_NONE) rcu_read_exit();
+        }
+    }
+    pthread_rwlock_unlock(&imgfs_lock);
+    return result;
+}
+
+/**********************************************************************
+ * Reads a variant, from the snapshot without lock if possible. When no
+ * error, returns within a read section, which keeps the view in place
+ * until the reply is sent, or with a copy in *copy: see release_view().
+ ********************************************************************** */
+static int read_view(const char* img_id, int resolution, const char** image_buffer, uint32_t* image_size,
+                     char** copy)
+{
+    *copy = NULL;
+    int result = rcu_read_enter();
+    if (result != ERR_NONE) return result;
+    int done = 0;
+    if (!atomic_load(&readers_blocked)) {
+        result = snapshot_read_view(snapshot, img_id, resolution, image_buffer, image_size, &done);
+    }
+    if (!done) {
+        // out of the read section, which a writer may be waiting for
+        rcu_read_exit();
+        return read_through_metadata(img_id, resolution, image_buffer, image_size, copy);
+    }
+    if (result != ERR_NONE) rcu_read_exit();
+    return result;
+}
+
+/**********************************************************************
+ * Lets go of what read_view() gave, once sent.
+ ********************************************************************** */
+static void release_view(char* copy)
+{
+    if (copy != NULL) {
+        free(copy);
+    } else {
+        rcu_read_exit();
+    }
+}
+
+/**********************************************************************
+ * Queues the computation of the variants of an image just inserted.
+ * Does nothing without variant workers; when the queue is full, the
+ * variants are left to the first reads.
+ ********************************************************************** */
+static void variant_queue_push(const char* img_id)
+{
+    pthread_mutex_lock(&variant_lock);
+    if (variants_running) {
+        if (variant_count == VARIANT_QUEUE_CAPACITY) {
+            variants_dropped++;
+        } else {
+            char* slot = variant_queue[(variant_head + variant_count) % VARIANT_QUEUE_CAPACITY];
+            strncpy(slot, img_id, MAX_IMG_ID);
+            slot[MAX_IMG_ID] = '\0';
+            variant_count++;
+            pthread_cond_signal(&variant_wakeup);
+        }
+    }
+    pthread_mutex_unlock(&variant_lock);
+}
+
+/**********************************************************************
+ * Waits for an image whose variants are to be computed.
+ * Returns 0 when the server stops.
+ ********************************************************************** */
+static int variant_queue_take(char* img_id)
+{
+    pthread_mutex_lock(&variant_lock);
+    while (variants_running && variant_count == 0) {
+        pthread_cond_wait(&variant_wakeup, &variant_lock);
+    }
+    const int running = variants_running;
+    if (running) {
+        memcpy(img_id, variant_queue[variant_head], MAX_IMG_ID + 1);
+        variant_head = (variant_head + 1) % VARIANT_QUEUE_CAPACITY;
+        variant_count--;
+    }
+    pthread_mutex_unlock(&variant_lock);
+    return running;
+}
+
+/**********************************************************************
+ * A variant worker: computes the thumbnail and small variants of the
+ * images inserted, so that their first reads find them ready.
+ ********************************************************************** */
+static void* variant_loop(void* arg _unused)
+{
+    char img_id[MAX_IMG_ID + 1];
+    while (variant_queue_take(img_id)) {
+        pthread_rwlock_wrlock(&imgfs_lock);
+        const int err = compute_variants(img_id, RESIZED_VARIANTS);
+        pthread_rwlock_unlock(&imgfs_lock);
+        if (err != ERR_NONE && err != ERR_IMAGE_NOT_FOUND) { // not found: deleted meanwhile
+            fprintf(stderr, "Variants of %s failed: %s\n", img_id, ERR_MSG(err));
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************
+ * Starts nb_workers variant workers.
+ ********************************************************************** */
+static void variant_workers_start(unsigned int nb_workers)
+{
+    variants_running = 1;
+    for (variant_workers = 0; variant_workers < nb_workers; ++variant_workers) {
+        if (pthread_create(&variant_threads[variant_workers], NULL, variant_loop, NULL) != 0) {
+            fprintf(stderr, "Could only start %u variant workers\n", variant_workers);
+            break;
+        }
+    }
+    if (variant_workers == 0) variants_running = 0;
+}
+
+/**********************************************************************
+ * Stops the variant workers, dropping what they did not compute yet.
+ ********************************************************************** */
+static void variant_workers_stop(void)
+{
+    pthread_mutex_lock(&variant_lock);
+    variants_running = 0;
+    pthread_cond_broadcast(&variant_wakeup);
+    pthread_mutex_unlock(&variant_lock);
+    for (unsigned int i = 0; i < variant_workers; ++i) {
+        pthread_join(variant_threads[i], NULL);
+    }
+    variant_workers = 0;
+}
+
 /**
  * @brief Handles the 'read' API call, sending the requested image data.
  *
@@ -186,6 +747,10 @@ int handle_list_call(int connection)
  * file system, and sends it back to the client. Handles different resolutions and errors
  * such as missing arguments or resolution mismatches.
  *
+ * Instead of a resolution, a size may be given as w and/or h: the image is then sent
+ * fit in the smallest bucket holding that size (see imgfs_derived.h), computed the
+ * first time and stored as a derived image, or as is when no larger than the bucket.
+ *
  * @param msg The HTTP message containing the request.
  * @param connection The socket connection to send the response to.
  * @return The status of the HTTP response.
@@ -193,6 +758,20 @@ int handle_list_call(int connection)
 
 int handle_read_call(struct http_message* msg, int connection)
 {
+    char img_id[MAX_IMG_ID];
+    int img_id_len = http_get_var(&msg->uri, "img_id", img_id, sizeof(img_id));
+
+    // any size, instead of one of the resolutions
+    char width[16], height[16];
+    const int width_len = http_get_var(&msg->uri, "w", width, sizeof(width));
+    const int height_len = http_get_var(&msg->uri, "h", height, sizeof(height));
+    if (width_len > 0 || height_len > 0) {
+        if (img_id_len <= 0) {
+            return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        }
+        return reply_sized(connection, img_id, width_len > 0 ? width : NULL, height_len > 0 ? height : NULL);
+    }
+
     char res[10];
     int res_len = http_get_var(&msg->uri, "res", res, sizeof(res));
     if (res_len <= 0) {
@@ -204,21 +783,17 @@ int handle_read_call(struct http_message* msg, int connection)
         return reply_error_msg(connection, ERR_RESOLUTIONS);
     }
 
-    char img_id[MAX_IMG_ID];
-    int img_id_len = http_get_var(&msg->uri, "img_id", img_id, sizeof(img_id));
     if (img_id_len <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
 
-    char* image_buffer = NULL;
+    // The content is served straight from the mapping of the imgFS file,
+    // found through the snapshot without any lock.
+    const char* image_buffer = NULL;
     uint32_t image_size = 0;
-    pthread_mutex_lock(&imgfs_mutex);
-    int result = do_read(img_id, resolution, &image_buffer, &image_size, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex);
+    char* copy = NULL;
+    int result = read_view(img_id, resolution, &image_buffer, &image_size, &copy);
     if (result != ERR_NONE) {
-        if (image_buffer) {
-            free(image_buffer);
-        }
         return reply_error_msg(connection, result);
     }
 
@@ -227,11 +802,172 @@ int handle_read_call(struct http_message* msg, int connection)
              "Content-Type: image/jpeg" HTTP_LINE_DELIM,
              image_size);
 
-    int response_status = http_reply(connection, "200 OK", headers, image_buffer, image_size);
+    result = http_reply(connection, "200 OK", headers, image_buffer, image_size);
+    release_view(copy);
+    return result;
+}
 
-    free(image_buffer);
+/**********************************************************************
+ * Copies the original of an image, to compute what derives from it
+ * without imgfs_lock. Copies nothing, and gives a NULL copy, when the
+ * original already fits in the given box (0 x 0 to always copy). Takes
+ * imgfs_lock for writing, as lookups may extend a lazy index.
+ ********************************************************************** */
+static int copy_original(const char* img_id, uint32_t box_width, uint32_t box_height,
+                         char** original, uint32_t* original_size)
+{
+    *original = NULL;
+    const char* view = NULL;
+    pthread_rwlock_wrlock(&imgfs_lock);
+    const uint32_t index = index_find_id(&fs_file, img_id, INDEX_NO_SLOT);
+    int result = index == INDEX_NO_SLOT ? ERR_IMAGE_NOT_FOUND
+                 : do_read_view(img_id, ORIG_RES, &view, original_size, &fs_file);
+    if (result == ERR_NONE) {
+        const struct img_metadata* metadata = &fs_file.metadata[index];
+        if (metadata->orig_res[0] > box_width || metadata->orig_res[1] > box_height) {
+            *original = malloc(*original_size);
+            if (*original == NULL) result = ERR_OUT_OF_MEMORY;
+            else memcpy(*original, view, *original_size);
+        }
+    }
+    pthread_rwlock_unlock(&imgfs_lock);
+    return result;
+}
 
-    return response_status;
+/**********************************************************************
+ * Stores an image derived from another for the next requests. Two
+ * requests for the same new one may both compute it: the second one is
+ * then not stored (ERR_DUPLICATE_ID). It is served anyway when it cannot
+ * be stored, which is only logged: it is computed again next time.
+ ********************************************************************** */
+static void store_derived(const void* derived, size_t derived_size, const char* derived_id, const char* img_id)
+{
+    pthread_rwlock_wrlock(&imgfs_lock);
+    const int err = derived_insert(derived, derived_size, derived_id, img_id, &fs_file);
+    pthread_rwlock_unlock(&imgfs_lock);
+    if (err != ERR_NONE && err != ERR_DUPLICATE_ID) {
+        fprintf(stderr, "Could not store an image derived from %s: %s\n", img_id, ERR_MSG(err));
+    }
+}
+
+/**********************************************************************
+ * Sends a derived image stored under derived_id (NULL if it cannot be
+ * stored), computing it with encode() if it is not yet. Sends the
+ * original instead when it fits in the given box.
+ ********************************************************************** */
+static int reply_derived(int connection, const char* img_id, const char* derived_id,
+                         uint32_t box_width, uint32_t box_height,
+                         int (*encode)(const char* original, size_t original_size,
+                                       const void* what, void** derived, size_t* derived_size),
+                         const void* what)
+{
+    const char* headers = "Content-Type: image/jpeg" HTTP_LINE_DELIM;
+    const char* image_buffer = NULL;
+    uint32_t image_size = 0;
+    char* copy = NULL;
+    int result = derived_id == NULL ? ERR_IMAGE_NOT_FOUND
+                 : read_view(derived_id, ORIG_RES, &image_buffer, &image_size, &copy);
+    if (result == ERR_IMAGE_NOT_FOUND) {
+        char* original = NULL;
+        uint32_t original_size = 0;
+        result = copy_original(img_id, box_width, box_height, &original, &original_size);
+        if (result != ERR_NONE) {
+            return reply_error_msg(connection, result);
+        }
+        if (original == NULL) {
+            // no smaller than its original: that is what is sent
+            result = read_view(img_id, ORIG_RES, &image_buffer, &image_size, &copy);
+        } else {
+            void* derived = NULL;
+            size_t derived_size = 0;
+            result = encode(original, original_size, what, &derived, &derived_size);
+            free(original);
+            if (result != ERR_NONE) {
+                return reply_error_msg(connection, result);
+            }
+            if (derived_id != NULL) store_derived(derived, derived_size, derived_id, img_id);
+            result = http_reply(connection, "200 OK", headers, derived, derived_size);
+            g_free(derived);
+            return result;
+        }
+    }
+    if (result != ERR_NONE) {
+        return reply_error_msg(connection, result);
+    }
+
+    result = http_reply(connection, "200 OK", headers, image_buffer, image_size);
+    release_view(copy);
+    return result;
+}
+
+/**
+ * @brief A tile to compute.
+ */
+struct tile_request {
+    uint32_t level;
+    uint32_t x;
+    uint32_t y;
+};
+
+static int encode_tile(const char* original, size_t original_size, const void* what,
+                       void** tile, size_t* tile_size)
+{
+    const struct tile_request* tile_request = what;
+    return tile_encode(original, original_size, tile_request->level, tile_request->x, tile_request->y,
+                       tile, tile_size);
+}
+
+/**
+ * @brief Handles the 'tile' API call, sending a square of TILE_SIZE pixels of an image
+ *        at some level of zoom (see imgfs_derived.h).
+ *
+ * A tile is computed from the original the first time it is asked for, decoding it at
+ * the scale of the level and down to the tile only, then stored as an image of its own:
+ * it is then read as any variant, from the snapshot without lock.
+ *
+ * @param msg The HTTP message containing the request.
+ * @param connection The socket connection to send the response to.
+ * @return The status of the HTTP response.
+ */
+static int handle_tile_call(const struct http_message* msg, int connection)
+{
+    char img_id[MAX_IMG_ID];
+    char level[16], x[16], y[16];
+    if (http_get_var(&msg->uri, "img_id", img_id, sizeof(img_id)) <= 0
+        || http_get_var(&msg->uri, "level", level, sizeof(level)) <= 0
+        || http_get_var(&msg->uri, "x", x, sizeof(x)) <= 0
+        || http_get_var(&msg->uri, "y", y, sizeof(y)) <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+    const struct tile_request tile = { atouint32(level), atouint32(x), atouint32(y) };
+
+    char derived_id[MAX_IMG_ID + 1];
+    const int stored = tile_id(img_id, tile.level, tile.x, tile.y, derived_id) == ERR_NONE;
+    // (0 x 0: even a single tile is computed, as it is cut from the original)
+    return reply_derived(connection, img_id, stored ? derived_id : NULL, 0, 0, encode_tile, &tile);
+}
+
+static int encode_sized(const char* original, size_t original_size, const void* what,
+                        void** variant, size_t* variant_size)
+{
+    const uint32_t* box = what;
+    return sized_encode(original, original_size, box[0], box[1], variant, variant_size);
+}
+
+/**********************************************************************
+ * Sends a variant of an image of the size requested (width or height
+ * NULL if not given), snapped to a bucket.
+ ********************************************************************** */
+static int reply_sized(int connection, const char* img_id, const char* width, const char* height)
+{
+    const uint32_t bucket = size_bucket(&size_buckets,
+                                        width == NULL ? 0 : atouint32(width),
+                                        height == NULL ? 0 : atouint32(height));
+    const uint32_t box[2] = { size_buckets.width[bucket], size_buckets.height[bucket] };
+
+    char derived_id[MAX_IMG_ID + 1];
+    const int stored = sized_id(img_id, box[0], box[1], derived_id) == ERR_NONE;
+    return reply_derived(connection, img_id, stored ? derived_id : NULL, box[0], box[1], encode_sized, box);
 }
 
 /**
@@ -263,14 +999,19 @@ int handle_insert_call(struct http_message* msg, int connection)
     }
     memcpy(image_buffer, msg->body.val, msg->body.len);
 
-    pthread_mutex_lock(&imgfs_mutex);
+    pthread_rwlock_wrlock(&imgfs_lock);
     int result = do_insert(image_buffer, msg->body.len, img_name, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex);
+    const uint64_t position = wal_position(&fs_file);
+    pthread_rwlock_unlock(&imgfs_lock);
     free(image_buffer);
+    // in WAL mode, reply once the insertion is durable, syncing it together
+    // with those that came meanwhile
+    if (result == ERR_NONE) result = wal_sync(&fs_file, position);
     if (result != ERR_NONE) {
         return reply_error_msg(connection, result);
     }
 
+    variant_queue_push(img_name);
     return reply_302_msg(connection);
 }
 
@@ -294,9 +1035,11 @@ int handle_delete_call(const struct http_message* msg, int connection)
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
 
-    pthread_mutex_lock(&imgfs_mutex);
+    pthread_rwlock_wrlock(&imgfs_lock);
     int result = do_delete(img_id, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex);
+    const uint64_t position = wal_position(&fs_file);
+    pthread_rwlock_unlock(&imgfs_lock);
+    if (result == ERR_NONE) result = wal_sync(&fs_file, position);
     if (result != ERR_NONE) {
         return reply_error_msg(connection, result);
     }
@@ -304,3 +1047,65 @@ int handle_delete_call(const struct http_message* msg, int connection)
     return reply_302_msg(connection);
 }
 
+
+/**
+ * @brief Handles the 'grow' API call, enlarging the metadata table of the file system.
+ *
+ * Retrieves the new number of slots from the URI and grows the file system to it.
+ * As this moves blobs, it waits for the replies still being served from them.
+ *
+ * @param msg The HTTP message containing the request.
+ * @param connection The socket connection to send the response to.
+ * @return The status of the HTTP response.
+ */
+static int handle_grow_call(const struct http_message* msg, int connection)
+{
+    char max_files[16];
+    int max_files_len = http_get_var(&msg->uri, "max_files", max_files, sizeof(max_files));
+    if (max_files_len <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    const uint32_t new_max_files = atouint32(max_files);
+    if (new_max_files == 0) {
+        return reply_error_msg(connection, ERR_MAX_FILES);
+    }
+
+    block_readers();
+    pthread_rwlock_wrlock(&imgfs_lock);
+    int result = do_grow(new_max_files, &fs_file);
+    admit_readers();
+    pthread_rwlock_unlock(&imgfs_lock);
+    if (result != ERR_NONE) {
+        return reply_error_msg(connection, result);
+    }
+
+    return reply_302_msg(connection);
+}
+
+/**
+ * @brief Handles the 'stats' API call, sending the state of the background work in JSON format.
+ *
+ * Gives the number of variant workers, and of images waiting for them, which stays well
+ * under the capacity of the queue unless inserts come faster than the workers compute.
+ *
+ * @param connection The socket connection to send the response to.
+ * @return The status of the HTTP response.
+ */
+static int handle_stats_call(int connection)
+{
+    pthread_mutex_lock(&variant_lock);
+    const unsigned int workers = variant_workers;
+    const size_t pending = variant_count;
+    const uint64_t dropped = variants_dropped;
+    pthread_mutex_unlock(&variant_lock);
+
+    char body[256];
+    snprintf(body, sizeof(body),
+             "{\"variant_workers\": %u, \"variant_queue\": %zu, \"variant_queue_capacity\": %d, "
+             "\"variant_queue_dropped\": %" PRIu64 "}",
+             workers, pending, VARIANT_QUEUE_CAPACITY, dropped);
+
+    return http_reply(connection, "200 OK", "Content-Type: application/json" HTTP_LINE_DELIM,
+                      body, strlen(body));
+}
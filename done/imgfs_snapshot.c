@@ -0,0 +1,397 @@
+/**
+ * @file imgfs_snapshot.c
+ * @brief Immutable copies of the metadata, for readers that take no lock
+ *        (see imgfs_snapshot.h).
+ *
+ * The table is an open-addressing one, with linear probing, whose
+ * buckets are atomic pointers to the entries. Writers are serialized by
+ * the caller: they alone change the table, bucket by bucket. A removed
+ * entry leaves a tombstone behind, so that the probes of the readers go
+ * on past it; the table is replaced by a larger one (sharing the same
+ * entries) before the buckets in use, tombstones included, fill three
+ * quarters of it.
+ */
+
+#include "imgfs_snapshot.h"
+#include "imgfs_index.h" // for INDEX_NO_SLOT
+#include "imgfs_rcu.h"
+#include "imgfs_state.h"
+#include "util.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_MIN_CAPACITY 64
+
+/**
+ * @struct snapshot_entry
+ * @brief What a reader needs of the metadata of an image. Never changed once published.
+ */
+struct snapshot_entry {
+    char img_id[MAX_IMG_ID + 1];
+    uint32_t hash;
+    uint32_t slot;
+    uint64_t offset[NB_RES];
+    uint32_t size[NB_RES];
+};
+
+struct snapshot_table {
+    size_t capacity; // a power of two
+    size_t filled;   // buckets that are not empty (tombstones included), for writers only
+    size_t live;     // entries, for writers only
+    _Atomic(const struct snapshot_entry*) buckets[];
+};
+
+struct snapshot_list {
+    uint64_t version; // of the snapshot it was made at
+    char json[];
+};
+
+struct imgfs_snapshot {
+    _Atomic(struct snapshot_table*) table; // NULL until built, or once dropped
+    _Atomic(const char*) map;
+    atomic_size_t map_size;
+    atomic_uint_fast64_t version;          // moved on by every update
+    _Atomic(struct snapshot_list*) list;
+};
+
+// left in the bucket of a removed entry
+static const struct snapshot_entry tombstone;
+
+/*******************************************************************
+ * FNV-1a hash of an image ID.
+ */
+static uint32_t hash_id(const char* img_id)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*******************************************************************
+ * Smallest capacity keeping count entries under half of the buckets.
+ */
+static size_t capacity_for(size_t count)
+{
+    size_t capacity = SNAPSHOT_MIN_CAPACITY;
+    while (capacity < 2 * count) capacity *= 2;
+    return capacity;
+}
+
+static struct snapshot_table* table_new(size_t capacity)
+{
+    struct snapshot_table* table = malloc(sizeof(struct snapshot_table)
+                                          + capacity * sizeof(table->buckets[0]));
+    if (table == NULL) return NULL;
+    table->capacity = capacity;
+    table->filled = 0;
+    table->live = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&table->buckets[i], NULL);
+    }
+    return table;
+}
+
+static void free_entry(void* entry)
+{
+    free(entry);
+}
+
+/*******************************************************************
+ * Frees an entry once no reader may see it any more.
+ */
+static void retire_entry(const struct snapshot_entry* entry)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    rcu_retire((struct snapshot_entry*) entry, free_entry);
+#pragma GCC diagnostic pop
+}
+
+/*******************************************************************
+ * Frees a table replaced by a larger one: the entries are still in use.
+ */
+static void free_table(void* table)
+{
+    free(table);
+}
+
+/*******************************************************************
+ * Frees a table and its entries.
+ */
+static void free_table_entries(void* arg)
+{
+    struct snapshot_table* table = arg;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        const struct snapshot_entry* entry = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        if (entry != NULL && entry != &tombstone) free((struct snapshot_entry*) entry);
+#pragma GCC diagnostic pop
+    }
+    free(table);
+}
+
+static void free_list(void* list)
+{
+    free(list);
+}
+
+/*******************************************************************
+ * Finds the bucket of an image, of a given slot unless slot is
+ * INDEX_NO_SLOT, and the entry it held. Returns the capacity of the
+ * table if none.
+ */
+static size_t table_find(const struct snapshot_table* table, const char* img_id, uint32_t hash,
+                         uint32_t slot, const struct snapshot_entry** found)
+{
+    const size_t mask = table->capacity - 1;
+    for (size_t n = 0, i = hash & mask; n < table->capacity; ++n, i = (i + 1) & mask) {
+        const struct snapshot_entry* entry = atomic_load_explicit(&table->buckets[i], memory_order_acquire);
+        if (entry == NULL) break;
+        if (entry != &tombstone && entry->hash == hash && (slot == INDEX_NO_SLOT || entry->slot == slot)
+            && strncmp(entry->img_id, img_id, MAX_IMG_ID) == 0) {
+            *found = entry;
+            return i;
+        }
+    }
+    *found = NULL;
+    return table->capacity;
+}
+
+/*******************************************************************
+ * Publishes an entry in the first free bucket of its probe. Writers only.
+ */
+static void table_place(struct snapshot_table* table, const struct snapshot_entry* entry)
+{
+    const size_t mask = table->capacity - 1;
+    size_t i = entry->hash & mask;
+    const struct snapshot_entry* there = NULL;
+    while ((there = atomic_load_explicit(&table->buckets[i], memory_order_relaxed)) != NULL
+           && there != &tombstone) {
+        i = (i + 1) & mask;
+    }
+    if (there == NULL) table->filled++;
+    table->live++;
+    atomic_store_explicit(&table->buckets[i], entry, memory_order_release);
+}
+
+/*******************************************************************
+ * A new entry, for a valid slot.
+ */
+static struct snapshot_entry* entry_new(const struct img_metadata* metadata, uint32_t slot, uint32_t hash)
+{
+    struct snapshot_entry* entry = calloc(1, sizeof(struct snapshot_entry));
+    if (entry == NULL) return NULL;
+    strncpy(entry->img_id, metadata->img_id, MAX_IMG_ID);
+    entry->hash = hash;
+    entry->slot = slot;
+    memcpy(entry->offset, metadata->offset, sizeof(entry->offset));
+    memcpy(entry->size, metadata->size, sizeof(entry->size));
+    return entry;
+}
+
+/*******************************************************************
+ * Drops the table, which no longer matches the metadata.
+ */
+static void drop_table(struct imgfs_snapshot* snapshot)
+{
+    struct snapshot_table* table = atomic_exchange(&snapshot->table, NULL);
+    if (table != NULL) rcu_retire(table, free_table_entries);
+}
+
+/*******************************************************************/
+struct imgfs_snapshot* snapshot_of(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_state* state = state_of(imgfs_file);
+    return state == NULL ? NULL : state->snapshot;
+}
+
+/*******************************************************************/
+int snapshot_build(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    struct imgfs_snapshot* snapshot = snapshot_of(imgfs_file);
+    if (snapshot == NULL) return ERR_INVALID_ARGUMENT;
+    if (atomic_load(&snapshot->table) != NULL) return ERR_NONE;
+
+    struct snapshot_table* table = table_new(capacity_for(imgfs_file->header.nb_files));
+    if (table == NULL) return ERR_OUT_OF_MEMORY;
+
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files && seen < imgfs_file->header.nb_files; ++i) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+        ++seen;
+
+        struct snapshot_entry* entry = entry_new(metadata, i, hash_id(metadata->img_id));
+        if (entry == NULL) {
+            free_table_entries(table);
+            return ERR_OUT_OF_MEMORY;
+        }
+        table_place(table, entry);
+    }
+
+    atomic_store(&snapshot->table, table);
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+void snapshot_update(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    struct imgfs_snapshot* snapshot = snapshot_of(imgfs_file);
+    if (snapshot == NULL) return;
+    atomic_fetch_add(&snapshot->version, 1);
+
+    struct snapshot_table* table = atomic_load(&snapshot->table);
+    if (table == NULL) return;
+
+    // the entry of the slot is found by the ID the slot has, or had until deleted
+    const struct img_metadata* metadata = &imgfs_file->metadata[slot];
+    const uint32_t hash = hash_id(metadata->img_id);
+    const struct snapshot_entry* former = NULL;
+    const size_t bucket = table_find(table, metadata->img_id, hash, slot, &former);
+
+    if (metadata->is_valid != NON_EMPTY) {
+        if (former != NULL) {
+            atomic_store_explicit(&table->buckets[bucket], &tombstone, memory_order_release);
+            table->live--;
+            retire_entry(former);
+        }
+        return;
+    }
+
+    struct snapshot_entry* entry = entry_new(metadata, slot, hash);
+    if (entry == NULL) {
+        drop_table(snapshot);
+        return;
+    }
+
+    if (former != NULL) {
+        atomic_store_explicit(&table->buckets[bucket], entry, memory_order_release);
+        retire_entry(former);
+        return;
+    }
+
+    if (table->filled + 1 > table->capacity / 4 * 3) {
+        // move the entries to a larger table, dropping the tombstones
+        struct snapshot_table* larger = table_new(capacity_for(table->live + 1));
+        if (larger == NULL) {
+            free(entry);
+            drop_table(snapshot);
+            return;
+        }
+        for (size_t i = 0; i < table->capacity; ++i) {
+            const struct snapshot_entry* kept = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+            if (kept != NULL && kept != &tombstone) table_place(larger, kept);
+        }
+        atomic_store(&snapshot->table, larger);
+        rcu_retire(table, free_table);
+        table = larger;
+    }
+    table_place(table, entry);
+}
+
+/*******************************************************************/
+int snapshot_set_map(const struct imgfs_file* imgfs_file, const void* map, size_t map_size)
+{
+    M_REQUIRE_NON_NULL(map);
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+
+    if (state->snapshot == NULL) {
+        struct imgfs_snapshot* snapshot = malloc(sizeof(struct imgfs_snapshot));
+        if (snapshot == NULL) return ERR_OUT_OF_MEMORY;
+        atomic_init(&snapshot->table, NULL);
+        atomic_init(&snapshot->map, NULL);
+        atomic_init(&snapshot->map_size, 0);
+        atomic_init(&snapshot->version, 0);
+        atomic_init(&snapshot->list, NULL);
+        state->snapshot = snapshot;
+    }
+
+    // readers load the size first: they may get a larger view than the size, never a smaller one
+    atomic_store(&state->snapshot->map, map);
+    atomic_store(&state->snapshot->map_size, map_size);
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+int snapshot_read_view(const struct imgfs_snapshot* snapshot, const char* img_id, int resolution,
+                       const char** image_buffer, uint32_t* image_size, int* done)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(done);
+
+    *done = 0;
+    if (snapshot == NULL) return ERR_NONE;
+    const struct snapshot_table* table = atomic_load(&snapshot->table);
+    if (table == NULL) return ERR_NONE;
+
+    *done = 1;
+    if (resolution < 0 || resolution >= NB_RES) return ERR_RESOLUTIONS;
+    const struct snapshot_entry* entry = NULL;
+    (void) table_find(table, img_id, hash_id(img_id), INDEX_NO_SLOT, &entry);
+    if (entry == NULL) return ERR_IMAGE_NOT_FOUND;
+
+    // a variant still to be computed, or past the view, needs the metadata
+    *done = 0;
+    if (entry->size[resolution] == 0) return ERR_NONE;
+    const size_t map_size = atomic_load(&snapshot->map_size);
+    const char* map = atomic_load(&snapshot->map);
+    if (entry->offset[resolution] + entry->size[resolution] > map_size) return ERR_NONE;
+
+    *done = 1;
+    *image_buffer = map + entry->offset[resolution];
+    *image_size = entry->size[resolution];
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+const char* snapshot_list(const struct imgfs_snapshot* snapshot)
+{
+    if (snapshot == NULL) return NULL;
+    const struct snapshot_list* list = atomic_load(&snapshot->list);
+    if (list == NULL || list->version != atomic_load(&snapshot->version)) return NULL;
+    return list->json;
+}
+
+/*******************************************************************/
+int snapshot_set_list(const struct imgfs_file* imgfs_file, const char* json)
+{
+    M_REQUIRE_NON_NULL(json);
+    struct imgfs_snapshot* snapshot = snapshot_of(imgfs_file);
+    if (snapshot == NULL) return ERR_INVALID_ARGUMENT;
+
+    const size_t length = strlen(json);
+    struct snapshot_list* list = malloc(sizeof(struct snapshot_list) + length + 1);
+    if (list == NULL) return ERR_OUT_OF_MEMORY;
+    list->version = atomic_load(&snapshot->version);
+    memcpy(list->json, json, length + 1);
+
+    struct snapshot_list* former = atomic_exchange(&snapshot->list, list);
+    if (former != NULL) rcu_retire(former, free_list);
+    return ERR_NONE;
+}
+
+/*******************************************************************/
+void snapshot_free(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->snapshot == NULL) return;
+    struct imgfs_snapshot* snapshot = state->snapshot;
+    state->snapshot = NULL;
+
+    rcu_barrier(); // the readers still in the snapshot, and what they may see
+    struct snapshot_table* table = atomic_load(&snapshot->table);
+    if (table != NULL) free_table_entries(table);
+    free(atomic_load(&snapshot->list));
+    free(snapshot);
+}
@@ -0,0 +1,122 @@
+/**
+ * @file imgfs_snapshot.h
+ * @brief Immutable copies of the metadata, for readers that take no lock.
+ *
+ * The snapshot of a mapped imgFS is a hash table from image ID to an
+ * immutable entry: the slot, offsets and sizes of the image. A change
+ * of a slot (insertion, deletion, new variant, blob moved) publishes a
+ * new entry in place of the former one with a single atomic store, and
+ * retires the former one through imgfs_rcu.h. A reader inside a read
+ * section (rcu_read_enter()) thus always finds a complete entry, either
+ * the former or the new one, without waiting for the writer.
+ *
+ * The table is filled from the metadata by snapshot_build(), which the
+ * lookups never do themselves, then kept up to date by the library.
+ * Should an update fail, the table is dropped until built again; the
+ * lookups then report that they could not answer.
+ *
+ * The snapshot also holds the view of the file (see map_view()) and the
+ * latest JSON listing of the images, with the version it was made at.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_snapshot; // the published state, see imgfs_snapshot.c
+
+/**
+ * @brief Gives the snapshot of an open imgFS, for later lookups without lock.
+ *        It stays valid until do_close().
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Its snapshot, or NULL if it is not mapped.
+ */
+struct imgfs_snapshot* snapshot_of(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Fills the table from the metadata, unless already done.
+ *        The caller excludes every other change of the imgFS meanwhile.
+ *
+ * @param imgfs_file The main in-memory structure, with its metadata loaded (or mapped).
+ * @return Some error code. 0 if no error.
+ */
+int snapshot_build(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Publishes the current state of a slot that just changed: its
+ *        new entry, or none if the slot is no longer valid.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param slot The metadata slot.
+ */
+void snapshot_update(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Publishes the view of the file, when mapped or moved by map_view().
+ *        The first call creates the (empty) snapshot of the imgFS.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param map The view of the file.
+ * @param map_size The length of the address range of the view.
+ * @return Some error code. 0 if no error.
+ */
+int snapshot_set_map(const struct imgfs_file* imgfs_file, const void* map, size_t map_size);
+
+/**
+ * @brief Like do_read_view_shared(), from the snapshot alone: takes no
+ *        lock, and never waits for a writer.
+ *
+ * Must be called within a read section, until the end of which the view
+ * stays valid. *done is 0 when the snapshot cannot answer (table not
+ * built, variant to compute, view past the current mapping, ...): the
+ * read must then go through the metadata.
+ *
+ * @param snapshot The snapshot of the imgFS.
+ * @param img_id The ID of the image.
+ * @param resolution The resolution of the variant.
+ * @param image_buffer Where to put the view of the variant.
+ * @param image_size Where to put its size.
+ * @param done Where to put whether the read was answered.
+ * @return Some error code. 0 if no error.
+ */
+int snapshot_read_view(const struct imgfs_snapshot* snapshot, const char* img_id, int resolution,
+                       const char** image_buffer, uint32_t* image_size, int* done);
+
+/**
+ * @brief Gives the JSON listing of the images, if the one published is
+ *        still current. Must be called within a read section, until the
+ *        end of which it stays valid.
+ *
+ * @param snapshot The snapshot of the imgFS.
+ * @return The listing (as do_list() in JSON mode), NULL if none is current.
+ */
+const char* snapshot_list(const struct imgfs_snapshot* snapshot);
+
+/**
+ * @brief Publishes the JSON listing of the current images.
+ *        The caller excludes every change of the imgFS meanwhile.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param json The listing made by do_list().
+ * @return Some error code. 0 if no error.
+ */
+int snapshot_set_list(const struct imgfs_file* imgfs_file, const char* json);
+
+/**
+ * @brief Releases the snapshot (if any), once its readers are gone.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void snapshot_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
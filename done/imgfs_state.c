@@ -0,0 +1,103 @@
+/**
+ * @file imgfs_state.c
+ * @brief Run-time state attached to an open imgFS (see imgfs_state.h).
+ *
+ * The states are found through a short list keyed by FILE*: a process
+ * only ever has a handful of imgFS open, and every lookup of every
+ * reader goes through state_of(). The entries of the list are never
+ * freed, only reused once their imgFS is closed, so that lookups walk
+ * it without any lock; only attaching and detaching are serialized. A
+ * detached state is retired through RCU, since a reader may still hold it.
+ */
+
+#include "imgfs_state.h"
+#include "imgfs_rcu.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>   // for calloc, free
+#include <string.h>   // for memset
+
+struct state_entry {
+    _Atomic(FILE*) file;                // NULL while the entry is free
+    _Atomic(struct imgfs_state*) state;
+    struct state_entry* next;           // set before the entry is published
+};
+
+static _Atomic(struct state_entry*) entries = NULL;
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************
+ * The entry in use for file, NULL if none.
+ */
+static struct state_entry* find_entry(const FILE* file)
+{
+    struct state_entry* entry = atomic_load_explicit(&entries, memory_order_acquire);
+    while (entry != NULL && atomic_load_explicit(&entry->file, memory_order_acquire) != file) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+int state_attach(struct imgfs_file* imgfs_file, struct imgfs_state** state)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(state);
+
+    // a FILE* closed without do_close() may have been reused by fopen():
+    // what was left behind for it is released first
+    struct imgfs_file stale;
+    zero_init_var(stale);
+    stale.file = imgfs_file->file;
+    if (state_of(&stale) != NULL) state_teardown(&stale);
+
+    struct imgfs_state* fresh = calloc(1, sizeof(struct imgfs_state));
+    if (fresh == NULL) return ERR_OUT_OF_MEMORY;
+    fresh->file = imgfs_file->file;
+
+    pthread_mutex_lock(&entries_lock);
+    struct state_entry* entry = find_entry(NULL);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct state_entry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&entries_lock);
+            free(fresh);
+            return ERR_OUT_OF_MEMORY;
+        }
+        entry->next = atomic_load(&entries);
+        atomic_store_explicit(&entries, entry, memory_order_release);
+    }
+    // the state first: whoever finds the file finds its state
+    atomic_store_explicit(&entry->state, fresh, memory_order_relaxed);
+    atomic_store_explicit(&entry->file, imgfs_file->file, memory_order_release);
+    pthread_mutex_unlock(&entries_lock);
+
+    *state = fresh;
+    return ERR_NONE;
+}
+
+struct imgfs_state* state_of(const struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->file == NULL) return NULL;
+
+    const struct state_entry* entry = find_entry(imgfs_file->file);
+    return entry == NULL ? NULL : atomic_load_explicit(&entry->state, memory_order_relaxed);
+}
+
+void state_detach(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->file == NULL) return;
+
+    struct imgfs_state* state = NULL;
+    pthread_mutex_lock(&entries_lock);
+    struct state_entry* entry = find_entry(imgfs_file->file);
+    if (entry != NULL) {
+        state = atomic_load_explicit(&entry->state, memory_order_relaxed);
+        atomic_store_explicit(&entry->file, NULL, memory_order_release);
+        atomic_store_explicit(&entry->state, NULL, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&entries_lock);
+    rcu_retire(state, free);
+}
@@ -0,0 +1,144 @@
+/**
+ * @file imgfs_state.h
+ * @brief Run-time state attached to an open imgFS.
+ *
+ * struct imgfs_file only holds what the course defines (file, header,
+ * metadata). Everything the library additionally keeps while a file is
+ * open (lookup index, mappings, ...) lives in a struct imgfs_state,
+ * found from the FILE* of the imgfs_file. An imgfs_file that was not
+ * opened through do_open() or do_create() simply has no state, and the
+ * library then falls back to plain scans of the metadata.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_index; // in-memory lookup structures, see imgfs_index.h
+struct imgfs_alloc; // free extents, see imgfs_alloc.h
+struct imgfs_refs;  // blobs by content, see imgfs_refs.h
+struct imgfs_wal;   // write-ahead log, see imgfs_wal.h
+struct imgfs_durability; // sync policy, see imgfs_durability.h
+struct imgfs_snapshot; // metadata published for readers without lock, see imgfs_snapshot.h
+
+/**
+ * @struct retired_map
+ * @brief A view of the file replaced by a larger one, kept until the
+ *        imgFS is closed, as pointers into it may still be in use.
+ */
+struct retired_map {
+    void* map;
+    size_t size;
+    struct retired_map* next;
+};
+
+/**
+ * @struct imgfs_state
+ * @brief What the library keeps about an open imgFS, besides struct imgfs_file.
+ *
+ * @param file     The FILE* of the imgfs_file this state belongs to.
+ * @param index    In-memory index over the metadata, NULL if none.
+ * @param alloc    Free extents of the content area, NULL until first needed.
+ * @param refs     Reference-counted blobs, by content, NULL until first needed.
+ * @param wal      Write-ahead log of the metadata changes, NULL when not in WAL mode.
+ * @param durability When changes are synced, NULL for DURABILITY_NONE.
+ * @param snapshot Entries of the images for readers without lock, NULL unless mapped.
+ * @param map      Read-only view of the whole file when opened with do_open_mapped()
+ *                 or do_open_lazy(), NULL otherwise. The metadata then point into a
+ *                 mapping of the file instead of a copy.
+ * @param map_size Length of the address range reserved for map.
+ * @param meta     Mapping of the header and metadata of a mapped imgFS, NULL otherwise.
+ * @param meta_size Its length.
+ * @param retired  Views replaced by map, see struct retired_map.
+ * @param gc_from  Offset up to which do_gbcollect_step() has compacted the
+ *                 blobs in the current pass, 0 when no pass is running.
+ * @param gc_to    Where do_gbcollect_step() puts the next blob it moves.
+ */
+struct imgfs_state {
+    FILE* file;
+    struct imgfs_index* index;
+    struct imgfs_alloc* alloc;
+    struct imgfs_refs* refs;
+    struct imgfs_wal* wal;
+    struct imgfs_durability* durability;
+    struct imgfs_snapshot* snapshot;
+    void* map;
+    size_t map_size;
+    void* meta;
+    size_t meta_size;
+    struct retired_map* retired;
+    uint64_t gc_from;
+    uint64_t gc_to;
+};
+
+/**
+ * @brief Creates the (empty) state of a freshly opened imgFS.
+ *
+ * Any state left behind for the same FILE* (closed without do_close())
+ * is released first, with state_teardown().
+ *
+ * @param imgfs_file The main in-memory structure, with its file open.
+ * @param state Where to put the new state.
+ * @return Some error code. 0 if no error.
+ */
+int state_attach(struct imgfs_file* imgfs_file, struct imgfs_state** state);
+
+/**
+ * @brief Finds the state of an open imgFS. A caller that does not exclude
+ *        do_close() (by the lock of the store) must be within a read
+ *        section (see imgfs_rcu.h) for as long as it uses the state.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Its state, or NULL if it has none.
+ */
+struct imgfs_state* state_of(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Releases everything the library keeps about an open imgFS (sync
+ *        policy, log, index, mappings, ...), then its state. The metadata
+ *        are no longer usable afterwards, but the file stays open.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void state_teardown(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Forgets the state of an imgFS, once its index and mappings are
+ *        released. The state itself is freed once no reader may still
+ *        have found it.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void state_detach(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Follows a change of header.max_files in the in-memory metadata
+ *        (copy or mapping, depending on how the imgFS was opened).
+ *
+ * The metadata region of the file must already have its new size.
+ *
+ * @param imgfs_file The main in-memory structure, with its new header.
+ * @param old_max_files The number of slots the metadata had so far.
+ * @return Some error code. 0 if no error.
+ */
+int state_resize_metadata(struct imgfs_file* imgfs_file, uint32_t old_max_files);
+
+/**
+ * @brief Makes the in-memory changes of the metadata of a mapped imgFS
+ *        stay in memory, until written explicitly (as with the copy made
+ *        by do_open()). Does nothing for an imgFS that is not mapped.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code. 0 if no error.
+ */
+int state_private_metadata(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
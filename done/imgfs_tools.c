@@ -6,6 +6,14 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_refs.h"
+#include "imgfs_snapshot.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
+#include "imgfs_durability.h"
+#include "imgfs_wal.h"
 #include "util.h"
 
 #include <inttypes.h>      // for PRIxN macros
@@ -14,6 +22,8 @@
 #include <stdio.h>         // for sprintf
 #include <stdlib.h>        // for calloc
 #include <string.h>        // for strcmp
+#include <sys/mman.h>      // for mmap
+#include <sys/stat.h>      // for fstat
 
 /*******************************************************************
  * Human-readable SHA
@@ -68,48 +78,297 @@ ORIGINAL: %" PRIu32 " x %" PRIu32 "\n",
 }
 
 
-int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+/*******************************************************************
+ * Size of the address range reserved for the read-only view of a
+ * mapped imgFS. Reserving (much) more than the file size lets blobs
+ * appended later show up in the view without ever remapping it.
+ */
+#define MAP_RESERVE (sizeof(size_t) >= 8 ? (size_t) 1 << 36 : (size_t) 1 << 28)
+
+static size_t metadata_region_size(const struct imgfs_header* header)
+{
+    return sizeof(struct imgfs_header) + (size_t) header->max_files * sizeof(struct img_metadata);
+}
+
+/*******************************************************************
+ * Releases the mappings (if any) of a mapped imgFS.
+ */
+static void unmap_file(struct imgfs_file* imgfs_file, struct imgfs_state* state)
+{
+    if (state->map == NULL) return;
+
+    if (state->meta != NULL) {
+        munmap(state->meta, state->meta_size);
+        state->meta = NULL;
+        state->meta_size = 0;
+        imgfs_file->metadata = NULL;
+    }
+    munmap(state->map, state->map_size);
+    state->map = NULL;
+    state->map_size = 0;
+    while (state->retired != NULL) {
+        struct retired_map* retired = state->retired;
+        state->retired = retired->next;
+        munmap(retired->map, retired->size);
+        free(retired);
+    }
+}
+
+/*******************************************************************
+ * Maps the header and metadata region, and reserves the read-only view
+ * of the whole file. Read-only stores get a private (copy-on-write)
+ * metadata mapping, so that in-memory changes never reach the disk,
+ * exactly as with the calloc'ed copy of do_open().
+ */
+static int map_file(struct imgfs_file* imgfs_file, struct imgfs_state* state, int writable)
+{
+    const int fd = fileno(imgfs_file->file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) return ERR_IO;
+
+    const size_t region = metadata_region_size(&imgfs_file->header);
+    if ((uint64_t) st.st_size < region) return ERR_IO;
+
+    void* meta = mmap(NULL, region, PROT_READ | PROT_WRITE,
+                      writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (meta == MAP_FAILED) return ERR_IO;
+
+    const size_t reserve = MAX((size_t) st.st_size, MAP_RESERVE);
+    void* view = mmap(NULL, reserve, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (view == MAP_FAILED) {
+        munmap(meta, region);
+        return ERR_IO;
+    }
+
+    imgfs_file->metadata = (struct img_metadata*) (void*) ((char*) meta + sizeof(struct imgfs_header));
+    state->meta = meta;
+    state->meta_size = region;
+    state->map = view;
+    state->map_size = reserve;
+    return snapshot_set_map(imgfs_file, view, reserve);
+}
+
+/*******************************************************************
+ * Follows a change of header.max_files: enlarges the in-memory copy of
+ * the metadata, or maps the larger metadata region of the file.
+ */
+int state_resize_metadata(struct imgfs_file* imgfs_file, uint32_t old_max_files)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    const uint32_t max_files = imgfs_file->header.max_files;
+    if (max_files < old_max_files) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->map == NULL) {
+        struct img_metadata* larger = realloc(imgfs_file->metadata, max_files * sizeof(struct img_metadata));
+        if (larger == NULL) return ERR_OUT_OF_MEMORY;
+        memset(larger + old_max_files, 0, (max_files - old_max_files) * sizeof(struct img_metadata));
+        imgfs_file->metadata = larger;
+        return ERR_NONE;
+    }
+
+    // only writable files can grow: their metadata mapping is a shared one, unless in WAL mode
+    const size_t region = metadata_region_size(&imgfs_file->header);
+    void* meta = mmap(NULL, region, PROT_READ | PROT_WRITE,
+                      state->wal != NULL ? MAP_PRIVATE : MAP_SHARED, fileno(imgfs_file->file), 0);
+    if (meta == MAP_FAILED) return ERR_IO;
+
+    munmap(state->meta, state->meta_size);
+    imgfs_file->metadata = (struct img_metadata*) (void*) ((char*) meta + sizeof(struct imgfs_header));
+    state->meta = meta;
+    state->meta_size = region;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Swaps the shared metadata mapping of a writable imgFS for a private
+ * one of the same pages: in-memory changes then no longer reach the file.
+ */
+int state_private_metadata(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->map == NULL) return ERR_NONE;
+
+    const size_t region = metadata_region_size(&imgfs_file->header);
+    void* meta = mmap(NULL, region, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(imgfs_file->file), 0);
+    if (meta == MAP_FAILED) return ERR_IO;
+
+    munmap(state->meta, state->meta_size);
+    imgfs_file->metadata = (struct img_metadata*) (void*) ((char*) meta + sizeof(struct imgfs_header));
+    state->meta = meta;
+    state->meta_size = region;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * How do_open() and its variants load the metadata.
+ */
+enum open_kind {
+    OPEN_COPY,    // read into memory, index built right away
+    OPEN_MAPPED,  // mapped, index built right away
+    OPEN_LAZY     // mapped, index built as lookups go
+};
+
+/*******************************************************************
+ * Common part of do_open(), do_open_mapped() and do_open_lazy().
+ */
+static int open_file(const char* imgfs_filename, const char* open_mode,
+                     struct imgfs_file* imgfs_file, enum open_kind kind)
 {
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(open_mode);
     M_REQUIRE_NON_NULL(imgfs_file);
 
+    imgfs_file->metadata = NULL;
+
     imgfs_file->file = fopen(imgfs_filename, open_mode);
     if (imgfs_file->file == NULL) {
         return ERR_IO;
     }
 
-    if (fread(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+    // The library reads and writes at explicit offsets (see imgfs_io.h):
+    // no stdio buffer, so that nothing stale may wait there to overwrite
+    // what is written through the descriptor or the mapping.
+    if (setvbuf(imgfs_file->file, NULL, _IONBF, 0) != 0) {
         fclose(imgfs_file->file);
         imgfs_file->file = NULL;
         return ERR_IO;
     }
 
-    imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
-    if (imgfs_file->metadata == NULL) {
+    // files of a later format may not be readable as such
+    if (io_read_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE
+        || imgfs_file->header.unused_32 > IMGFS_FORMAT_LATEST) {
         fclose(imgfs_file->file);
         imgfs_file->file = NULL;
-        return ERR_OUT_OF_MEMORY;
+        return ERR_IO;
     }
 
-    if (fread(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, imgfs_file->file) != imgfs_file->header.max_files) {
-        free(imgfs_file->metadata);
+    struct imgfs_state* state = NULL;
+    int err = state_attach(imgfs_file, &state);
+    if (err != ERR_NONE) {
         fclose(imgfs_file->file);
         imgfs_file->file = NULL;
-        imgfs_file->metadata = NULL;
-        return ERR_IO;
+        return err;
+    }
+
+    const int writable = open_mode[0] != 'r' || strchr(open_mode, '+') != NULL;
+    if (kind != OPEN_COPY) {
+        err = map_file(imgfs_file, state, writable);
+    } else {
+        imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
+        if (imgfs_file->metadata == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            err = io_read_at(imgfs_file->file, imgfs_file->metadata,
+                             imgfs_file->header.max_files * sizeof(struct img_metadata),
+                             sizeof(struct imgfs_header));
+        }
+    }
+
+    // after a crash, the log holds changes the metadata do not have yet
+    int replayed = 0;
+    if (err == ERR_NONE) {
+        err = wal_replay(imgfs_file, imgfs_filename, writable, &replayed);
+    }
+    // a lazy index looks up the on-disk one, which a log makes unreliable
+    if (err == ERR_NONE) {
+        err = index_build(imgfs_file, kind == OPEN_LAZY && !replayed);
+    }
+
+    if (err != ERR_NONE) {
+        do_close(imgfs_file);
+        return err;
     }
 
     return ERR_NONE;
 }
 
+int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+{
+    return open_file(imgfs_filename, open_mode, imgfs_file, OPEN_COPY);
+}
 
+int do_open_mapped(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+{
+    return open_file(imgfs_filename, open_mode, imgfs_file, OPEN_MAPPED);
+}
+
+int do_open_lazy(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+{
+    return open_file(imgfs_filename, open_mode, imgfs_file, OPEN_LAZY);
+}
+
+int map_view_shared(const struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size, const char** view)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(view);
+    const struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->map == NULL) return ERR_INVALID_ARGUMENT;
+
+    // touching the view past the end of the file would raise SIGBUS
+    uint64_t file_size = 0;
+    if (io_size(imgfs_file->file, &file_size) != ERR_NONE) return ERR_IO;
+    if (offset + size > file_size) return ERR_IO;
+
+    *view = offset + size > state->map_size ? NULL : (const char*) state->map + offset;
+    return ERR_NONE;
+}
+
+int map_view(struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size, const char** view)
+{
+    int err = map_view_shared(imgfs_file, offset, size, view);
+    if (err != ERR_NONE || *view != NULL) return err;
+
+    // the file outgrew the reservation: move the view to a larger one,
+    // keeping the former one for the pointers into it still in use
+    struct imgfs_state* state = state_of(imgfs_file);
+    uint64_t file_size = 0;
+    if (io_size(imgfs_file->file, &file_size) != ERR_NONE) return ERR_IO;
+    const size_t reserve = 2 * (size_t) file_size;
+    struct retired_map* retired = malloc(sizeof(struct retired_map));
+    if (retired == NULL) return ERR_OUT_OF_MEMORY;
+    void* larger = mmap(NULL, reserve, PROT_READ, MAP_SHARED | MAP_NORESERVE,
+                        fileno(imgfs_file->file), 0);
+    if (larger == MAP_FAILED) {
+        free(retired);
+        return ERR_IO;
+    }
+    retired->map = state->map;
+    retired->size = state->map_size;
+    retired->next = state->retired;
+    state->retired = retired;
+    state->map = larger;
+    state->map_size = reserve;
+
+    *view = (const char*) state->map + offset;
+    return snapshot_set_map(imgfs_file, larger, reserve);
+}
+
+void state_teardown(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return;
+
+    durability_stop(imgfs_file); // before the log it may sync
+    wal_stop(imgfs_file);
+    index_free(imgfs_file);
+    alloc_free(imgfs_file);
+    refs_free(imgfs_file);
+    snapshot_free(imgfs_file); // before the view its readers use
+    unmap_file(imgfs_file, state);
+    state_detach(imgfs_file);
+}
 
 void do_close(struct imgfs_file* imgfs_file)
 {
     if (imgfs_file == NULL) return;
 
     if (imgfs_file->file != NULL) {
+        // the index and the mappings only exist while the file is open
+        state_teardown(imgfs_file);
         fclose(imgfs_file->file);
         imgfs_file->file = NULL;
     }
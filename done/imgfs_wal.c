@@ -0,0 +1,467 @@
+/**
+ * @file imgfs_wal.c
+ * @brief Write-ahead log of the metadata changes of an imgFS (see imgfs_wal.h).
+ *
+ * The log is a sequence of fixed-size records, each holding the whole
+ * header and one whole metadata slot, so that replaying a record is a
+ * plain copy, and replaying it twice does no harm. A record carries its
+ * position (increasing) and a checksum: replay stops at the first record
+ * torn by the crash.
+ *
+ * Records are appended to memory first. They only reach the log in
+ * wal_sync(), after the blobs they refer to were synced, so that a
+ * durable record never refers to a blob that is not.
+ */
+
+#include "imgfs.h"
+#include "imgfs_blobs.h"
+#include "imgfs_index.h"
+#include "imgfs_io.h"
+#include "imgfs_state.h"
+#include "imgfs_wal.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>     // for open
+#include <pthread.h>
+#include <stddef.h>    // for offsetof
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>    // for read, write, fdatasync, ftruncate, unlink
+
+#define WAL_SUFFIX ".wal"
+#define WAL_MAGIC 0x4c415749u                      // "IWAL"
+#define WAL_CHECKPOINT_SIZE ((uint64_t) 8 << 20)   // log size triggering a checkpoint
+
+struct wal_record {
+    uint32_t magic;
+    uint32_t slot;
+    uint64_t position;
+    struct imgfs_header header;
+    struct img_metadata metadata;
+    uint64_t checksum;  // of all the bytes before it
+};
+
+struct imgfs_wal {
+    char* path;
+    int fd;                     // the log, opened for appending
+    int file_fd;                // the imgFS, whose blobs are synced before the log
+    pthread_mutex_t lock;       // for the fields below, up to failed
+    pthread_cond_t synced;
+    struct wal_record* pending; // appended, not written to the log yet
+    size_t nb_pending;
+    size_t pending_capacity;
+    uint64_t appended;          // position of the last appended record
+    uint64_t durable;           // position up to which records are durable
+    int syncing;                // someone is writing and syncing the log
+    int failed;                 // error of the last sync, records may be missing from the log
+    // only used under the lock serializing the operations on the imgFS
+    uint64_t log_size;
+    uint32_t* dirty;            // slots logged since the last checkpoint
+    size_t nb_dirty;
+    size_t dirty_capacity;
+};
+
+/*******************************************************************
+ * FNV-1a: a torn record is all that needs detecting.
+ */
+static uint64_t checksum(const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    uint64_t hash = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3u;
+    }
+    return hash;
+}
+
+static uint64_t record_checksum(const struct wal_record* record)
+{
+    return checksum(record, offsetof(struct wal_record, checksum));
+}
+
+static char* log_path(const char* imgfs_filename)
+{
+    const size_t length = strlen(imgfs_filename);
+    char* path = malloc(length + sizeof(WAL_SUFFIX));
+    if (path == NULL) return NULL;
+    memcpy(path, imgfs_filename, length);
+    memcpy(path + length, WAL_SUFFIX, sizeof(WAL_SUFFIX));
+    return path;
+}
+
+/*******************************************************************
+ * Makes the creation or removal of a file in a directory durable.
+ */
+static int sync_directory(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    char* directory = slash == NULL ? strdup(".") : strndup(path, (size_t) (slash - path) + 1);
+    if (directory == NULL) return ERR_OUT_OF_MEMORY;
+
+    const int fd = open(directory, O_RDONLY);
+    free(directory);
+    if (fd < 0) return ERR_IO;
+    const int err = fsync(fd) == 0 ? ERR_NONE : ERR_IO;
+    close(fd);
+    return err;
+}
+
+static int write_all(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+    while (size > 0) {
+        const ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return ERR_IO;
+        bytes += written;
+        size -= (size_t) written;
+    }
+    return ERR_NONE;
+}
+
+static struct imgfs_wal* wal_of(const struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_state* state = state_of(imgfs_file);
+    return state == NULL ? NULL : state->wal;
+}
+
+static void wal_destroy(struct imgfs_wal* wal)
+{
+    if (wal == NULL) return;
+    if (wal->fd >= 0) close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->pending);
+    free(wal->dirty);
+    free(wal->path);
+    free(wal);
+}
+
+/*******************************************************************
+ * Writes the header and some slots in place, from memory. The blobs
+ * they point to are made durable first: the log records only the
+ * metadata, and once these are in place the log goes.
+ */
+static int write_in_place(struct imgfs_file* imgfs_file, const uint32_t* slots, size_t count)
+{
+    if (blobs_sync(imgfs_file->file) != ERR_NONE) return ERR_IO;
+    if (io_write_at(imgfs_file->file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+        return ERR_IO;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (io_write_at(imgfs_file->file, &imgfs_file->metadata[slots[i]], sizeof(struct img_metadata),
+                        sizeof(struct imgfs_header) + (uint64_t) slots[i] * sizeof(struct img_metadata)) != ERR_NONE) {
+            return ERR_IO;
+        }
+    }
+    return blobs_sync(imgfs_file->file);
+}
+
+static int compare_slots(const void* a, const void* b)
+{
+    const uint32_t x = *(const uint32_t*) a;
+    const uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static size_t sort_unique(uint32_t* slots, size_t count)
+{
+    qsort(slots, count, sizeof(uint32_t), compare_slots);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (unique == 0 || slots[unique - 1] != slots[i]) slots[unique++] = slots[i];
+    }
+    return unique;
+}
+
+static int add_slot(uint32_t** slots, size_t* count, size_t* capacity, uint32_t slot)
+{
+    if (*count == *capacity) {
+        const size_t larger_capacity = *capacity == 0 ? 64 : 2 * *capacity;
+        uint32_t* larger = realloc(*slots, larger_capacity * sizeof(uint32_t));
+        if (larger == NULL) return ERR_OUT_OF_MEMORY;
+        *slots = larger;
+        *capacity = larger_capacity;
+    }
+    (*slots)[(*count)++] = slot;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Public interface.
+ */
+int wal_start(struct imgfs_file* imgfs_file, const char* imgfs_filename)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL) return ERR_INVALID_ARGUMENT;
+    if (state->wal != NULL) return ERR_NONE;
+
+    // the changes must now stay in memory until they are checkpointed
+    int err = state_private_metadata(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_wal* wal = calloc(1, sizeof(struct imgfs_wal));
+    if (wal == NULL) return ERR_OUT_OF_MEMORY;
+    wal->fd = -1;
+    wal->file_fd = fileno(imgfs_file->file);
+    if (pthread_mutex_init(&wal->lock, NULL) != 0) {
+        free(wal);
+        return ERR_THREADING;
+    }
+    if (pthread_cond_init(&wal->synced, NULL) != 0) {
+        pthread_mutex_destroy(&wal->lock);
+        free(wal);
+        return ERR_THREADING;
+    }
+
+    wal->path = log_path(imgfs_filename);
+    if (wal->path == NULL) err = ERR_OUT_OF_MEMORY;
+    if (err == ERR_NONE) {
+        wal->fd = open(wal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (wal->fd < 0) err = ERR_IO;
+    }
+    // the log must outlive a crash for its records to
+    if (err == ERR_NONE) err = sync_directory(wal->path);
+    if (err != ERR_NONE) {
+        if (wal->fd >= 0) unlink(wal->path);
+        wal_destroy(wal);
+        return err;
+    }
+
+    state->wal = wal;
+    return ERR_NONE;
+}
+
+int wal_active(const struct imgfs_file* imgfs_file)
+{
+    return wal_of(imgfs_file) != NULL;
+}
+
+int wal_append(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    struct imgfs_wal* wal = wal_of(imgfs_file);
+    if (wal == NULL || slot >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    struct wal_record record;
+    zero_init_var(record);
+    record.magic = WAL_MAGIC;
+    record.slot = slot;
+    record.header = imgfs_file->header;
+    record.metadata = imgfs_file->metadata[slot];
+
+    pthread_mutex_lock(&wal->lock);
+    int err = ERR_NONE;
+    if (wal->nb_pending == wal->pending_capacity) {
+        const size_t capacity = wal->pending_capacity == 0 ? 64 : 2 * wal->pending_capacity;
+        struct wal_record* larger = realloc(wal->pending, capacity * sizeof(struct wal_record));
+        if (larger == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            wal->pending = larger;
+            wal->pending_capacity = capacity;
+        }
+    }
+    if (err == ERR_NONE) {
+        record.position = ++wal->appended;
+        record.checksum = record_checksum(&record);
+        wal->pending[wal->nb_pending++] = record;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    if (err != ERR_NONE) return err;
+
+    // a slot missing from this list would not be checkpointed: write it in place now
+    if (add_slot(&wal->dirty, &wal->nb_dirty, &wal->dirty_capacity, slot) != ERR_NONE) {
+        err = write_in_place(imgfs_file, &slot, 1);
+        return err == ERR_NONE ? wal_checkpoint(imgfs_file) : err;
+    }
+    wal->log_size += sizeof(struct wal_record);
+    return wal->log_size >= WAL_CHECKPOINT_SIZE ? wal_checkpoint(imgfs_file) : ERR_NONE;
+}
+
+uint64_t wal_position(const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_wal* wal = wal_of(imgfs_file);
+    if (wal == NULL) return 0;
+
+    pthread_mutex_lock(&wal->lock);
+    const uint64_t position = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    return position;
+}
+
+int wal_durable(const struct imgfs_file* imgfs_file, uint64_t position)
+{
+    struct imgfs_wal* wal = wal_of(imgfs_file);
+    if (wal == NULL) return 1;
+
+    pthread_mutex_lock(&wal->lock);
+    const int durable = wal->durable >= position;
+    pthread_mutex_unlock(&wal->lock);
+    return durable;
+}
+
+int wal_sync(const struct imgfs_file* imgfs_file, uint64_t position)
+{
+    struct imgfs_wal* wal = wal_of(imgfs_file);
+    if (wal == NULL) return ERR_NONE;
+
+    int err = ERR_NONE;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable < position) {
+        if (wal->failed != ERR_NONE) {
+            err = wal->failed;
+            break;
+        }
+        if (wal->syncing) {
+            // the sync running may not cover position: check again once it is done
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+
+        // lead a group: everything appended so far
+        wal->syncing = 1;
+        struct wal_record* records = wal->pending;
+        const size_t count = wal->nb_pending;
+        const uint64_t target = wal->appended;
+        wal->pending = NULL;
+        wal->nb_pending = wal->pending_capacity = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        int sync_err = fdatasync(wal->file_fd) == 0 ? ERR_NONE : ERR_IO;
+        if (sync_err == ERR_NONE) sync_err = write_all(wal->fd, records, count * sizeof(struct wal_record));
+        if (sync_err == ERR_NONE && fdatasync(wal->fd) != 0) sync_err = ERR_IO;
+        free(records);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->syncing = 0;
+        if (sync_err == ERR_NONE) {
+            wal->durable = target;
+        } else {
+            wal->failed = sync_err;  // until the next checkpoint
+        }
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return err;
+}
+
+int wal_checkpoint(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    struct imgfs_wal* wal = wal_of(imgfs_file);
+    if (wal == NULL || wal->nb_dirty == 0) return ERR_NONE;
+
+    // no sync may write to the log while it is emptied
+    pthread_mutex_lock(&wal->lock);
+    while (wal->syncing) {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    wal->syncing = 1;
+    wal->nb_pending = 0;  // what they hold gets written in place
+    const uint64_t target = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+
+    wal->nb_dirty = sort_unique(wal->dirty, wal->nb_dirty);
+    int err = write_in_place(imgfs_file, wal->dirty, wal->nb_dirty);
+    // the log must not replay older records over what is written in place from now on
+    if (err == ERR_NONE && (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0)) err = ERR_IO;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->syncing = 0;
+    if (err == ERR_NONE) {
+        wal->durable = target;
+        wal->failed = ERR_NONE;
+    } else {
+        wal->failed = err;
+    }
+    pthread_cond_broadcast(&wal->synced);
+    pthread_mutex_unlock(&wal->lock);
+
+    if (err == ERR_NONE) {
+        wal->nb_dirty = 0;
+        wal->log_size = 0;
+    }
+    return err;
+}
+
+int wal_replay(struct imgfs_file* imgfs_file, const char* imgfs_filename, int writable, int* found)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(found);
+    *found = 0;
+
+    char* path = log_path(imgfs_filename);
+    if (path == NULL) return ERR_OUT_OF_MEMORY;
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(path);
+        return errno == ENOENT ? ERR_NONE : ERR_IO;
+    }
+    *found = 1;
+
+    uint32_t* slots = NULL;
+    size_t count = 0, capacity = 0;
+    int err = ERR_NONE;
+    uint64_t last = 0;
+    struct wal_record record;
+    while (err == ERR_NONE && read(fd, &record, sizeof(record)) == (ssize_t) sizeof(record)) {
+        // the first record torn by the crash ends the log
+        if (record.magic != WAL_MAGIC || record.checksum != record_checksum(&record)
+            || record.position <= last || record.slot >= imgfs_file->header.max_files
+            || record.header.max_files != imgfs_file->header.max_files
+            || record.header.unused_32 != imgfs_file->header.unused_32) {
+            break;
+        }
+        last = record.position;
+        imgfs_file->header = record.header;
+        imgfs_file->metadata[record.slot] = record.metadata;
+        err = add_slot(&slots, &count, &capacity, record.slot);
+    }
+    close(fd);
+
+    if (err == ERR_NONE && writable) {
+        count = sort_unique(slots, count);
+        err = write_in_place(imgfs_file, slots, count);
+    }
+    // The on-disk index is changed in place as the images are, ahead of
+    // their records: whatever the log holds, even nothing, the index may
+    // not match the metadata. It is rebuilt from them, before the log goes.
+    if (err == ERR_NONE && writable && imgfs_file->header.unused_32 == IMGFS_FORMAT_INDEXED) {
+        err = index_disk_create(imgfs_file);
+        if (err == ERR_NONE) err = blobs_sync(imgfs_file->file);
+    }
+    if (err == ERR_NONE && writable) {
+        if (unlink(path) != 0) err = ERR_IO;
+        if (err == ERR_NONE) err = sync_directory(path);
+    }
+
+    free(slots);
+    free(path);
+    return err;
+}
+
+void wal_stop(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_state* state = state_of(imgfs_file);
+    if (state == NULL || state->wal == NULL) return;
+
+    // should the checkpoint fail, the log is kept for the next open to replay;
+    // so it is for a state left behind, which has no metadata to write back
+    struct imgfs_wal* wal = state->wal;
+    if (imgfs_file->metadata != NULL
+        && wal_checkpoint(imgfs_file) == ERR_NONE && unlink(wal->path) == 0) {
+        sync_directory(wal->path);
+    }
+    state->wal = NULL;
+    wal_destroy(wal);
+}
@@ -0,0 +1,128 @@
+/**
+ * @file imgfs_wal.h
+ * @brief Write-ahead log of the metadata changes of an imgFS.
+ *
+ * In WAL mode, insertions, deletions and lazy resizes no longer write
+ * the header and the metadata slot they change in place: they append
+ * both to a log kept next to the imgFS (its name followed by ".wal"),
+ * and return. Whoever needs a change to be durable then calls
+ * wal_sync(): the first caller syncs the blobs, writes and syncs every
+ * record appended so far, and all the changes waiting meanwhile are made
+ * durable by that one sync (group commit).
+ *
+ * Every so often, and before anything writes metadata in place (growing,
+ * moving blobs), a checkpoint writes the changed slots into the metadata
+ * region, syncs it and empties the log.
+ *
+ * do_open() and its variants replay the records left in the log by a
+ * crash, before anything else reads the metadata. A clean do_close()
+ * checkpoints and removes the log.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_wal; // the log, see imgfs_wal.c
+
+/**
+ * @brief Switches an imgFS open for writing to WAL mode.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param imgfs_filename The name of the imgFS file, to derive the name of the log.
+ * @return Some error code. 0 if no error.
+ */
+int wal_start(struct imgfs_file* imgfs_file, const char* imgfs_filename);
+
+/**
+ * @brief Whether an imgFS is in WAL mode.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return 1 if so, 0 otherwise.
+ */
+int wal_active(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Logs the header and one metadata slot, as they are in memory.
+ *        The blobs they refer to must already be written.
+ *
+ * @param imgfs_file The main in-memory structure, in WAL mode.
+ * @param slot The metadata slot that changed.
+ * @return Some error code. 0 if no error.
+ */
+int wal_append(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Position of the last record appended so far.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return The position to wait for with wal_sync(), 0 if not in WAL mode.
+ */
+uint64_t wal_position(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Whether the records up to a position are durable.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param position A position given by wal_position().
+ * @return 1 if so (or if not in WAL mode), 0 otherwise.
+ */
+int wal_durable(const struct imgfs_file* imgfs_file, uint64_t position);
+
+/**
+ * @brief Waits until the records up to a position are durable, syncing
+ *        them (with all those appended meanwhile) if no one else is.
+ *
+ * Unlike the other functions, it may be called without holding the lock
+ * that serializes the operations on the imgFS.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @param position A position given by wal_position().
+ * @return Some error code. 0 if no error.
+ */
+int wal_sync(const struct imgfs_file* imgfs_file, uint64_t position);
+
+/**
+ * @brief Writes the logged slots in place, syncs them and empties the log.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code. 0 if no error (or if not in WAL mode).
+ */
+int wal_checkpoint(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Replays the records a crash left in the log of an imgFS just
+ *        opened, before anything else reads its metadata.
+ *
+ * The changes are applied to the in-memory header and metadata and, when
+ * the file is writable, written in place, after which the log is removed.
+ *
+ * The on-disk ID index (see imgfs_index.h) is changed in place ahead of
+ * the records: once a log is found, even an empty one, it is rebuilt
+ * from the metadata when the file is writable, and must not be used
+ * otherwise.
+ *
+ * @param imgfs_file The main in-memory structure, with its header and metadata loaded.
+ * @param imgfs_filename The name of the imgFS file.
+ * @param writable Whether the file is open for writing.
+ * @param found Where to put whether a log was found (the store was not closed cleanly).
+ * @return Some error code. 0 if no error.
+ */
+int wal_replay(struct imgfs_file* imgfs_file, const char* imgfs_filename, int writable, int* found);
+
+/**
+ * @brief Leaves WAL mode (if on): checkpoints, then removes the log.
+ *
+ * @param imgfs_file The main in-memory structure.
+ */
+void wal_stop(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
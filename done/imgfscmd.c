@@ -58,6 +58,8 @@ static command_mapping commands[] = {
     {"delete", do_delete_cmd},
     {"insert", do_insert_cmd},
     {"read", do_read_cmd},
+    {"grow", do_grow_cmd},
+    {"gc", do_gbcollect_cmd},
     {NULL, NULL},
 } ;
 
@@ -92,7 +94,13 @@ int main(int argc, char* argv[])
          */
         argc--; argv++; // skips command call name
 
-        int found = 0 ;
+        // options coming before the command
+        if (strcmp(argv[0], "-durability") == 0) {
+            ret = argc < 3 ? ERR_NOT_ENOUGH_ARGUMENTS : set_durability_option(argv[1]);
+            argc -= 2; argv += 2;
+        }
+
+        int found = ret != ERR_NONE;
         int i = 0 ;
         while (found!=1 && commands[i].func_name!=NULL) {
             if (strncmp(argv[0], commands[i].func_name, MIN(strlen(commands[i].func_name), strlen(argv[0])) + 1) == 0) {
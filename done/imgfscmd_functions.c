@@ -6,6 +6,8 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_durability.h"
+#include "imgfs_index.h"   // for index_find_id
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 #include <json-c/json.h>
@@ -23,6 +25,10 @@ static const uint16_t default_small_res = 256;
 static const uint16_t MAX_THUMB_RES = 128;
 static const uint16_t MAX_SMALL_RES = 512;
 
+// durability policy of the commands that change the imgFS
+static enum durability_mode durability = DURABILITY_NONE;
+static uint32_t durability_interval_ms = DURABILITY_DEFAULT_INTERVAL_MS;
+
 /************************
  * Displays some explanations.
  ************************ */
@@ -50,14 +56,45 @@ int help(int useless _unused, char** useless_too _unused)
            "      read an image from the imgFS and save it to a file.\n"
            "      default resolution is \"original\".\n"
            "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
-           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n",
+           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+           "  grow <imgFS_filename> <MAX_FILES>: enlarge the imgFS to MAX_FILES images.\n"
+           "  gc <imgFS_filename> <tmp imgFS_filename>: performs garbage collecting on imgFS.\n"
+           "      requires a temporary filename for copying the imgFS.\n"
+           "imgfscmd -durability <none|batched[:MS]|sync> [COMMAND] [ARGUMENTS]\n"
+           "  when insert, delete and read sync the imgFS: never (none, the default),\n"
+           "  every MS milliseconds (default %u) and at the end (batched),\n"
+           "  or after every change (sync).\n",
            default_max_files, UINT32_MAX,
            default_thumb_res, default_thumb_res, MAX_THUMB_RES, MAX_THUMB_RES,
-           default_small_res, default_small_res, MAX_SMALL_RES, MAX_SMALL_RES);
+           default_small_res, default_small_res, MAX_SMALL_RES, MAX_SMALL_RES,
+           DURABILITY_DEFAULT_INTERVAL_MS);
 
     return ERR_NONE;
 }
 
+/************************
+ * Sets the durability policy given on the command line.
+ ************************ */
+int set_durability_option(const char* mode)
+{
+    M_REQUIRE_NON_NULL(mode);
+    return durability_parse(mode, &durability, &durability_interval_ms);
+}
+
+/************************
+ * Opens an imgFS for a command that changes it, with the durability
+ * policy given on the command line.
+ ************************ */
+static int open_for_writing(const char* imgfs_filename, struct imgfs_file* imgfs_file)
+{
+    int error = do_open_lazy(imgfs_filename, "rb+", imgfs_file);
+    if (error != ERR_NONE) return error;
+
+    error = durability_start(imgfs_file, durability, durability_interval_ms);
+    if (error != ERR_NONE) do_close(imgfs_file);
+    return error;
+}
+
 /************************
  * Opens imgFS file and calls do_list().
  ************************ */
@@ -110,6 +147,7 @@ int do_create_cmd(int argc, char** argv)
     struct imgfs_file imgfs_file;
 
     imgfs_file.header.max_files = default_max_files;
+    imgfs_file.header.unused_32 = IMGFS_FORMAT_LATEST;
     imgfs_file.header.resized_res[0] = default_thumb_res;
     imgfs_file.header.resized_res[1] = default_thumb_res;
     imgfs_file.header.resized_res[2] = default_small_res;
@@ -184,7 +222,7 @@ int do_delete_cmd(int argc, char** argv)
         return ERR_INVALID_IMGID;
     }
 
-    int open = do_open(argv[0], "rb+", &imgfs_file);
+    int open = open_for_writing(argv[0], &imgfs_file);
     if (open != ERR_NONE) {
         return open;
     }
@@ -282,26 +320,39 @@ int do_read_cmd(int argc, char **argv)
     const int resolution = (argc == 3) ? resolution_atoi(argv[2]) : ORIG_RES;
     if (resolution == -1) return ERR_RESOLUTIONS;
 
+    // Reading changes nothing, unless the variant is still to be computed:
+    // only then is the imgFS opened for writing.
     struct imgfs_file myfile;
     zero_init_var(myfile);
-    int error = do_open(argv[0], "rb+", &myfile);
+    int error = do_open_lazy(argv[0], "rb", &myfile);
     if (error != ERR_NONE) return error;
 
-    char *image_buffer = NULL;
+    const uint32_t index = index_find_id(&myfile, img_id, INDEX_NO_SLOT);
+    if (index != INDEX_NO_SLOT && myfile.metadata[index].size[resolution] == 0) {
+        do_close(&myfile);
+        error = open_for_writing(argv[0], &myfile);
+        if (error != ERR_NONE) return error;
+    }
+
+    // The image is written out straight from the mapping, hence before closing.
+    const char *image_buffer = NULL;
     uint32_t image_size = 0;
-    error = do_read(img_id, resolution, &image_buffer, &image_size, &myfile);
-    do_close(&myfile);
+    error = do_read_view(img_id, resolution, &image_buffer, &image_size, &myfile);
     if (error != ERR_NONE) {
+        do_close(&myfile);
         return error;
     }
 
     // Extracting to a separate image file.
     char* tmp_name = NULL;
     create_name(img_id, resolution, &tmp_name);
-    if (tmp_name == NULL) return ERR_OUT_OF_MEMORY;
+    if (tmp_name == NULL) {
+        do_close(&myfile);
+        return ERR_OUT_OF_MEMORY;
+    }
     error = write_disk_image(tmp_name, image_buffer, image_size);
     free(tmp_name);
-    free(image_buffer);
+    do_close(&myfile);
 
     return error;
 }
@@ -313,7 +364,7 @@ int do_insert_cmd(int argc, char **argv)
 
     struct imgfs_file myfile;
     zero_init_var(myfile);
-    int error = do_open(argv[0], "rb+", &myfile);
+    int error = open_for_writing(argv[0], &myfile);
     if (error != ERR_NONE) return error;
 
     char *image_buffer = NULL;
@@ -331,3 +382,37 @@ int do_insert_cmd(int argc, char **argv)
     do_close(&myfile);
     return error;
 }
+
+/************************
+ * Enlarges the metadata table of an imgFS.
+ */
+int do_grow_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc > 2) return ERR_INVALID_ARGUMENT;
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const uint32_t max_files = atouint32(argv[1]);
+    if (max_files == 0) return ERR_MAX_FILES;
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    int error = do_open_lazy(argv[0], "rb+", &imgfs_file);
+    if (error != ERR_NONE) return error;
+
+    error = do_grow(max_files, &imgfs_file);
+    do_close(&imgfs_file);
+    return error;
+}
+
+/************************
+ * Removes the room left by deleted images in an imgFS.
+ */
+int do_gbcollect_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc > 2) return ERR_INVALID_ARGUMENT;
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    return do_gbcollect(argv[0], argv[1]);
+}
@@ -36,3 +36,19 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Enlarges the metadata table of an imgFS.
+ *******************************************************************/
+int do_grow_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Removes the room left by deleted images in an imgFS.
+ *******************************************************************/
+int do_gbcollect_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Sets when the commands that change an imgFS sync it (see
+ * durability_parse() for the accepted values).
+ *******************************************************************/
+int set_durability_option(const char* mode);
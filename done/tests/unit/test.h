@@ -10,6 +10,7 @@
 
 #include <check.h>
 #include <stdlib.h>   // EXIT_FAILURE
+#include <string.h>   // memset, strcmp
 
 #ifndef ck_assert_mem_eq
 // exists since check 0.11.0
@@ -231,3 +232,91 @@ static void read_file(void *buffer, const char *filename, size_t size)
 
     fclose(file);
 }
+
+static void read_file_and_size(void **buffer, const char *filename, size_t* size)
+{
+    FILE *file = fopen(filename, "r");
+    ck_assert_ptr_nonnull(file);
+
+    ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+    *size = (size_t)ftell(file);
+    rewind(file);
+
+    *buffer = calloc(*size, 1);
+    ck_assert_ptr_nonnull(*buffer);
+
+    ck_assert_uint_eq(fread(*buffer, 1, *size, file), *size);
+
+    fclose(file);
+}
+
+// ======================================================================
+// Fixtures of the tests of the modules behind the course functions
+
+#define TEST_MAX_FILES 10
+#define TEST_THUMB_RES 64
+#define TEST_SMALL_RES 256
+
+/*
+ * Creates an empty imgFS of the given format (IMGFS_FORMAT_*) and,
+ * unless mode is NULL, opens it with that mode.
+ */
+static void create_imgfs(const char *filename, uint32_t format, const char *mode, struct imgfs_file *file)
+{
+    memset(file, 0, sizeof(*file));
+    file->header.max_files = TEST_MAX_FILES;
+    file->header.resized_res[0] = file->header.resized_res[1] = TEST_THUMB_RES;
+    file->header.resized_res[2] = file->header.resized_res[3] = TEST_SMALL_RES;
+    file->header.unused_32 = format;
+    ck_assert_err_none(do_create(filename, file));
+    do_close(file);
+    if (mode != NULL) ck_assert_err_none(do_open(filename, mode, file));
+}
+
+/*
+ * Inserts the content of a file under img_id, and returns its size.
+ */
+static size_t insert_data(const char *filename, const char *img_id, struct imgfs_file *file)
+{
+    void *image = NULL;
+    size_t size = 0;
+    read_file_and_size(&image, filename, &size);
+    ck_assert_err_none(do_insert(image, size, img_id, file));
+    free(image);
+    return size;
+}
+
+/*
+ * The slot of a valid image, header.max_files if there is none.
+ */
+static uint32_t find_slot(const struct imgfs_file *file, const char *img_id)
+{
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid == NON_EMPTY && !strcmp(file->metadata[i].img_id, img_id)) return i;
+    }
+    return file->header.max_files;
+}
+
+static int has_image(const struct imgfs_file *file, const char *img_id)
+{
+    return find_slot(file, img_id) < file->header.max_files;
+}
+
+/*
+ * Checks that the original of an image is the content of a file.
+ */
+static void check_image(struct imgfs_file *file, const char *img_id, const char *filename)
+{
+    void *expected = NULL;
+    size_t expected_size = 0;
+    read_file_and_size(&expected, filename, &expected_size);
+
+    char *image = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_read(img_id, ORIG_RES, &image, &size, file));
+    ck_assert_uint_eq(size, expected_size);
+    ck_assert_int_eq(memcmp(image, expected, size), 0);
+
+    free(image);
+    free(expected);
+}
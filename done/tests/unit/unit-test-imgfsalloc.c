@@ -0,0 +1,202 @@
+#include "imgfs.h"
+#include "imgfs_io.h"
+#include "imgfs_rcu.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PAPILLON_SIZE    72876
+#define COQ_SMALL_SIZE   17327
+
+// ======================================================================
+// The offset of the original of an image.
+static uint64_t offset_of(const struct imgfs_file* file, const char* img_id)
+{
+    const uint32_t slot = find_slot(file, img_id);
+    ck_assert_uint_lt(slot, file->header.max_files);
+    return file->metadata[slot].offset[ORIG_RES];
+}
+
+// ======================================================================
+START_TEST(alloc_appends_without_holes)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    ck_assert_uint_eq(offset_of(&file, "pap"), size);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    ck_assert_uint_eq(offset_of(&file, "mure"), size + PAPILLON_SIZE);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_reuses_smallest_hole)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t hole = offset_of(&file, "pap");
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+
+    ck_assert_err_none(do_delete("pap", &file));
+
+    // both fit in the room of the deleted image, one after the other
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_eq(offset_of(&file, "coq"), hole);
+    insert_data(DATA_DIR "/papillon_small.jpg", "pap2", &file);
+    ck_assert_uint_eq(offset_of(&file, "pap2"), hole + COQ_SMALL_SIZE);
+
+    // the file did not grow
+    uint64_t new_size = 0;
+    ck_assert_err_none(io_size(file.file, &new_size));
+    ck_assert_uint_eq(new_size, size);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_keeps_shared_blobs)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t shared = offset_of(&file, "pap");
+    ck_assert_uint_eq(offset_of(&file, "same"), shared);
+
+    // "same" still uses the content
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_gt(offset_of(&file, "coq"), offset_of(&file, "mure"));
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_cuts_end_of_file)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t end = offset_of(&file, "mure");
+
+    // the room at the end of the file is cut off, then taken again
+    ck_assert_err_none(do_delete("mure", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_eq(offset_of(&file, "coq"), end);
+
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+    ck_assert_uint_eq(size, end + COQ_SMALL_SIZE);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_after_reopen)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t hole = offset_of(&file, "pap");
+    ck_assert_err_none(do_delete("pap", &file));
+    do_close(&file);
+
+    // the holes are worked out again from the metadata
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_eq(offset_of(&file, "coq"), hole);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_waits_for_readers)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t hole = offset_of(&file, "pap");
+
+    // a reader may still see the deleted blob: its room is not reused yet
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_gt(offset_of(&file, "coq"), offset_of(&file, "mure"));
+    rcu_read_exit();
+
+    // once it is gone, it is
+    insert_data(DATA_DIR "/papillon_small.jpg", "pap2", &file);
+    ck_assert_uint_eq(offset_of(&file, "pap2"), hole);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_alloc_test_suite()
+{
+    Suite *s = suite_create("Tests of the reuse of the room freed by deletions");
+
+    Add_Test(s, alloc_appends_without_holes);
+    Add_Test(s, alloc_reuses_smallest_hole);
+    Add_Test(s, alloc_keeps_shared_blobs);
+    Add_Test(s, alloc_cuts_end_of_file);
+    Add_Test(s, alloc_after_reopen);
+    Add_Test(s, alloc_waits_for_readers);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_alloc_test_suite)
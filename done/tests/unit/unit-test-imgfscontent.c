@@ -188,6 +188,77 @@ START_TEST(lazily_resize_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(resize_steps_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    const uint32_t slot = find_slot(&file, "pap");
+
+    struct resize_job job;
+    int done = 1;
+    ck_assert_err_none(resize_begin(RESIZED_VARIANTS, &file, slot, &job, &done));
+    ck_assert_int_eq(done, 0);
+    ck_assert_err_none(resize_encode(&job));
+    ck_assert_err_none(resize_finish(&file, &job));
+    resize_release(&job);
+
+    ck_assert_uint_ne(file.metadata[slot].size[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[slot].size[SMALL_RES], 0);
+
+    // nothing is left to do
+    ck_assert_err_none(resize_begin(RESIZED_VARIANTS, &file, slot, &job, &done));
+    ck_assert_int_eq(done, 1);
+    resize_release(&job);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_steps_image_deleted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    const uint32_t slot = find_slot(&file, "pap");
+
+    struct resize_job job;
+    int done = 1;
+    ck_assert_err_none(resize_begin(RESIZED_VARIANTS, &file, slot, &job, &done));
+    ck_assert_int_eq(done, 0);
+    ck_assert_err_none(resize_encode(&job));
+
+    // the image was replaced by another while encoding: its variants are dropped
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    ck_assert_uint_eq(find_slot(&file, "mure"), slot);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    const long file_size = ftell(file.file);
+
+    ck_assert_err_none(resize_finish(&file, &job));
+    resize_release(&job);
+
+    ck_assert_uint_eq(file.metadata[slot].size[THUMB_RES], 0);
+    ck_assert_uint_eq(file.metadata[slot].size[SMALL_RES], 0);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), file_size);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -200,6 +271,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_invalid_mode);
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
+    Add_Test(s, resize_steps_valid);
+    Add_Test(s, resize_steps_image_deleted);
 
     return s;
 }
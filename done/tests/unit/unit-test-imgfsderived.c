@@ -0,0 +1,431 @@
+#include "image_content.h"
+#include "imgfs.h"
+#include "imgfs_derived.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+// ======================================================================
+// Stores the content of a file as a tile of an image.
+static void insert_tile(const char* filename, const char* img_id, uint32_t x, struct imgfs_file* file)
+{
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(tile_id(img_id, 0, x, 0, derived_id));
+
+    void* tile = NULL;
+    size_t size = 0;
+    read_file_and_size(&tile, filename, &size);
+    ck_assert_err_none(derived_insert(tile, size, derived_id, img_id, file));
+    free(tile);
+}
+
+// Stores the content of a file as a sized variant of an image.
+static void insert_sized(const char* filename, const char* img_id, uint32_t width, uint32_t height,
+                         struct imgfs_file* file)
+{
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(sized_id(img_id, width, height, derived_id));
+
+    void* variant = NULL;
+    size_t size = 0;
+    read_file_and_size(&variant, filename, &size);
+    ck_assert_err_none(derived_insert(variant, size, derived_id, img_id, file));
+    free(variant);
+}
+
+// The number of derived images stored.
+static uint32_t count_derived(const struct imgfs_file* file)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid == NON_EMPTY && IS_DERIVED_ID(file->metadata[i].img_id)) ++count;
+    }
+    return count;
+}
+
+// What do_list() prints on stdout, to be released with free().
+static char* list_stdout(const struct imgfs_file* file)
+{
+    FILE* output = tmpfile();
+    ck_assert_ptr_nonnull(output);
+
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    ck_assert_int_ge(saved, 0);
+    ck_assert_int_ge(dup2(fileno(output), STDOUT_FILENO), 0);
+    const int err = do_list(file, STDOUT, NULL);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    ck_assert_err_none(err);
+
+    const long size = ftell(output);
+    ck_assert_int_ge(size, 0);
+    char* text = calloc((size_t) size + 1, 1);
+    ck_assert_ptr_nonnull(text);
+    rewind(output);
+    ck_assert_uint_eq(fread(text, 1, (size_t) size, output), (size_t) size);
+    fclose(output);
+    return text;
+}
+
+// ======================================================================
+START_TEST(derived_tile_geometry)
+{
+    start_test_print;
+
+    ck_assert_uint_eq(tile_levels(1, 1), 1);
+    ck_assert_uint_eq(tile_levels(TILE_SIZE, TILE_SIZE), 1);
+    ck_assert_uint_eq(tile_levels(TILE_SIZE + 1, 10), 2);
+    ck_assert_uint_eq(tile_levels(1000, 600), 3); // 1000, 500, 250
+
+    ck_assert_int_eq(tile_exists(1000, 600, 0, 3, 2), 1);
+    ck_assert_int_eq(tile_exists(1000, 600, 0, 4, 0), 0);
+    ck_assert_int_eq(tile_exists(1000, 600, 0, 0, 3), 0);
+    ck_assert_int_eq(tile_exists(1000, 600, 1, 1, 1), 1);
+    ck_assert_int_eq(tile_exists(1000, 600, 1, 2, 0), 0);
+    ck_assert_int_eq(tile_exists(1000, 600, 2, 0, 0), 1);
+    ck_assert_int_eq(tile_exists(1000, 600, 2, 1, 0), 0);
+    ck_assert_int_eq(tile_exists(1000, 600, 3, 0, 0), 0);
+    ck_assert_int_eq(tile_exists(0, 600, 0, 0, 0), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_tile_id)
+{
+    start_test_print;
+
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(tile_id("pap", 2, 1, 3, derived_id));
+    ck_assert(IS_DERIVED_ID(derived_id));
+    ck_assert_str_eq(derived_parent(derived_id), "pap");
+    ck_assert_ptr_null(derived_parent("pap"));
+
+    // the ID of the image must fit in it
+    char img_id[MAX_IMG_ID + 1];
+    memset(img_id, 'a', MAX_IMG_ID);
+    img_id[MAX_IMG_ID] = '\0';
+    ck_assert_err(tile_id(img_id, 0, 0, 0, derived_id), ERR_INVALID_IMGID);
+    ck_assert_invalid_arg(tile_id(NULL, 0, 0, 0, derived_id));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_insert_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+
+    insert_tile(DATA_DIR "/papillon_small.jpg", "pap", 0, &file);
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_uint_eq(count_derived(&file), 1);
+    ck_assert(file.metadata[find_slot(&file, "pap")].unused_16 & IMG_HAS_DERIVED);
+
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(tile_id("pap", 0, 0, 0, derived_id));
+    check_image(&file, derived_id, DATA_DIR "/papillon_small.jpg");
+
+    // once only, for an image stored, and never by do_insert()
+    void* tile = NULL;
+    size_t size = 0;
+    read_file_and_size(&tile, DATA_DIR "/papillon_small.jpg", &size);
+    ck_assert_err(derived_insert(tile, size, derived_id, "pap", &file), ERR_DUPLICATE_ID);
+    ck_assert_err(derived_insert(tile, size, "pap_tile", "pap", &file), ERR_INVALID_IMGID);
+    ck_assert_err_none(tile_id("unknown", 0, 0, 0, derived_id));
+    ck_assert_err(derived_insert(tile, size, derived_id, "unknown", &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(do_insert(tile, size, derived_id, &file), ERR_INVALID_IMGID);
+    free(tile);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_deleted_with_image)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_tile(DATA_DIR "/papillon_small.jpg", "pap", 0, &file);
+    insert_tile(DATA_DIR "/coquelicots_small.jpg", "pap", 1, &file);
+    insert_tile(DATA_DIR "/papillon_small.jpg", "mure", 0, &file);
+
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_uint_eq(count_derived(&file), 1);
+    do_close(&file);
+
+    // as on disk
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_uint_eq(count_derived(&file), 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_evicted_when_full)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    for (uint32_t x = 0; x < TEST_MAX_FILES - 1; ++x) {
+        insert_tile(DATA_DIR "/papillon_small.jpg", "pap", x, &file);
+    }
+    ck_assert_uint_eq(file.header.nb_files, TEST_MAX_FILES);
+
+    // the derived images give way to the images of the users, but not to each other
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(tile_id("pap", 1, 0, 0, derived_id));
+    void* tile = NULL;
+    size_t size = 0;
+    read_file_and_size(&tile, DATA_DIR "/papillon_small.jpg", &size);
+    ck_assert_err(derived_insert(tile, size, derived_id, "pap", &file), ERR_IMGFS_FULL);
+    free(tile);
+
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    ck_assert_uint_eq(file.header.nb_files, TEST_MAX_FILES);
+    ck_assert_uint_eq(count_derived(&file), TEST_MAX_FILES - 2);
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_not_listed)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_tile(DATA_DIR "/papillon_small.jpg", "pap", 0, &file);
+    insert_tile(DATA_DIR "/papillon_small.jpg", "pap", 1, &file);
+
+    char* json = NULL;
+    ck_assert_err_none(do_list(&file, JSON, &json));
+    ck_assert_ptr_nonnull(strstr(json, "\"pap\""));
+    ck_assert_ptr_null(strchr(json, DERIVED_MARK));
+    free(json);
+
+    // only the images listed are counted
+    char* text = list_stdout(&file);
+    ck_assert_ptr_nonnull(strstr(text, "IMAGE COUNT: 1\t"));
+    ck_assert_ptr_nonnull(strstr(text, "IMAGE ID: pap\n"));
+    ck_assert_ptr_null(strchr(text, DERIVED_MARK));
+    free(text);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_only_listed_empty)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb", &file);
+
+    // as left by a deletion interrupted before its derived images
+    const uint32_t slot = 3;
+    strcpy(file.metadata[slot].img_id, "\x1ftile:0:0:0\x1fpap");
+    file.metadata[slot].is_valid = NON_EMPTY;
+    file.header.nb_files = 1;
+
+    char* text = list_stdout(&file);
+    ck_assert_ptr_nonnull(strstr(text, "IMAGE COUNT: 0\t"));
+    ck_assert_ptr_nonnull(strstr(text, "<< empty imgFS >>"));
+    free(text);
+
+    memset(&file.metadata[slot], 0, sizeof(file.metadata[slot]));
+    file.header.nb_files = 0;
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_size_buckets)
+{
+    start_test_print;
+
+    struct size_buckets buckets;
+    ck_assert_err_none(size_buckets_parse(DEFAULT_SIZE_BUCKETS, &buckets));
+    ck_assert_uint_eq(buckets.count, 5);
+
+    // sorted by area, square unless given both dimensions
+    ck_assert_err_none(size_buckets_parse("512,64x32,128", &buckets));
+    ck_assert_uint_eq(buckets.count, 3);
+    ck_assert_uint_eq(buckets.width[0], 64);
+    ck_assert_uint_eq(buckets.height[0], 32);
+    ck_assert_uint_eq(buckets.width[1], 128);
+    ck_assert_uint_eq(buckets.height[1], 128);
+    ck_assert_uint_eq(buckets.width[2], 512);
+
+    // the smallest box the size fits in, else the largest one
+    ck_assert_uint_eq(size_bucket(&buckets, 60, 30), 0);
+    ck_assert_uint_eq(size_bucket(&buckets, 60, 40), 1);
+    ck_assert_uint_eq(size_bucket(&buckets, 0, 200), 2);
+    ck_assert_uint_eq(size_bucket(&buckets, 4000, 10), 2);
+
+    ck_assert_err(size_buckets_parse("", &buckets), ERR_INVALID_ARGUMENT);
+    ck_assert_err(size_buckets_parse("0", &buckets), ERR_INVALID_ARGUMENT);
+    ck_assert_err(size_buckets_parse("128,", &buckets), ERR_INVALID_ARGUMENT);
+    ck_assert_err(size_buckets_parse("128x", &buckets), ERR_INVALID_ARGUMENT);
+    ck_assert_err(size_buckets_parse("70000", &buckets), ERR_INVALID_ARGUMENT);
+    ck_assert_err(size_buckets_parse("1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17", &buckets),
+                  ERR_INVALID_ARGUMENT);
+    ck_assert_invalid_arg(size_buckets_parse(NULL, &buckets));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_sized_id)
+{
+    start_test_print;
+
+    char derived_id[MAX_IMG_ID + 1];
+    char other_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(sized_id("pap", 128, 64, derived_id));
+    ck_assert(IS_DERIVED_ID(derived_id));
+    ck_assert_str_eq(derived_parent(derived_id), "pap");
+
+    // one per image and box, apart from the tiles
+    ck_assert_err_none(sized_id("pap", 64, 128, other_id));
+    ck_assert_str_ne(derived_id, other_id);
+    ck_assert_err_none(tile_id("pap", 0, 128, 64, other_id));
+    ck_assert_str_ne(derived_id, other_id);
+
+    char img_id[MAX_IMG_ID + 1];
+    memset(img_id, 'a', MAX_IMG_ID);
+    img_id[MAX_IMG_ID] = '\0';
+    ck_assert_err(sized_id(img_id, 128, 128, derived_id), ERR_INVALID_IMGID);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_sized_encode)
+{
+    start_test_print;
+
+    void* original = NULL;
+    size_t original_size = 0;
+    read_file_and_size(&original, DATA_DIR "/papillon.jpg", &original_size);
+
+    void* variant = NULL;
+    size_t variant_size = 0;
+    ck_assert_err(sized_encode(original, original_size, 0, 64, &variant, &variant_size), ERR_INVALID_ARGUMENT);
+
+    // the image fits the box, keeping its aspect ratio
+    ck_assert_err_none(sized_encode(original, original_size, 128, 64, &variant, &variant_size));
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, variant, variant_size));
+    ck_assert_uint_le(width, 128);
+    ck_assert_uint_le(height, 64);
+    ck_assert(width == 128 || height == 64);
+    g_free(variant);
+
+    free(original);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_variant_table)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon_small.jpg", "pap2", &file);
+    insert_sized(DATA_DIR "/mure.jpg", "pap", 128, 128, &file);
+    insert_sized(DATA_DIR "/coquelicots_small.jpg", "pap", 512, 512, &file);
+    insert_sized(DATA_DIR "/mure.jpg", "pap2", 128, 128, &file);
+
+    const uint32_t slot = index_find_derived(&file, "pap");
+    ck_assert_uint_ne(slot, INDEX_NO_SLOT);
+    ck_assert_str_eq(derived_parent(file.metadata[slot].img_id), "pap");
+    char derived_id[MAX_IMG_ID + 1];
+    ck_assert_err_none(sized_id("pap", 512, 512, derived_id));
+    check_image(&file, derived_id, DATA_DIR "/coquelicots_small.jpg");
+    do_close(&file);
+
+    // the variants of an image go with it, found through the index on disk
+    ck_assert_err_none(do_open_lazy(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_uint_eq(index_find_derived(&file, "pap"), INDEX_NO_SLOT);
+    ck_assert_uint_ne(index_find_derived(&file, "pap2"), INDEX_NO_SLOT);
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(count_derived(&file), 1);
+    ck_assert_err_none(sized_id("pap2", 128, 128, derived_id));
+    check_image(&file, derived_id, DATA_DIR "/mure.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_derived_test_suite()
+{
+    Suite *s = suite_create("Tests of the images derived from the stored ones");
+
+    Add_Test(s, derived_tile_geometry);
+    Add_Test(s, derived_tile_id);
+    Add_Test(s, derived_insert_valid);
+    Add_Test(s, derived_deleted_with_image);
+    Add_Test(s, derived_evicted_when_full);
+    Add_Test(s, derived_not_listed);
+    Add_Test(s, derived_only_listed_empty);
+    Add_Test(s, derived_size_buckets);
+    Add_Test(s, derived_sized_id);
+    Add_Test(s, derived_sized_encode);
+    Add_Test(s, derived_variant_table);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_derived_test_suite)
@@ -0,0 +1,152 @@
+#include "imgfs.h"
+#include "imgfs_durability.h"
+#include "imgfs_wal.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define POLL_US      10000
+#define POLL_TIMEOUT 500 // times POLL_US
+
+// ======================================================================
+// Creates an empty imgFS at dump, opens it for writing, in WAL mode,
+// with the given policy.
+static void open_with(const char* dump, enum durability_mode mode, uint32_t interval_ms,
+                      struct imgfs_file* file)
+{
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", file);
+    ck_assert_err_none(wal_start(file, dump));
+    ck_assert_err_none(durability_start(file, mode, interval_ms));
+}
+
+// ======================================================================
+START_TEST(durability_parse_modes)
+{
+    start_test_print;
+
+    enum durability_mode mode = DURABILITY_NONE;
+    uint32_t interval = 0;
+
+    ck_assert_err_none(durability_parse("none", &mode, &interval));
+    ck_assert_int_eq(mode, DURABILITY_NONE);
+    ck_assert_err_none(durability_parse("sync", &mode, &interval));
+    ck_assert_int_eq(mode, DURABILITY_PER_OP);
+    ck_assert_err_none(durability_parse("batched", &mode, &interval));
+    ck_assert_int_eq(mode, DURABILITY_BATCHED);
+    ck_assert_uint_eq(interval, DURABILITY_DEFAULT_INTERVAL_MS);
+    ck_assert_err_none(durability_parse("batched:250", &mode, &interval));
+    ck_assert_int_eq(mode, DURABILITY_BATCHED);
+    ck_assert_uint_eq(interval, 250);
+
+    ck_assert_err(durability_parse("batched:0", &mode, &interval), ERR_INVALID_ARGUMENT);
+    ck_assert_err(durability_parse("batched:", &mode, &interval), ERR_INVALID_ARGUMENT);
+    ck_assert_err(durability_parse("batchedly", &mode, &interval), ERR_INVALID_ARGUMENT);
+    ck_assert_err(durability_parse("fast", &mode, &interval), ERR_INVALID_ARGUMENT);
+    ck_assert_invalid_arg(durability_parse(NULL, &mode, &interval));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_none)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_with(dump, DURABILITY_NONE, 0, &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    ck_assert_int_eq(wal_durable(&file, wal_position(&file)), 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_per_op)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_with(dump, DURABILITY_PER_OP, 0, &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    ck_assert_int_eq(wal_durable(&file, wal_position(&file)), 1);
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_int_eq(wal_durable(&file, wal_position(&file)), 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_batched)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_with(dump, DURABILITY_BATCHED, 10, &file);
+
+    // the background thread gets there, without any further operation
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t position = wal_position(&file);
+    int polls = 0;
+    while (!wal_durable(&file, position) && polls < POLL_TIMEOUT) {
+        usleep(POLL_US);
+        ++polls;
+    }
+    ck_assert_int_eq(wal_durable(&file, position), 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_batched_stop)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_with(dump, DURABILITY_BATCHED, 3600 * 1000, &file);
+
+    // what the background thread did not sync yet is synced when it stops
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    const uint64_t position = wal_position(&file);
+    durability_stop(&file);
+    ck_assert_int_eq(wal_durable(&file, position), 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_durability_test_suite()
+{
+    Suite *s = suite_create("Tests of the durability policies");
+
+    Add_Test(s, durability_parse_modes);
+    Add_Test(s, durability_none);
+    Add_Test(s, durability_per_op);
+    Add_Test(s, durability_batched);
+    Add_Test(s, durability_batched_stop);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_durability_test_suite)
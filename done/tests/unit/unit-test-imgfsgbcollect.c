@@ -0,0 +1,202 @@
+#include "imgfs.h"
+#include "imgfs_io.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// ======================================================================
+// Runs compaction steps of the given budget until a pass ends, and
+// gives how many it took.
+static int compact(struct imgfs_file* file, size_t budget)
+{
+    int steps = 0;
+    int finished = 0;
+    while (!finished) {
+        size_t copied = 0;
+        ck_assert_err_none(do_gbcollect_step(file, budget, &copied, &finished));
+        ++steps;
+        ck_assert_int_lt(steps, 100);
+    }
+    return steps;
+}
+
+// The end of the last blob of an imgFS.
+static uint64_t content_end(const struct imgfs_file* file)
+{
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &file->metadata[i];
+        if (metadata->is_valid != NON_EMPTY) continue;
+        for (int res = 0; res < NB_RES; ++res) {
+            const uint64_t blob_end = metadata->offset[res] + metadata->size[res];
+            if (metadata->size[res] > 0 && blob_end > end) end = blob_end;
+        }
+    }
+    return end;
+}
+
+// ======================================================================
+START_TEST(gbcollect_offline)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_tmp);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_err_none(do_delete("pap", &file));
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dump_tmp));
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert(!has_image(&file, "pap"));
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    check_image(&file, "coq", DATA_DIR "/coquelicots_small.jpg");
+    uint64_t new_size = 0;
+    ck_assert_err_none(io_size(file.file, &new_size));
+    ck_assert_uint_lt(new_size, size);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(gbcollect_step_slides_down)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    const uint64_t hole = file.metadata[find_slot(&file, "pap")].offset[ORIG_RES];
+    ck_assert_err_none(do_delete("pap", &file));
+
+    compact(&file, SIZE_MAX);
+
+    // the next blobs took the room of the deleted one, and the file was cut after them
+    ck_assert_uint_eq(file.metadata[find_slot(&file, "mure")].offset[ORIG_RES], hole);
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+    ck_assert_uint_eq(size, content_end(&file));
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    check_image(&file, "coq", DATA_DIR "/coquelicots_small.jpg");
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    check_image(&file, "coq", DATA_DIR "/coquelicots_small.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(gbcollect_step_overlapping)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    const uint64_t hole = file.metadata[find_slot(&file, "coq")].offset[ORIG_RES];
+    ck_assert_err_none(do_delete("coq", &file));
+
+    // the blob moves down by less than its size: onto itself
+    compact(&file, SIZE_MAX);
+    ck_assert_uint_eq(file.metadata[find_slot(&file, "pap")].offset[ORIG_RES], hole);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(gbcollect_step_budget)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_data(DATA_DIR "/papillon_small.jpg", "pap_small", &file);
+    ck_assert_err_none(do_delete("coq", &file));
+
+    // a small budget spreads the pass over several steps, with other operations in between
+    size_t copied = 0;
+    int finished = 0;
+    ck_assert_err_none(do_gbcollect_step(&file, 1, &copied, &finished));
+    ck_assert_int_eq(finished, 0);
+    ck_assert_uint_gt(copied, 0);
+    ck_assert_err_none(do_delete("mure", &file));
+    ck_assert_int_gt(compact(&file, 1), 1);
+
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+    ck_assert_uint_eq(size, content_end(&file));
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "pap_small", DATA_DIR "/papillon_small.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(gbcollect_step_shared)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    ck_assert_err_none(do_delete("mure", &file));
+
+    // every slot sharing a moved blob follows it
+    compact(&file, SIZE_MAX);
+    ck_assert_uint_eq(file.metadata[find_slot(&file, "pap")].offset[ORIG_RES],
+                      file.metadata[find_slot(&file, "same")].offset[ORIG_RES]);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "same", DATA_DIR "/papillon.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_gbcollect_test_suite()
+{
+    Suite *s = suite_create("Tests of the garbage collection");
+
+    Add_Test(s, gbcollect_offline);
+    Add_Test(s, gbcollect_step_slides_down);
+    Add_Test(s, gbcollect_step_overlapping);
+    Add_Test(s, gbcollect_step_budget);
+    Add_Test(s, gbcollect_step_shared);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_gbcollect_test_suite)
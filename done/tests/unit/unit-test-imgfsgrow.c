@@ -0,0 +1,149 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define GROWN_MAX_FILES 40
+
+// ======================================================================
+// Creates an imgFS of the given format at dump, with two images right
+// after the metadata, where the larger table goes.
+static void create_filled(const char* dump, uint32_t format, struct imgfs_file* file)
+{
+    create_imgfs(dump, format, "rb+", file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", file);
+}
+
+// ======================================================================
+START_TEST(grow_not_larger)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+
+    ck_assert_err(do_grow(TEST_MAX_FILES, &file), ERR_MAX_FILES);
+    ck_assert_err(do_grow(TEST_MAX_FILES - 1, &file), ERR_MAX_FILES);
+    ck_assert_uint_eq(file.header.max_files, TEST_MAX_FILES);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grow_basic)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_filled(dump, IMGFS_FORMAT_BASIC, &file);
+    const uint32_t version = file.header.version;
+
+    ck_assert_err_none(do_grow(GROWN_MAX_FILES, &file));
+    ck_assert_uint_eq(file.header.max_files, GROWN_MAX_FILES);
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_uint_gt(file.header.version, version);
+
+    // the images in the way were moved past the new table
+    const uint64_t table_end = sizeof(struct imgfs_header) + GROWN_MAX_FILES * sizeof(struct img_metadata);
+    ck_assert_uint_ge(file.metadata[find_slot(&file, "pap")].offset[ORIG_RES], table_end);
+    ck_assert_uint_ge(file.metadata[find_slot(&file, "mure")].offset[ORIG_RES], table_end);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    do_close(&file);
+
+    // as on disk, with room for more images than before
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.header.max_files, GROWN_MAX_FILES);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    for (int i = 0; i < TEST_MAX_FILES; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "coq%d", i);
+        insert_data(DATA_DIR "/coquelicots_small.jpg", img_id, &file);
+    }
+    ck_assert_uint_eq(file.header.nb_files, TEST_MAX_FILES + 2);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grow_indexed)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_filled(dump, IMGFS_FORMAT_INDEXED, &file);
+
+    ck_assert_err_none(do_grow(GROWN_MAX_FILES, &file));
+    ck_assert_uint_eq(file.header.unused_32, IMGFS_FORMAT_INDEXED);
+    ck_assert_uint_eq(file.header.unused_64,
+                      sizeof(struct imgfs_header) + GROWN_MAX_FILES * sizeof(struct img_metadata));
+    do_close(&file);
+
+    // the new on-disk index answers, the metadata are not scanned
+    ck_assert_err_none(do_open_lazy(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.unused_32, IMGFS_FORMAT_INDEXED);
+    const uint32_t slot = index_find_id(&file, "mure", INDEX_NO_SLOT);
+    ck_assert_uint_ne(slot, INDEX_NO_SLOT);
+    ck_assert_str_eq(file.metadata[slot].img_id, "mure");
+    ck_assert_int_eq(index_scanning(&file), 1);
+    ck_assert_uint_eq(index_find_id(&file, "unknown", INDEX_NO_SLOT), INDEX_NO_SLOT);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grow_twice)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_filled(dump, IMGFS_FORMAT_INDEXED, &file);
+
+    ck_assert_err_none(do_grow(TEST_MAX_FILES + 1, &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_err_none(do_grow(GROWN_MAX_FILES, &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open_lazy(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.max_files, GROWN_MAX_FILES);
+    ck_assert_uint_ne(index_find_id(&file, "coq", INDEX_NO_SLOT), INDEX_NO_SLOT);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    check_image(&file, "coq", DATA_DIR "/coquelicots_small.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_grow_test_suite()
+{
+    Suite *s = suite_create("Tests of the growth of the metadata table");
+
+    Add_Test(s, grow_not_larger);
+    Add_Test(s, grow_basic);
+    Add_Test(s, grow_indexed);
+    Add_Test(s, grow_twice);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_grow_test_suite)
@@ -0,0 +1,201 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_rcu.h"
+#include "imgfs_snapshot.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define MURE_SIZE        40861
+
+// ======================================================================
+// Creates an indexed imgFS at dump, with three images.
+static void create_filled(const char* dump)
+{
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_INDEXED, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    do_close(&file);
+}
+
+// ======================================================================
+START_TEST(index_disk_basic)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb", &file);
+    ck_assert_uint_eq(file.header.unused_32, IMGFS_FORMAT_BASIC);
+    ck_assert_uint_eq(index_disk_size(&file.header), 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(index_disk_indexed)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+
+    create_imgfs(dump, IMGFS_FORMAT_INDEXED, "rb", &file);
+    ck_assert_uint_eq(file.header.unused_32, IMGFS_FORMAT_INDEXED);
+    ck_assert_uint_gt(index_disk_size(&file.header), 0);
+    ck_assert_uint_ge(file.header.unused_64,
+                      sizeof(struct imgfs_header) + file.header.max_files * sizeof(struct img_metadata));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(index_find_without_scan)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    create_filled(dump);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open_lazy(dump, "rb", &file));
+
+    // the on-disk index answers, the metadata are not scanned
+    const char* ids[] = { "coq", "pap", "mure" };
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        const uint32_t slot = index_find_id(&file, ids[i], INDEX_NO_SLOT);
+        ck_assert_uint_ne(slot, INDEX_NO_SLOT);
+        ck_assert_str_eq(file.metadata[slot].img_id, ids[i]);
+        ck_assert_int_eq(index_scanning(&file), 1);
+    }
+    ck_assert_uint_eq(index_find_id(&file, "unknown", INDEX_NO_SLOT), INDEX_NO_SLOT);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(index_find_after_delete)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    create_filled(dump);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("mure", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open_lazy(dump, "rb", &file));
+    ck_assert_uint_eq(index_find_id(&file, "mure", INDEX_NO_SLOT), INDEX_NO_SLOT);
+    const uint32_t slot = index_find_id(&file, "coq", INDEX_NO_SLOT);
+    ck_assert_uint_ne(slot, INDEX_NO_SLOT);
+    ck_assert_str_eq(file.metadata[slot].img_id, "coq");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(index_lazy_scan_stops)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    create_filled(dump);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open_lazy(dump, "rb", &file));
+
+    // the content lookup scans, up to the last of the images
+    char image[MURE_SIZE];
+    uint8_t sha[SHA256_DIGEST_LENGTH];
+    read_file(image, DATA_DIR "/mure.jpg", MURE_SIZE);
+    SHA256((const unsigned char*) image, MURE_SIZE, sha);
+    const uint32_t slot = index_find_sha(&file, sha, INDEX_NO_SLOT);
+    ck_assert_uint_ne(slot, INDEX_NO_SLOT);
+    ck_assert_str_eq(file.metadata[slot].img_id, "mure");
+
+    ck_assert_err_none(index_finish_scan(&file));
+    ck_assert_int_eq(index_scanning(&file), 0);
+    ck_assert_uint_ne(index_find_id(&file, "pap", INDEX_NO_SLOT), INDEX_NO_SLOT);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(index_undo_failed_insert)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    do_close(&file);
+
+    // the content is shared and the index only in memory: the header and
+    // metadata writes are the first to fail
+    ck_assert_err_none(do_open_mapped(dump, "rb", &file));
+    ck_assert_err_none(snapshot_build(&file));
+    void* image = NULL;
+    size_t size = 0;
+    read_file_and_size(&image, DATA_DIR "/papillon.jpg", &size);
+    ck_assert_err(do_insert(image, size, "pap2", &file), ERR_IO);
+    free(image);
+
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert(!has_image(&file, "pap2"));
+    ck_assert_uint_eq(index_find_id(&file, "pap2", INDEX_NO_SLOT), INDEX_NO_SLOT);
+    ck_assert_uint_ne(index_find_id(&file, "pap", INDEX_NO_SLOT), INDEX_NO_SLOT);
+
+    // nor is it left in the snapshot
+    const char* view = NULL;
+    uint32_t view_size = 0;
+    int done = 0;
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_err(snapshot_read_view(snapshot_of(&file), "pap2", ORIG_RES, &view, &view_size, &done),
+                  ERR_IMAGE_NOT_FOUND);
+    ck_assert_int_eq(done, 1);
+    ck_assert_err_none(snapshot_read_view(snapshot_of(&file), "pap", ORIG_RES, &view, &view_size, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_uint_eq(view_size, size);
+    rcu_read_exit();
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_index_test_suite()
+{
+    Suite *s = suite_create("Tests of the ID indexes");
+
+    Add_Test(s, index_disk_basic);
+    Add_Test(s, index_disk_indexed);
+    Add_Test(s, index_find_without_scan);
+    Add_Test(s, index_find_after_delete);
+    Add_Test(s, index_lazy_scan_stops);
+    Add_Test(s, index_undo_failed_insert);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_index_test_suite)
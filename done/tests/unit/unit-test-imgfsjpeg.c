@@ -0,0 +1,266 @@
+#include "imgfs_jpeg.h"
+#include "test.h"
+#include <check.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PAPILLON_SIZE 72876
+#define MURE_SIZE     40861
+
+// ======================================================================
+// Writes little-endian numbers, as in a TIFF structure starting with "II".
+static void put_u16(uint8_t* at, uint32_t value)
+{
+    at[0] = (uint8_t) value;
+    at[1] = (uint8_t) (value >> 8);
+}
+
+static void put_u32(uint8_t* at, uint32_t value)
+{
+    put_u16(at, value & 0xFFFF);
+    put_u16(at + 2, value >> 16);
+}
+
+static void put_entry(uint8_t* at, uint32_t tag, uint32_t type, uint32_t value)
+{
+    put_u16(at, tag);
+    put_u16(at + 2, type);
+    put_u32(at + 4, 1);
+    put_u32(at + 8, value);
+}
+
+// ======================================================================
+// A JPEG with an APP1 segment holding EXIF data: IFD0 with the given
+// orientation, IFD1 pointing to a 4-byte thumbnail. Returns its size.
+#define EXIF_TIFF_SIZE 60
+#define EXIF_THUMB_AT  56 // in the TIFF structure
+
+static size_t make_exif_jpeg(uint8_t* buffer, uint32_t orientation)
+{
+    const uint8_t start[] = { 0xFF, 0xD8, 0xFF, 0xE1, 0x00, 6 + EXIF_TIFF_SIZE + 2 };
+    memcpy(buffer, start, sizeof(start));
+    memcpy(buffer + sizeof(start), "Exif\0\0", 6);
+
+    uint8_t* tiff = buffer + sizeof(start) + 6;
+    memset(tiff, 0, EXIF_TIFF_SIZE);
+    memcpy(tiff, "II", 2);
+    put_u16(tiff + 2, 42);
+    put_u32(tiff + 4, 8);                           // IFD0
+    put_u16(tiff + 8, 1);
+    put_entry(tiff + 10, 0x0112, 3, orientation);
+    put_u32(tiff + 22, 26);                         // IFD1
+    put_u16(tiff + 26, 2);
+    put_entry(tiff + 28, 0x0201, 4, EXIF_THUMB_AT);
+    put_entry(tiff + 40, 0x0202, 4, 4);
+    put_u32(tiff + 52, 0);                          // no IFD2
+    const uint8_t thumbnail[] = { 0xFF, 0xD8, 0xFF, 0xD9 };
+    memcpy(tiff + EXIF_THUMB_AT, thumbnail, sizeof(thumbnail));
+
+    uint8_t* end = tiff + EXIF_TIFF_SIZE;
+    end[0] = 0xFF;
+    end[1] = 0xD9;
+    return (size_t) (end + 2 - buffer);
+}
+
+// ======================================================================
+// A JPEG with an APP0 segment, then a frame header (SOF0) of the given size.
+static const uint8_t frame_jpeg[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE0, 0x00, 0x04, 0x00, 0x00,             // APP0, empty
+    0xFF, 0xFF, 0xC0, 0x00, 0x0B, 0x08,             // SOF0 (after padding), 8 bits
+    0x01, 0xE0, 0x02, 0x80,                         // 480 x 640
+    0x01, 0x01, 0x11, 0x00,                         // one component
+    0xFF, 0xDA                                      // start of scan
+};
+
+// ======================================================================
+START_TEST(jpeg_dimensions_null_params)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+    const char* jpeg = (const char*) frame_jpeg;
+
+    ck_assert_int_eq(jpeg_dimensions(NULL, sizeof(frame_jpeg), &height, &width), 0);
+    ck_assert_int_eq(jpeg_dimensions(jpeg, sizeof(frame_jpeg), NULL, &width), 0);
+    ck_assert_int_eq(jpeg_dimensions(jpeg, sizeof(frame_jpeg), &height, NULL), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_dimensions_frame_header)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+    ck_assert_int_eq(jpeg_dimensions((const char*) frame_jpeg, sizeof(frame_jpeg), &height, &width), 1);
+    ck_assert_uint_eq(height, 480);
+    ck_assert_uint_eq(width, 640);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_dimensions_malformed)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+    uint8_t jpeg[sizeof(frame_jpeg)];
+
+    // cut in the middle of the frame header
+    ck_assert_int_eq(jpeg_dimensions((const char*) frame_jpeg, 16, &height, &width), 0);
+
+    // not a JPEG
+    memcpy(jpeg, frame_jpeg, sizeof(jpeg));
+    jpeg[1] = 0xD9;
+    ck_assert_int_eq(jpeg_dimensions((const char*) jpeg, sizeof(jpeg), &height, &width), 0);
+
+    // a height only given after the first scan
+    memcpy(jpeg, frame_jpeg, sizeof(jpeg));
+    jpeg[14] = 0;
+    jpeg[15] = 0;
+    ck_assert_int_eq(jpeg_dimensions((const char*) jpeg, sizeof(jpeg), &height, &width), 0);
+
+    // a segment longer than the buffer
+    memcpy(jpeg, frame_jpeg, sizeof(jpeg));
+    jpeg[5] = 0xFF;
+    ck_assert_int_eq(jpeg_dimensions((const char*) jpeg, sizeof(jpeg), &height, &width), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_dimensions_images)
+{
+    start_test_print;
+
+    char image[PAPILLON_SIZE];
+    uint32_t height = 0, width = 0;
+
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+    ck_assert_int_eq(jpeg_dimensions(image, PAPILLON_SIZE, &height, &width), 1);
+    ck_assert_uint_eq(width, 1200);
+    ck_assert_uint_eq(height, 800);
+
+    read_file(image, DATA_DIR "/mure.jpg", MURE_SIZE);
+    ck_assert_int_eq(jpeg_dimensions(image, MURE_SIZE, &height, &width), 1);
+    ck_assert_uint_eq(width, 640);
+    ck_assert_uint_eq(height, 455);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_exif_thumbnail_found)
+{
+    start_test_print;
+
+    uint8_t jpeg[128];
+    const size_t size = make_exif_jpeg(jpeg, 1);
+    const char* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) jpeg, size, &thumbnail, &thumbnail_size), 1);
+    ck_assert_ptr_eq(thumbnail, jpeg + 12 + EXIF_THUMB_AT);
+    ck_assert_uint_eq(thumbnail_size, 4);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_exif_thumbnail_rotated)
+{
+    start_test_print;
+
+    uint8_t jpeg[128];
+    const size_t size = make_exif_jpeg(jpeg, 6);
+    const char* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) jpeg, size, &thumbnail, &thumbnail_size), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_exif_thumbnail_malformed)
+{
+    start_test_print;
+
+    uint8_t jpeg[128];
+    const char* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+
+    // no EXIF data at all
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) frame_jpeg, sizeof(frame_jpeg),
+                                         &thumbnail, &thumbnail_size), 0);
+
+    // a thumbnail reaching past the EXIF data
+    size_t size = make_exif_jpeg(jpeg, 1);
+    put_u32(jpeg + 12 + 48, 5);
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) jpeg, size, &thumbnail, &thumbnail_size), 0);
+
+    // a thumbnail which is not a JPEG
+    size = make_exif_jpeg(jpeg, 1);
+    jpeg[12 + EXIF_THUMB_AT + 1] = 0;
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) jpeg, size, &thumbnail, &thumbnail_size), 0);
+
+    // an unknown byte order
+    size = make_exif_jpeg(jpeg, 1);
+    memcpy(jpeg + 12, "XX", 2);
+    ck_assert_int_eq(jpeg_exif_thumbnail((const char*) jpeg, size, &thumbnail, &thumbnail_size), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_exif_thumbnail_images)
+{
+    start_test_print;
+
+    char image[PAPILLON_SIZE];
+    const char* thumbnail = NULL;
+    size_t thumbnail_size = 0;
+    uint32_t height = 0, width = 0;
+
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+    ck_assert_int_eq(jpeg_exif_thumbnail(image, PAPILLON_SIZE, &thumbnail, &thumbnail_size), 1);
+    ck_assert_uint_eq(thumbnail_size, 3818);
+    ck_assert(thumbnail > image && thumbnail + thumbnail_size <= image + PAPILLON_SIZE);
+
+    // the thumbnail is a JPEG of its own, smaller than the image
+    ck_assert_int_eq(jpeg_dimensions(thumbnail, thumbnail_size, &height, &width), 1);
+    ck_assert_uint_lt(width, 1200);
+    ck_assert_uint_lt(height, 800);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_jpeg_test_suite()
+{
+    Suite *s = suite_create("Tests of the JPEG and EXIF parser");
+
+    Add_Test(s, jpeg_dimensions_null_params);
+    Add_Test(s, jpeg_dimensions_frame_header);
+    Add_Test(s, jpeg_dimensions_malformed);
+    Add_Test(s, jpeg_dimensions_images);
+    Add_Test(s, jpeg_exif_thumbnail_found);
+    Add_Test(s, jpeg_exif_thumbnail_rotated);
+    Add_Test(s, jpeg_exif_thumbnail_malformed);
+    Add_Test(s, jpeg_exif_thumbnail_images);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_jpeg_test_suite)
@@ -0,0 +1,190 @@
+#include "image_content.h"
+#include "imgfs.h"
+#include "imgfs_io.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// ======================================================================
+// The offset of a variant of an image.
+static uint64_t offset_of(const struct imgfs_file* file, const char* img_id, int resolution)
+{
+    const uint32_t slot = find_slot(file, img_id);
+    ck_assert_uint_lt(slot, file->header.max_files);
+    return file->metadata[slot].offset[resolution];
+}
+
+// ======================================================================
+START_TEST(refs_shared_until_last)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t shared = offset_of(&file, "pap", ORIG_RES);
+    ck_assert_uint_eq(offset_of(&file, "same", ORIG_RES), shared);
+
+    // the content stays as long as one image refers to it
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_ne(offset_of(&file, "coq", ORIG_RES), shared);
+    check_image(&file, "same", DATA_DIR "/papillon.jpg");
+
+    // and goes with the last one
+    ck_assert_err_none(do_delete("same", &file));
+    insert_data(DATA_DIR "/papillon_small.jpg", "pap_small", &file);
+    ck_assert_uint_eq(offset_of(&file, "pap_small", ORIG_RES), shared);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(refs_after_reopen)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t shared = offset_of(&file, "pap", ORIG_RES);
+    do_close(&file);
+
+    // the references are counted again from the metadata
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_ne(offset_of(&file, "coq", ORIG_RES), shared);
+    check_image(&file, "same", DATA_DIR "/papillon.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(refs_content_dedup_after_delete)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", &file);
+    const uint64_t shared = offset_of(&file, "pap", ORIG_RES);
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+
+    // a new copy of the content still finds the remaining one
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/papillon.jpg", "again", &file);
+    ck_assert_uint_eq(offset_of(&file, "again", ORIG_RES), shared);
+    uint64_t new_size = 0;
+    ck_assert_err_none(io_size(file.file, &new_size));
+    ck_assert_uint_eq(new_size, size);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(refs_variant_shared)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+
+    ck_assert_err_none(lazily_resize(SMALL_RES, &file, find_slot(&file, "pap")));
+    const uint64_t variant = offset_of(&file, "pap", SMALL_RES);
+    ck_assert_uint_ne(variant, 0);
+    uint64_t size = 0;
+    ck_assert_err_none(io_size(file.file, &size));
+
+    // the image of the same content takes the variant computed for the other one
+    ck_assert_err_none(lazily_resize(SMALL_RES, &file, find_slot(&file, "same")));
+    ck_assert_uint_eq(offset_of(&file, "same", SMALL_RES), variant);
+    uint64_t new_size = 0;
+    ck_assert_err_none(io_size(file.file, &new_size));
+    ck_assert_uint_eq(new_size, size);
+    do_close(&file);
+
+    // as on disk
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(offset_of(&file, "same", SMALL_RES), variant);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(refs_variant_kept_on_delete)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_data(DATA_DIR "/papillon.jpg", "same", &file);
+    ck_assert_err_none(lazily_resize(THUMB_RES, &file, find_slot(&file, "pap")));
+    ck_assert_err_none(lazily_resize(THUMB_RES, &file, find_slot(&file, "same")));
+    const uint64_t variant = offset_of(&file, "same", THUMB_RES);
+
+    char* before = NULL;
+    uint32_t before_size = 0;
+    ck_assert_err_none(do_read("same", THUMB_RES, &before, &before_size, &file));
+
+    // the variant stays with the remaining image, and its room is not reused
+    ck_assert_err_none(do_delete("pap", &file));
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    ck_assert_uint_ne(offset_of(&file, "coq", ORIG_RES), variant);
+
+    char* after = NULL;
+    uint32_t after_size = 0;
+    ck_assert_err_none(do_read("same", THUMB_RES, &after, &after_size, &file));
+    ck_assert_uint_eq(after_size, before_size);
+    ck_assert_int_eq(memcmp(after, before, after_size), 0);
+    free(before);
+    free(after);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_refs_test_suite()
+{
+    Suite *s = suite_create("Tests of the blobs shared by several images");
+
+    Add_Test(s, refs_shared_until_last);
+    Add_Test(s, refs_after_reopen);
+    Add_Test(s, refs_content_dedup_after_delete);
+    Add_Test(s, refs_variant_shared);
+    Add_Test(s, refs_variant_kept_on_delete);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_refs_test_suite)
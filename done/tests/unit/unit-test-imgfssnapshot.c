@@ -0,0 +1,224 @@
+#include "imgfs.h"
+#include "imgfs_rcu.h"
+#include "imgfs_snapshot.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// ======================================================================
+// Reads the original of an image from the snapshot alone, in a read
+// section, and checks it is the content of a file.
+static void check_view(const struct imgfs_snapshot* snapshot, const char* img_id, const char* filename)
+{
+    void* expected = NULL;
+    size_t expected_size = 0;
+    read_file_and_size(&expected, filename, &expected_size);
+
+    ck_assert_err_none(rcu_read_enter());
+    const char* view = NULL;
+    uint32_t size = 0;
+    int done = 0;
+    ck_assert_err_none(snapshot_read_view(snapshot, img_id, ORIG_RES, &view, &size, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_uint_eq(size, expected_size);
+    ck_assert_int_eq(memcmp(view, expected, size), 0);
+    rcu_read_exit();
+
+    free(expected);
+}
+
+// Creates an imgFS at dump with two images, and opens it mapped.
+static void open_filled(const char* dump, const char* mode, struct imgfs_file* file)
+{
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb+", file);
+    insert_data(DATA_DIR "/papillon.jpg", "pap", file);
+    insert_data(DATA_DIR "/mure.jpg", "mure", file);
+    do_close(file);
+    ck_assert_err_none(do_open_mapped(dump, mode, file));
+}
+
+// ======================================================================
+START_TEST(snapshot_only_mapped)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, "rb", &file);
+    ck_assert_ptr_null(snapshot_of(&file));
+    ck_assert_invalid_arg(snapshot_build(&file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open_mapped(dump, "rb", &file));
+    ck_assert_ptr_nonnull(snapshot_of(&file));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_read)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_filled(dump, "rb", &file);
+    const struct imgfs_snapshot* snapshot = snapshot_of(&file);
+
+    // nothing is answered before the table is built
+    ck_assert_err_none(rcu_read_enter());
+    const char* view = NULL;
+    uint32_t size = 0;
+    int done = 1;
+    ck_assert_err_none(snapshot_read_view(snapshot, "pap", ORIG_RES, &view, &size, &done));
+    ck_assert_int_eq(done, 0);
+    rcu_read_exit();
+
+    ck_assert_err_none(snapshot_build(&file));
+    check_view(snapshot, "pap", DATA_DIR "/papillon.jpg");
+    check_view(snapshot, "mure", DATA_DIR "/mure.jpg");
+
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_err(snapshot_read_view(snapshot, "unknown", ORIG_RES, &view, &size, &done), ERR_IMAGE_NOT_FOUND);
+    ck_assert_int_eq(done, 1);
+    ck_assert_err(snapshot_read_view(snapshot, "pap", NB_RES, &view, &size, &done), ERR_RESOLUTIONS);
+    ck_assert_int_eq(done, 1);
+
+    // a variant still to compute goes through the metadata
+    ck_assert_err_none(snapshot_read_view(snapshot, "pap", THUMB_RES, &view, &size, &done));
+    ck_assert_int_eq(done, 0);
+    rcu_read_exit();
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_follows_changes)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_filled(dump, "rb+", &file);
+    const struct imgfs_snapshot* snapshot = snapshot_of(&file);
+    ck_assert_err_none(snapshot_build(&file));
+
+    // deleted, the image is no longer found
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_err_none(rcu_read_enter());
+    const char* view = NULL;
+    uint32_t size = 0;
+    int done = 0;
+    ck_assert_err(snapshot_read_view(snapshot, "pap", ORIG_RES, &view, &size, &done), ERR_IMAGE_NOT_FOUND);
+    ck_assert_int_eq(done, 1);
+    rcu_read_exit();
+
+    // inserted, it is found once mapped
+    insert_data(DATA_DIR "/coquelicots_small.jpg", "coq", &file);
+    const char* mapped = NULL;
+    ck_assert_err_none(do_read_view("coq", ORIG_RES, &mapped, &size, &file));
+    check_view(snapshot, "coq", DATA_DIR "/coquelicots_small.jpg");
+
+    // a new variant is answered as well
+    ck_assert_err_none(do_read_view("mure", THUMB_RES, &mapped, &size, &file));
+    ck_assert_err_none(rcu_read_enter());
+    uint32_t thumb_size = 0;
+    ck_assert_err_none(snapshot_read_view(snapshot, "mure", THUMB_RES, &view, &thumb_size, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_uint_eq(thumb_size, size);
+    ck_assert_int_eq(memcmp(view, mapped, size), 0);
+    rcu_read_exit();
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_view_kept_for_readers)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_filled(dump, "rb+", &file);
+    const struct imgfs_snapshot* snapshot = snapshot_of(&file);
+    ck_assert_err_none(snapshot_build(&file));
+
+    void* expected = NULL;
+    size_t expected_size = 0;
+    read_file_and_size(&expected, DATA_DIR "/papillon.jpg", &expected_size);
+
+    // a reader that got the view before the image was deleted still reads it
+    ck_assert_err_none(rcu_read_enter());
+    const char* view = NULL;
+    uint32_t size = 0;
+    int done = 0;
+    ck_assert_err_none(snapshot_read_view(snapshot, "pap", ORIG_RES, &view, &size, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_uint_eq(size, expected_size);
+    ck_assert_int_eq(memcmp(view, expected, size), 0);
+    rcu_read_exit();
+
+    free(expected);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_list_current)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    open_filled(dump, "rb+", &file);
+    const struct imgfs_snapshot* snapshot = snapshot_of(&file);
+    ck_assert_err_none(snapshot_build(&file));
+
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_ptr_null(snapshot_list(snapshot));
+    rcu_read_exit();
+
+    ck_assert_err_none(snapshot_set_list(&file, "listing"));
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_str_eq(snapshot_list(snapshot), "listing");
+    rcu_read_exit();
+
+    // any change makes it out of date
+    ck_assert_err_none(do_delete("mure", &file));
+    ck_assert_err_none(rcu_read_enter());
+    ck_assert_ptr_null(snapshot_list(snapshot));
+    rcu_read_exit();
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_snapshot_test_suite()
+{
+    Suite *s = suite_create("Tests of the snapshots for readers without lock");
+
+    Add_Test(s, snapshot_only_mapped);
+    Add_Test(s, snapshot_read);
+    Add_Test(s, snapshot_follows_changes);
+    Add_Test(s, snapshot_view_kept_for_readers);
+    Add_Test(s, snapshot_list_current);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_snapshot_test_suite)
@@ -0,0 +1,94 @@
+#include "imgfs.h"
+#include "imgfs_rcu.h"
+#include "imgfs_state.h"
+#include "test.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// ======================================================================
+START_TEST(state_attach_detach)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+    file.file = tmpfile();
+    ck_assert_ptr_nonnull(file.file);
+
+    struct imgfs_state* state = NULL;
+    ck_assert_err_none(state_attach(&file, &state));
+    ck_assert_ptr_eq(state_of(&file), state);
+    ck_assert_ptr_eq(state->file, file.file);
+
+    state_detach(&file);
+    ck_assert_ptr_null(state_of(&file));
+
+    fclose(file.file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(state_kept_for_readers)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+    file.file = tmpfile();
+    ck_assert_ptr_nonnull(file.file);
+
+    struct imgfs_state* state = NULL;
+    ck_assert_err_none(state_attach(&file, &state));
+
+    // a reader that found the state before it was detached still uses it
+    ck_assert_err_none(rcu_read_enter());
+    const struct imgfs_state* seen = state_of(&file);
+    ck_assert_ptr_eq(seen, state);
+    state_detach(&file);
+    ck_assert_ptr_null(state_of(&file));
+    ck_assert_ptr_eq(seen->file, file.file);
+    rcu_read_exit();
+
+    rcu_barrier();
+    fclose(file.file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(state_released_on_close)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_LATEST, NULL, &file);
+
+    ck_assert_err_none(do_open_mapped(dump, "rb", &file));
+    struct imgfs_file closed = file;
+    ck_assert_ptr_nonnull(state_of(&closed));
+    do_close(&file);
+    ck_assert_ptr_null(state_of(&closed));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_state_test_suite()
+{
+    Suite *s = suite_create("Tests of the run-time state of an open imgFS");
+
+    Add_Test(s, state_attach_detach);
+    Add_Test(s, state_kept_for_readers);
+    Add_Test(s, state_released_on_close);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_state_test_suite)
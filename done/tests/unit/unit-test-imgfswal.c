@@ -0,0 +1,220 @@
+#include "imgfs.h"
+#include "imgfs_wal.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vips/vips.h>
+
+// ======================================================================
+// Inserts an image of the data directory, and waits for it to be durable.
+static void insert_durable(const char* name, const char* img_id, struct imgfs_file* file)
+{
+    insert_data(name, img_id, file);
+    ck_assert_err_none(wal_sync(file, wal_position(file)));
+}
+
+// Copies an imgFS and its log as they are on disk, as a crash would leave them.
+static void crash_copy(const char* dst, const char* src)
+{
+    char dst_wal[4200] = {0};
+    char src_wal[4200] = {0};
+    snprintf(dst_wal, sizeof(dst_wal), "%s.wal", dst);
+    snprintf(src_wal, sizeof(src_wal), "%s.wal", src);
+    DUPLICATE_FILE(dst, src);
+    DUPLICATE_FILE(dst_wal, src_wal);
+    ck_assert_int_eq(access(dst_wal, F_OK), 0);
+}
+
+// The header as written in place.
+static void read_header(const char* dump, struct imgfs_header* header)
+{
+    read_file(header, dump, sizeof(*header));
+}
+
+// ======================================================================
+START_TEST(wal_replay_writable)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_crash);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    ck_assert_err_none(wal_start(&file, dump));
+    ck_assert_int_eq(wal_active(&file), 1);
+
+    insert_durable(DATA_DIR "/papillon.jpg", "pap", &file);
+    crash_copy(dump_crash, dump);
+    do_close(&file);
+
+    // the change is only in the log
+    struct imgfs_header header;
+    read_header(dump_crash, &header);
+    ck_assert_uint_eq(header.nb_files, 0);
+
+    // replayed, written in place, and the log removed
+    ck_assert_err_none(do_open(dump_crash, "rb+", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert(has_image(&file, "pap"));
+    do_close(&file);
+
+    char wal[4200] = {0};
+    snprintf(wal, sizeof(wal), "%s.wal", dump_crash);
+    ck_assert_int_ne(access(wal, F_OK), 0);
+    read_header(dump_crash, &header);
+    ck_assert_uint_eq(header.nb_files, 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(wal_replay_read_only)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_crash);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    ck_assert_err_none(wal_start(&file, dump));
+
+    insert_durable(DATA_DIR "/papillon.jpg", "pap", &file);
+    crash_copy(dump_crash, dump);
+    do_close(&file);
+
+    // replayed in memory only, the log is kept
+    ck_assert_err_none(do_open(dump_crash, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert(has_image(&file, "pap"));
+    do_close(&file);
+
+    struct imgfs_header header;
+    read_header(dump_crash, &header);
+    ck_assert_uint_eq(header.nb_files, 0);
+    char wal[4200] = {0};
+    snprintf(wal, sizeof(wal), "%s.wal", dump_crash);
+    ck_assert_int_eq(access(wal, F_OK), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(wal_replay_delete)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_crash);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    insert_durable(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_durable(DATA_DIR "/mure.jpg", "mure", &file);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(wal_start(&file, dump));
+    ck_assert_err_none(do_delete("pap", &file));
+    ck_assert_err_none(wal_sync(&file, wal_position(&file)));
+    crash_copy(dump_crash, dump);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump_crash, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert(!has_image(&file, "pap"));
+    ck_assert(has_image(&file, "mure"));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(wal_replay_torn_record)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_crash);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    ck_assert_err_none(wal_start(&file, dump));
+
+    insert_durable(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_durable(DATA_DIR "/mure.jpg", "mure", &file);
+    crash_copy(dump_crash, dump);
+    do_close(&file);
+
+    // the last record is cut short by the crash
+    char wal[4200] = {0};
+    snprintf(wal, sizeof(wal), "%s.wal", dump_crash);
+    struct stat st;
+    ck_assert_int_eq(stat(wal, &st), 0);
+    ck_assert_int_eq(truncate(wal, st.st_size - 1), 0);
+
+    ck_assert_err_none(do_open(dump_crash, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert(has_image(&file, "pap"));
+    ck_assert(!has_image(&file, "mure"));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(wal_checkpoint_in_place)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_crash);
+    struct imgfs_file file;
+    create_imgfs(dump, IMGFS_FORMAT_BASIC, "rb+", &file);
+    ck_assert_err_none(wal_start(&file, dump));
+
+    insert_durable(DATA_DIR "/papillon.jpg", "pap", &file);
+    insert_durable(DATA_DIR "/mure.jpg", "mure", &file);
+    ck_assert_err_none(wal_checkpoint(&file));
+
+    // the images are in place, and the log is empty
+    struct imgfs_header header;
+    read_header(dump, &header);
+    ck_assert_uint_eq(header.nb_files, 2);
+    char wal[4200] = {0};
+    snprintf(wal, sizeof(wal), "%s.wal", dump);
+    struct stat st;
+    ck_assert_int_eq(stat(wal, &st), 0);
+    ck_assert_int_eq(st.st_size, 0);
+
+    // a crash from now on finds them without the log
+    crash_copy(dump_crash, dump);
+    do_close(&file);
+    ck_assert_err_none(do_open(dump_crash, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    check_image(&file, "pap", DATA_DIR "/papillon.jpg");
+    check_image(&file, "mure", DATA_DIR "/mure.jpg");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_wal_test_suite()
+{
+    Suite *s = suite_create("Tests of the replay of the write-ahead log");
+
+    Add_Test(s, wal_replay_writable);
+    Add_Test(s, wal_replay_read_only);
+    Add_Test(s, wal_replay_delete);
+    Add_Test(s, wal_replay_torn_record);
+    Add_Test(s, wal_checkpoint_in_place);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_wal_test_suite)
@@ -69,6 +69,8 @@ class Imgfs:
         self.test_name = None
         self.test_iteration = None
 
+        self.curl_count = 0
+
     def _start_test(self, name, attributes):
         """Initializes the library when a test case starts."""
         self.logged_commands = []
@@ -174,7 +176,7 @@ class Imgfs:
 
         return res
 
-    def imgfs_start_server(self, file, port):
+    def imgfs_start_server(self, file, port, *options):
         already_running = False
         try:
             self.telnet.open_connection("localhost", port=port)
@@ -189,10 +191,10 @@ class Imgfs:
         dump = self.copy_dump_file(file)
 
         self.logged_commands.append(
-            shlex.join([f"./{os.path.basename(self.server_executable)}", dump, port])
+            shlex.join([f"./{os.path.basename(self.server_executable)}", dump, port, *options])
         )
 
-        self.server_process = self.process.start_process(self.server_executable, dump, port)
+        self.server_process = self.process.start_process(self.server_executable, dump, port, *options)
 
         timeout = time.time() + 10
         while True:
@@ -224,7 +226,38 @@ class Imgfs:
         self.builtin.should_be_equal_as_integers(curl.rc, 0)
         
         out = open("tmp.txt", "rb").read()
+        self._check_reply(out, expected_err, expected_file, output_file)
+
+    def imgfs_curl_start(self, *args):
+        """
+        Starts curl in the background, so that several requests reach the
+        server at once. The reply is checked by Imgfs Curl Wait.
+        """
+        self.process.process_should_be_running(self.server_process)
+
+        self.logged_commands.append(shlex.join(["curl", "-i", *args]) + " &")
+
+        output = f"tmp{self.curl_count}.txt"
+        self.curl_count += 1
+        return (self.process.start_process("curl", "-i", *args, stdout=output), output)
+
+    def imgfs_curl_wait(self, started, expected_err=None, expected_file=None, output_file=None,
+                        expected_status=None):
+        """
+        Waits for a curl started by Imgfs Curl Start, and checks its reply as
+        Imgfs Curl does. expected_status is the status line expected, e.g. "200 OK".
+        """
+        handle, output = started
+        curl = self.process.wait_for_process(handle)
+        self.builtin.should_be_equal_as_integers(curl.rc, 0)
+
+        out = open(output, "rb").read()
+        if expected_status:
+            self.builtin.should_start_with(out.decode('latin-1'), f"HTTP/1.1 {expected_status}\r\n")
+        self._check_reply(out, expected_err, expected_file, output_file)
+        return out
 
+    def _check_reply(self, out, expected_err, expected_file, output_file):
         if expected_err:
             expected_err_msg = "Error: " + self.errors.get_error_message(expected_err) + '\n'
             self.builtin.should_be_equal_as_strings(out, f"HTTP/1.1 500 Internal Server Error\r\nContent-Length: {len(expected_err_msg)}\r\n\r\n{expected_err_msg}".encode('utf-8'))